@@ -0,0 +1,187 @@
+/*
+ * archive.c - reader for archives of xpvm object files
+ *
+ *             See archive.h for the archive layout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "objread.h"
+#include "archive.h"
+
+// message for the last failure
+static char errbuf[256];
+
+static int setError(const char *fmt, const char *arg)
+{
+  snprintf(errbuf, sizeof errbuf, fmt, arg);
+  return -1;
+}
+
+// checkTables
+//
+// check that every table, name, index and member lies inside the file
+//
+static int checkTables(ar_file *ar)
+{
+  size_t at = 20;
+  unsigned int i, w;
+
+  if (ar->num_buckets == 0 || (ar->num_buckets & (ar->num_buckets - 1)))
+  {
+    return 0;
+  }
+  // the sizes are checked one at a time so the sum can't wrap
+  if (ar->num_members > (ar->size - at) / 12)
+  {
+    return 0;
+  }
+  ar->members = ar->base + at;
+  at += (size_t) ar->num_members * 12;
+  if (ar->num_buckets > (ar->size - at) / 4)
+  {
+    return 0;
+  }
+  ar->buckets = ar->base + at;
+  at += (size_t) ar->num_buckets * 4;
+  if (ar->num_symbols > (ar->size - at) / 12)
+  {
+    return 0;
+  }
+  ar->symbols = ar->base + at;
+  at += (size_t) ar->num_symbols * 12;
+  if (ar->strings_length > ar->size - at ||
+      (ar->strings_length && ar->base[at + ar->strings_length - 1] != 0))
+  {
+    return 0;
+  }
+  ar->strings = (const char *) ar->base + at;
+
+  for (i = 0; i < ar->num_members; i += 1)
+  {
+    const unsigned char *m = ar->members + 12 * i;
+    if (objWord(m) >= ar->strings_length ||
+        objWord(m + 4) > ar->size ||
+        objWord(m + 8) > ar->size - objWord(m + 4))
+    {
+      return 0;
+    }
+  }
+  for (i = 0; i < ar->num_buckets; i += 1)
+  {
+    w = objWord(ar->buckets + 4 * i);
+    if (w != AR_NONE && w >= ar->num_symbols)
+    {
+      return 0;
+    }
+  }
+  for (i = 0; i < ar->num_symbols; i += 1)
+  {
+    const unsigned char *s = ar->symbols + 12 * i;
+    w = objWord(s + 8);
+    if (objWord(s) >= ar->strings_length ||
+        objWord(s + 4) >= ar->num_members ||
+        (w != AR_NONE && w >= ar->num_symbols))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int arOpen(const char *path, ar_file *ar)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  memset(ar, 0, sizeof *ar);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+  {
+    return setError("can't open %s", path);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < 20)
+  {
+    close(fd);
+    return setError("%s is not an xpvm archive", path);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return setError("can't map %s", path);
+  }
+
+  ar->base = map;
+  ar->size = st.st_size;
+  if (objWord(ar->base) != AR_MAGIC)
+  {
+    arClose(ar);
+    return setError("%s: bad magic number", path);
+  }
+  ar->num_members = objWord(ar->base + 4);
+  ar->num_buckets = objWord(ar->base + 8);
+  ar->num_symbols = objWord(ar->base + 12);
+  ar->strings_length = objWord(ar->base + 16);
+  if (!checkTables(ar))
+  {
+    arClose(ar);
+    return setError("%s: truncated or malformed archive", path);
+  }
+  return 0;
+}
+
+void arClose(ar_file *ar)
+{
+  if (ar->base)
+  {
+    munmap((void *) ar->base, ar->size);
+  }
+  memset(ar, 0, sizeof *ar);
+}
+
+const char *arError(void)
+{
+  return errbuf;
+}
+
+int arLookup(const ar_file *ar, const char *name)
+{
+  unsigned int i = objWord(ar->buckets + 4 * (arHash(name) &
+                                               (ar->num_buckets - 1)));
+  unsigned int steps;
+
+  // bounded, in case the chain loops
+  for (steps = 0; i != AR_NONE && steps < ar->num_symbols; steps += 1)
+  {
+    const unsigned char *s = ar->symbols + 12 * i;
+    if (!strcmp(ar->strings + objWord(s), name))
+    {
+      return objWord(s + 4);
+    }
+    i = objWord(s + 8);
+  }
+  return -1;
+}
+
+const char *arMemberName(const ar_file *ar, unsigned int i)
+{
+  return ar->strings + objWord(ar->members + 12 * i);
+}
+
+int arOpenMember(const ar_file *ar, unsigned int i, obj_file *obj)
+{
+  const unsigned char *m = ar->members + 12 * i;
+
+  if (objOpenBuffer(ar->base + objWord(m + 4), objWord(m + 8),
+                    arMemberName(ar, i), obj))
+  {
+    return setError("%s", objError());
+  }
+  return 0;
+}
@@ -0,0 +1,74 @@
+//
+// archive.h - reader for archives of xpvm object files
+//
+// include objread.h first.
+//
+// an archive bundles object files with an index of the blocks they
+// export, so a linker can find the member that defines a block with one
+// hash lookup instead of opening every member. like objread, the
+// archive is mapped read-only and the views point into the mapping.
+//
+// archive layout (all words are 32-bit big endian):
+//
+//   header:  magic (0x58504152, "XPAR"), number of members,
+//            number of index buckets (a power of two), number of
+//            symbols, string table length in bytes
+//   members: name, byte offset of the object file, its size in bytes
+//   buckets: index of the first symbol in the bucket, or AR_NONE
+//   symbols: name, member index, index of the next symbol in the same
+//              bucket, or AR_NONE
+//   strings: NUL terminated strings, padded with NULs to a word
+//   objects: the member object files, each starting on a word
+//
+// names are byte offsets into the string table. a symbol is kept in
+// bucket arHash(name) & (number of buckets - 1).
+//
+
+#define AR_MAGIC 0x58504152
+
+// end of a bucket chain
+#define AR_NONE 0xFFFFFFFF
+
+typedef struct ar_file {
+  const unsigned char *base;         // start of the mapping
+  size_t              size;
+  unsigned int        num_members;
+  unsigned int        num_buckets;
+  unsigned int        num_symbols;
+  const unsigned char *members;      // (name, offset, size) word triples
+  const unsigned char *buckets;
+  const unsigned char *symbols;      // (name, member, next) word triples
+  const char          *strings;
+  unsigned int        strings_length;
+} ar_file;
+
+// map the named archive and check its tables
+//   returns 0 on success, -1 on failure (see arError)
+extern int arOpen(const char *path, ar_file *ar);
+
+// unmap the archive
+extern void arClose(ar_file *ar);
+
+// message describing the last arOpen or arOpenMember failure
+extern const char *arError(void);
+
+// the member exporting the block name, or -1 if none does
+extern int arLookup(const ar_file *ar, const char *name);
+
+// name of member i
+extern const char *arMemberName(const ar_file *ar, unsigned int i);
+
+// index member i in place (see objOpenBuffer)
+//   returns 0 on success, -1 on failure (see arError)
+extern int arOpenMember(const ar_file *ar, unsigned int i, obj_file *obj);
+
+// the index hash, shared with the archive writer
+static inline unsigned int arHash(const char *s)
+{
+  unsigned int h = 5381;
+  while (*s)
+  {
+    h = h * 33 + (unsigned char) *s++;
+  }
+  return h;
+}
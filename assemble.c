@@ -40,20 +40,49 @@ static FILE *fp;
 // running count for number of words to output for object code
 static unsigned int currentLength = 0;
 
+// words of the block being encoded so far (pass 2)
+//   kept apart from currentLength, since with -s the encoder thread
+//   runs while the parser is still counting
+static unsigned int encodeLength = 0;
+
 /* number of block the object file will contain */
 static int num_blocks = 0;
 
+// id of the function new fixups are made from
+static unsigned int refBlock = 0;
+
+// mark sorted handler tables in the annotations (-x)
+int indexHandlers = 0;
+
+// write the line table into the aux data (-g)
+int lineTable = 0;
+
+// source line of the statement pass 1 is given next
+int sourceLine = 0;
+
+// the attributes the attr directives of the function being parsed declare
+static unsigned int pendingAttrs = 0;
+
+static const struct {
+  char *name;
+  unsigned int flag;
+} attrNames[] = {
+  {"leaf",      ANNOT_LEAF},
+  {"nothrow",   ANNOT_NO_THROW},
+  {"nonative",  ANNOT_NO_NATIVE},
+  {"lowregs",   ANNOT_LOW_REGS},
+  {NULL,        0}
+};
+
 // forward references for private symbol table routines
 static void *symtabLookup(char *id);
 static int symtabInstallDefinition(char *id, unsigned int addr);
-static void symtabInstallReference(char *id, unsigned int addr,
-                                   unsigned int format);
+static void symtabInstallReference(char *id, stmt_node *site,
+                                   unsigned int addr, unsigned int format);
 static void symtabInstallExport(char *id);
 static void symtabInstallImport(char *id);
 static void *symtabInitIterator(void);
 static void *symtabNext(void *inIter);
-static void *referenceInitIterator(void *symRec);
-static unsigned int referenceNext(void *inIter, unsigned int *outFormat);
 
 // forward reference to private debug routines
 static void dump_stmt_list( stmt_node *);
@@ -66,21 +95,21 @@ static void printDefinedLabels(void);
 #endif
 
 // forward reference to the private assemble routines
-static int verifyOpcode(char *opcode);
-static int getOpcodeEncoding(char *opcode);
 static void outputWord(int value);
 static unsigned int checkForImportExportErrors(void);
 static void checkForAddressErrors(void);
 static void output_header(void);
-static int encodeAddr20(char*, unsigned int);
-static int encodeAddr16(char*, unsigned int);
+static void outputInsymbols(void);
 static unsigned int fit_in_8(int value);
 static unsigned int fitIn16(int value);
 static unsigned int fitIn20(int value);
+static int addrFits(int disp, unsigned int format);
 static void checkAddr(char*, unsigned int def, unsigned int ref,
                      unsigned int format);
 
 static func_node *func_pass1( char *, handler_node *, stmt_node * );
+static unsigned int block_attrs( func_node *, int trusting );
+static int names_only( INSTR * );
 //static void func_pass2( char * );
 static handler_node *handler_pass1( char *, char *, char * );
 static handler_node *handler_pass2( char *, char *, char * );
@@ -88,7 +117,7 @@ static void dump_funcs( func_node * );
 static void dump_handler_list( handler_node * );
 static void dump_native_ref_list( native_ref_node * );
 
-static void verify_handler_list( handler_node * );
+static void verify_handler_list( func_node * );
 //////////////////////////////////////////////////////////////////////////
 // public entry points
 
@@ -121,6 +150,64 @@ static unsigned int get_blk_id( const char *blk_name )
   return 0;
 }
 
+/*
+ * encode_data
+ *
+ * Output a packed run of data words (format 12): the values are
+ * converted to big endian once and the buffer is written repeat times.
+ */
+static void encode_data( INSTR *instr )
+{
+  unsigned int n = instr->u.format12.num_values;
+  unsigned char *buf = malloc( 4 * n + 1 );
+  unsigned int i;
+
+  if (!buf)
+    fatal("malloc failed in encode_data");
+  for (i = 0; i < n; i += 1)
+  {
+    unsigned int v = instr->u.format12.values[i];
+    buf[4 * i] = v >> 24;
+    buf[4 * i + 1] = v >> 16;
+    buf[4 * i + 2] = v >> 8;
+    buf[4 * i + 3] = v;
+  }
+  for (i = 0; i < instr->u.format12.repeat; i += 1)
+  {
+    if (n && fwrite( buf, 4, n, fp ) != n)
+      fatal("write failed for the object file");
+  }
+  encodeLength += n * instr->u.format12.repeat;
+  free(buf);
+}
+
+// the word of an instruction of each format, from its encoding e, its
+// INSTR i and its label operand x (a PC-relative displacement, or the
+// block id of ldblkid)
+//   the opcode is always the high byte and registers follow it, one
+//   byte each; a format 11 ldimm is encoded as its constant pool load,
+//   ldl/ldd reg, pc, offset to the pool entry. from pc the 8-bit offset
+//   of format 7 is in words, like the branch displacements; from any
+//   other base register it is in bytes
+#define ENCODE_1(e, i, x)   ((unsigned int) (e) << 24)
+#define ENCODE_2(e, i, x)   (ENCODE_1(e, i, x) | ((x) & 0xFFFFF))
+#define ENCODE_3(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format3.reg << 16)
+#define ENCODE_4(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format4.reg << 16 | \
+                             ((i)->u.format4.constant & 0xFFFF))
+#define ENCODE_5(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format5.reg << 16 | \
+                             ((x) & 0xFFFF))
+#define ENCODE_6(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format6.reg1 << 16 | \
+                             (i)->u.format6.reg2 << 8)
+#define ENCODE_7(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format7.reg1 << 16 | \
+                             (i)->u.format7.reg2 << 8 | \
+                             ((i)->u.format7.const8 & 0xFF))
+#define ENCODE_8(e, i, x)   (ENCODE_1(e, i, x) | (i)->u.format8.reg1 << 16 | \
+                             (i)->u.format8.reg2 << 8 | ((x) & 0xFF))
+#define ENCODE_10(e, i, x)  (ENCODE_1(e, i, x) | (i)->u.format10.reg1 << 16 | \
+                             (i)->u.format10.reg2 << 8 | (i)->u.format10.reg3)
+#define ENCODE_11(e, i, x)  (ENCODE_1(e, i, x) | (i)->u.format11.reg << 16 | \
+                             15 << 8 | ((x) & 0xFF))
+
 static void encode_stmt( stmt_node *stmt )
 {
   // if there is not an instruction then we are done
@@ -129,37 +216,41 @@ static void encode_stmt( stmt_node *stmt )
     return;
   }
 
-  if (!strcmp(stmt->instr->opcode, "ldblkid") && stmt->instr->format == 5 )
+  // packed data goes out in one write per copy
+  if (stmt->instr->format == 12)
   {
-    stmt->instr->format = 4;
-    /* This is a wicked hack :):):) */
-    stmt->instr->u.format4.constant = get_blk_id( stmt->instr->u.format5.addr );
-  } 
-
-  if ( !strcmp(stmt->instr->opcode, "ldnative") )
+    encode_data( stmt->instr );
+    return;
+  }
+  // and included files are copied file to file
+  if (stmt->instr->format == 13)
   {
-    char encodedOpcode = getOpcodeEncoding(stmt->instr->opcode);
-    /* Output the opcode, register and ZERO. This native reference is listed
-     * in the header of the object file and will have the correct const16
-     * filled in by the VM. */
-    outputWord((encodedOpcode << 24) |
-               (stmt->instr->u.format5.reg << 16) |
-               0x0000);
+    incbin_copy( stmt->instr->u.format13.path, stmt->instr->u.format13.offset,
+                 stmt->instr->u.format13.length, fp );
+    encodeLength += stmt_words( stmt->instr );
     return;
   }
 
-  // also can skip the import and export directives
-  if (!strcmp(stmt->instr->opcode, "export") || !strcmp(stmt->instr->opcode, "import"))
+  // the row selected on pass 1; a constant pool load (format 11) is the
+  // ldl/ldd row of its mnemonic
+  INSTR *instr = stmt->instr;
+  int op = opcode_lookup(instr->opcode,
+                         instr->format == 11 ? 7 : instr->format);
+  if (op < 0)
+    bug("no %s row for format %d in encode_stmt", instr->opcode,
+        instr->format);
+
+  // the directives
+  if (op == OP_EXPORT || op == OP_IMPORT || op == OP_ATTR)
   {
+    // these take no space
     return;
   }
-
-  // now handle the remaining directives
-  if (!strcmp(stmt->instr->opcode, "alloc"))
+  if (op == OP_ALLOC)
   {
-    // need to add to currentLength
-    int len = (stmt->instr->u.format9.constant);
-    currentLength += len;
+    // need to add to encodeLength
+    int len = (instr->u.format9.constant);
+    encodeLength += len;
     int i;
     for (i = 0; i < len; i += 1)
     {
@@ -167,74 +258,60 @@ static void encode_stmt( stmt_node *stmt )
     }
     return;
   }
-  if (!strcmp(stmt->instr->opcode, "word"))
+  if (op == OP_WORD)
   {
-    currentLength += 1;
-    outputWord(stmt->instr->u.format9.constant);
+    encodeLength += 1;
+    outputWord(instr->u.format9.constant);
     return;
   }
 
   // now handle the instructions
   // go ahead and count the word to be encoded
-  //   so currentLength will be equal to what PC will be when it executes
-  currentLength += 1;
+  //   so encodeLength will be equal to what PC will be when it executes
+  encodeLength += 1;
 
-  // get the opcode encoding
-  char encodedOpcode = getOpcodeEncoding(stmt->instr->opcode);
+  if (op == OP_LDBLKID)
+  {
+    // the operand is the id of the named block
+    int id;
+    if (streamFuncs)
+    {
+      // a block that isn't parsed yet is patched in by stream_finish
+      id = stream_blk_id( instr->u.format5.addr, ftell( fp ),
+                          ENCODE_5(opcodes[op].encoding, instr, 0) );
+    }
+    else
+      id = get_blk_id( instr->u.format5.addr );
+    outputWord(ENCODE_5(opcodes[op].encoding, instr, id));
+    return;
+  }
+  if (op == OP_LDNATIVE)
+  {
+    /* Output the opcode, register and ZERO. This native reference is listed
+     * in the header of the object file and will have the correct const16
+     * filled in by the VM. */
+    outputWord(ENCODE_5(opcodes[op].encoding, instr, 0));
+    return;
+  }
+  if (instr->format == 11)
+  {
+    outputWord(ENCODE_11(opcodes[op].encoding, instr, stmt->disp));
+    return;
+  }
 
-  // now handle the different instruction formats
-  int encodedAddr;
-  switch (stmt->instr->format)
+  // one case per instruction, each encoding by its own format; label
+  // operands were resolved into stmt->disp between the passes
+  switch (op)
   {
-    case 1:
-      outputWord(encodedOpcode);
-      break;
-    case 2:
-      encodedAddr = encodeAddr20(stmt->instr->u.format2.addr, currentLength);
-      outputWord((encodedAddr << 12) |
-                 (encodedOpcode));
-      break;
-    case 3:
-      outputWord((stmt->instr->u.format3.reg << 16) |
-                 (encodedOpcode << 24));
-      break;
-    case 4:
-      outputWord((stmt->instr->u.format4.constant & 0xFFFF) |
-                 (stmt->instr->u.format4.reg << 16) |
-                 (encodedOpcode << 24));
-      break;
-    case 5:
-      encodedAddr = encodeAddr20(stmt->instr->u.format5.addr, currentLength);
-      outputWord((encodedAddr << 12) |
-                 (stmt->instr->u.format5.reg << 8) |
-                 (encodedOpcode));
-      break;
-    case 6:
-      outputWord((encodedOpcode << 24) |
-                 (stmt->instr->u.format6.reg1 << 16) |
-                 (stmt->instr->u.format6.reg2 << 8));
-      break;
-    case 7:
-      outputWord((encodedOpcode << 24) |
-                 (stmt->instr->u.format7.reg1 << 16) |
-                 (stmt->instr->u.format7.reg2 << 8) |
-                 (stmt->instr->u.format7.const8));
-      break;
-    case 8:
-      encodedAddr = encodeAddr16(stmt->instr->u.format8.addr, currentLength);
-      outputWord((encodedOpcode << 24) |
-                 (stmt->instr->u.format8.reg1 << 16) |
-                 (stmt->instr->u.format8.reg2 << 8) |
-                 (encodedAddr));
-      break;
-    case 10:
-      outputWord((encodedOpcode << 24) |
-                 (stmt->instr->u.format10.reg1 << 16) |
-                 (stmt->instr->u.format10.reg2 << 8) |
-                 (stmt->instr->u.format10.reg3));
+#define OP(id, mnemonic, format, encoding) \
+    case OP_##id: \
+      outputWord(ENCODE_##format(encoding, instr, stmt->disp)); \
       break;
+#define DIR(id, mnemonic, format) \
+    case OP_##id:
+#include "isa.def"
     default:
-      bug("unexpected format (%d) seen in encode_stmt", stmt->instr->format);
+      bug("unexpected opcode %s seen in encode_stmt", instr->opcode);
   }
 
 }
@@ -249,73 +326,389 @@ void encode_stmt_list( stmt_node *stmt_list )
   }
 }
 
-void encode_handler( handler_node *handler )
+// a handler table entry, by address
+struct handler_range {
+  int start;
+  int end;
+  int handle;
+};
+
+// a block reference by name, for the outsymbol table
+struct outsym_ref {
+  char *name;
+  unsigned int addr;
+};
+
+static int compare_addrs( const void *a, const void *b )
 {
-  outputWord( handler->start_addr*4 );
-  outputWord( handler->end_addr*4 );
-  outputWord( handler->handle_addr*4 );
+  int x = *(const int *) a;
+  int y = *(const int *) b;
+  return x < y ? -1 : x > y;
 }
 
-void encode_handler_list( handler_node *handler_list )
+/*
+ * normalize_handlers
+ *
+ * Rewrite the handler table into ranges that are sorted by start and
+ * don't overlap, keeping what a first match search in declaration order
+ * finds for every address: each interval between two range boundaries
+ * goes to the first handler that covers it, and neighbouring intervals
+ * with the same handler are merged. Empty ranges disappear.
+ * Returns the number of ranges, which are put in *out.
+ */
+static unsigned int normalize_handlers( func_node *func,
+                                        struct handler_range **out )
 {
-  handler_node *walk = handler_list;
-  while (walk)
+  unsigned int num_bounds = 0, num_ranges = 0, i, j;
+  handler_node *walk;
+  int *bounds;
+
+  *out = NULL;
+  if (!func->num_handlers)
+    return 0;
+  bounds = malloc( 2 * func->num_handlers * sizeof *bounds );
+  *out = malloc( 2 * func->num_handlers * sizeof **out );
+  if (!bounds || !*out)
+    fatal("malloc failed in normalize_handlers");
+
+  for (walk = func->handler_list; walk; walk = walk->link)
   {
-    encode_handler(walk);
-    walk = walk->link;
+    bounds[num_bounds++] = walk->start_addr;
+    bounds[num_bounds++] = walk->end_addr;
+  }
+  qsort( bounds, num_bounds, sizeof *bounds, compare_addrs );
+
+  for (i = 0; i + 1 < num_bounds; i += 1)
+  {
+    if (bounds[i] == bounds[i + 1])
+      continue;
+    for (walk = func->handler_list; walk; walk = walk->link)
+    {
+      if (walk->start_addr <= bounds[i] && bounds[i] < walk->end_addr)
+        break;
+    }
+    if (!walk)
+      continue;
+    j = num_ranges;
+    if (j && (*out)[j - 1].end == bounds[i] &&
+        (*out)[j - 1].handle == walk->handle_addr)
+    {
+      (*out)[j - 1].end = bounds[i + 1];
+      continue;
+    }
+    (*out)[j].start = bounds[i];
+    (*out)[j].end = bounds[i + 1];
+    (*out)[j].handle = walk->handle_addr;
+    num_ranges += 1;
   }
+  free(bounds);
+  return num_ranges;
+}
+
+void encode_handler( struct handler_range *range )
+{
+  outputWord( range->start*4 );
+  outputWord( range->end*4 );
+  outputWord( range->handle*4 );
 }
 
-void encode_native_ref( native_ref_node *ref )
+void encode_handler_list( struct handler_range *ranges, unsigned int n )
+{
+  unsigned int i;
+  for (i = 0; i < n; i += 1)
+  {
+    encode_handler( &ranges[i] );
+  }
+}
+
+static int compare_native_refs( const void *a, const void *b )
+{
+  const native_ref_node *x = *(native_ref_node * const *) a;
+  const native_ref_node *y = *(native_ref_node * const *) b;
+  int cmp = strcmp(x->name, y->name);
+  if (cmp)
+    return cmp;
+  return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+/*
+ * encode_native_ref
+ *
+ * Output one entry of the native reference table: the name, the number
+ * of sites that use it and the sites, refs[0..n).
+ */
+void encode_native_ref( native_ref_node **refs, unsigned int n )
 {
-  char *s = ref->name;
-  while( putc( *s++, fp ) );
-  /* *4 to get to the right word and +2 to get to the right byte */
-  outputWord( ref->addr*4 + 2 );
+  unsigned int i;
+  outputWord( strtab_intern( refs[0]->name ) );
+  outputWord( n );
+  for (i = 0; i < n; i += 1)
+  {
+    /* *4 to get to the right word and +2 to get to the right byte */
+    outputWord( refs[i]->addr*4 + 2 );
+  }
 }
 
+/*
+ * encode_native_ref_list
+ *
+ * Output the native reference table, one entry per distinct name, so
+ * the VM resolves each native once however often it is used.
+ */
 void encode_native_ref_list( native_ref_node *native_ref_list )
 {
-  native_ref_node *walk = native_ref_list;
-  while (walk)
+  unsigned int num_refs = native_ref_list_length( native_ref_list );
+  unsigned int num_names = 0, i, j;
+  native_ref_node **refs;
+  native_ref_node *walk;
+
+  refs = malloc( (num_refs ? num_refs : 1) * sizeof *refs );
+  if (!refs)
+    fatal("malloc failed in encode_native_ref_list");
+  for (i = 0, walk = native_ref_list; walk; walk = walk->link)
   {
-    encode_native_ref(walk);
-    walk = walk->link;
+    refs[i++] = walk;
+  }
+  qsort( refs, num_refs, sizeof *refs, compare_native_refs );
+
+  for (i = 0; i < num_refs; i += 1)
+  {
+    num_names += !i || strcmp(refs[i]->name, refs[i - 1]->name);
+  }
+  /* number of native functions referenced */
+  outputWord( num_names );
+  for (i = 0; i < num_refs; i = j)
+  {
+    for (j = i + 1; j < num_refs && !strcmp(refs[j]->name, refs[i]->name);
+         j += 1)
+      ;
+    encode_native_ref( refs + i, j - i );
+  }
+  free(refs);
+}
+
+/*
+ * collect_outsyms
+ *
+ * The outsymbol references of a block: the name and byte offset of
+ * every ldblkid in it. Its const16 holds the id of the block within
+ * this object file (0 for an imported block), so a linker can renumber
+ * the blocks of several objects, and resolve the imports, by name.
+ * Collected before encode_stmt rewrites the ldblkids.
+ */
+static unsigned int collect_outsyms( func_node *func, struct outsym_ref **out )
+{
+  stmt_node *walk;
+  unsigned int addr = 0, n = 0;
+
+  *out = NULL;
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    n += walk->instr->format == 5 &&
+         opcode_lookup(walk->instr->opcode, 5) == OP_LDBLKID;
+  }
+  if (!n)
+    return 0;
+  *out = malloc( n * sizeof **out );
+  if (!*out)
+    fatal("malloc failed in collect_outsyms");
+  for (n = 0, walk = func->stmt_list; walk; walk = walk->link)
+  {
+    if (walk->instr->format == 5 &&
+        opcode_lookup(walk->instr->opcode, 5) == OP_LDBLKID)
+    {
+      (*out)[n].name = walk->instr->u.format5.addr;
+      (*out)[n].addr = addr;
+      n += 1;
+    }
+    addr += stmt_words( walk->instr );
+  }
+  return n;
+}
+
+/*
+ * frame_size
+ *
+ * The number of registers a call of the block needs: one past the
+ * highest register any operand names. Never less than 16, since every
+ * frame holds fp, sp and pc (r13 to r15), which calls and constant pool
+ * loads use without naming them.
+ */
+unsigned int frame_size( func_node *func )
+{
+  stmt_node *walk;
+  unsigned int high = 15;
+
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    INSTR *instr = walk->instr;
+    unsigned int r = 0;
+    switch (instr->format)
+    {
+      case 3:
+        r = instr->u.format3.reg;
+        break;
+      case 4:
+        r = instr->u.format4.reg;
+        break;
+      case 5:
+        r = instr->u.format5.reg;
+        break;
+      case 6:
+      case 7:
+      case 8:
+      case 10:
+        // formats 6, 7, 8 and 10 share the layout of their registers
+        r = instr->u.format10.reg1;
+        if (instr->u.format10.reg2 > r)
+          r = instr->u.format10.reg2;
+        if (instr->format == 10 && instr->u.format10.reg3 > r)
+          r = instr->u.format10.reg3;
+        break;
+      case 11:
+        r = instr->u.format11.reg;
+        break;
+    }
+    if (r > high)
+      high = r;
   }
+  return high + 1;
+}
+
+void encode_outsym_list( struct outsym_ref *refs, unsigned int n )
+{
+  unsigned int i;
+  for (i = 0; i < n; i += 1)
+  {
+    outputWord( strtab_intern( refs[i].name ) );
+    outputWord( refs[i].addr*4 );
+  }
+}
+
+// put value at p as a varint, returning the byte after it
+static unsigned char *put_varint( unsigned char *p, unsigned int value )
+{
+  while (value >= 0x80)
+  {
+    *p++ = (value & 0x7F) | 0x80;
+    value >>= 7;
+  }
+  *p++ = value;
+  return p;
+}
+
+/*
+ * encode_line_table
+ *
+ * The aux data of a block with -g (see lineTable in defs.h), preceded by
+ * its length. An entry is made where a statement with words starts a
+ * line other than the entry before; the statements the assembler made
+ * have no line, and go with the entry before.
+ */
+static void encode_line_table( stmt_node *stmt_list )
+{
+  stmt_node *walk;
+  unsigned int n = 0, addr = 0, lastAddr = 0, length;
+  int lastLine = 0;
+  unsigned char *buf, *p;
+
+  for (walk = stmt_list; walk; walk = walk->link)
+    n += 1;
+  // at most 5 bytes a varint, and the count and padding
+  if (!(buf = malloc( 10 * n + 8 )))
+    fatal("malloc failed in encode_line_table");
+  p = buf + 4;
+  n = 0;
+  for (walk = stmt_list; walk; walk = walk->link)
+  {
+    unsigned int words = stmt_words( walk->instr );
+    if (words && walk->line && walk->line != lastLine)
+    {
+      int delta = walk->line - lastLine;
+      p = put_varint( p, addr - lastAddr );
+      p = put_varint( p, delta < 0 ? ~((unsigned int) delta << 1)
+                                   : (unsigned int) delta << 1 );
+      lastAddr = addr;
+      lastLine = walk->line;
+      n += 1;
+    }
+    addr += words;
+  }
+  buf[0] = n >> 24;
+  buf[1] = n >> 16;
+  buf[2] = n >> 8;
+  buf[3] = n;
+  while ((p - buf) & 3)
+    *p++ = 0;
+  length = p - buf;
+  outputWord( length );
+  if (fwrite( buf, 1, length, fp ) != length)
+    fatal("write failed for the object file");
+  free(buf);
 }
 
 void encode_func( func_node *func )
 {
-  char *name = func->name;
-  while( putc( *name++, fp ) );
+  struct handler_range *ranges;
+  unsigned int num_ranges = normalize_handlers( func, &ranges );
+  struct outsym_ref *outsyms;
+  unsigned int num_outsyms = collect_outsyms( func, &outsyms );
+  // addresses, and so PC-relative offsets, are relative to the block
+  encodeLength = 0;
+  /* name */
+  outputWord( strtab_intern( func->name ) );
   /* annotations */
-  outputWord( 0 );
+  outputWord( (indexHandlers && num_ranges ? ANNOT_SORTED_HANDLERS : 0) |
+              block_attrs( func, 0 ) | func->attrs );
   outputWord( 2 );
   /* frame size */
-  outputWord( 0 );
+  outputWord( frame_size( func ) );
   /* contents length */
   outputWord( func->length*4 );
   encode_stmt_list( func->stmt_list );
   /* number exception handlers */
-  outputWord( func->num_handlers );
-  encode_handler_list( func->handler_list );
+  outputWord( num_ranges );
+  encode_handler_list( ranges, num_ranges );
+  free(ranges);
   /* number outsymbol references */
-  outputWord( 0 );
-  /* number native functions references */
-  outputWord( func->num_native_refs );
+  outputWord( num_outsyms );
+  encode_outsym_list( outsyms, num_outsyms );
+  free(outsyms);
+  /* native function references */
   encode_native_ref_list( func->native_ref_list );
-  /* auxiliary data length */
-  outputWord( 0 );
+  /* auxiliary data length, and the data */
+  if (lineTable)
+    encode_line_table( func->stmt_list );
+  else
+    outputWord( 0 );
 }
 
 void encode_funcs( func_node *func_list )
 {
   func_node *walk = func_list;
+  const char *strings;
+  unsigned int length;
+  long offset;
+
+  // with -s the blocks were encoded as they were parsed
+  if (streamFuncs)
+    stream_finish( fp );
   while (walk)
   {
     encode_func( walk );
     walk = walk->link;
   }
+
+  /* the string table goes last, so names can be added while encoding */
+  offset = ftell( fp );
+  strings = strtab_data( &length );
+  if (length && fwrite( strings, 1, length, fp ) != length)
+    fatal("write failed for the string table");
+  if (fseek( fp, 8, SEEK_SET ))
+    fatal("can't seek back to the object file header");
+  outputWord( offset );
+  outputWord( length );
+  fseek( fp, 0, SEEK_END );
 }
 
 func_node *process_func_list( func_node *node, func_node *list )
@@ -326,12 +719,63 @@ func_node *process_func_list( func_node *node, func_node *list )
     return node;
   }
   else
-    return NULL;
+    return list;
+}
+
+func_node *reverse_func_list( func_node *list )
+{
+  func_node *prev = NULL;
+  while (list)
+  {
+    func_node *next = list->link;
+    list->link = prev;
+    prev = list;
+    list = next;
+  }
+  return prev;
+}
+
+/*
+ * finish_func
+ *
+ * What the func rule does with the function pass 1 built: attach the
+ * native references found in its statements, and with -s encode it.
+ * Returns the function to keep, or NULL.
+ */
+func_node *finish_func( func_node *func )
+{
+  if (func)
+  {
+    func->native_ref_list = native_ref_list;
+    func->num_native_refs = native_ref_list_length( native_ref_list );
+  }
+  // reset the global, which was filled in as native references were
+  //   found during instruction parsing
+  native_ref_list = NULL;
+  // with -s the function is encoded now, not kept
+  return stream_func( func );
+}
+
+/*
+ * finish_program
+ *
+ * The rest of pass 1, once the whole func_list is in (in reverse).
+ */
+void finish_program( func_node *list )
+{
+  if (list)
+  {
+    func_list = reverse_func_list( list );
+    expand_constants( func_list );
+    verify_handlers( func_list );
+  }
 }
 
 func_node *process_func( char *id1, char *id2, handler_node *handler_list, 
                    stmt_node *stmt_list )
 {
+  if (irConvert && currentPass == 1)
+    ir_func( id1, id2 );
   currentLength = 0; 
   if ( strcmp( id1, id2) )
   {
@@ -359,6 +803,8 @@ handler_node *process_handler( char *handle, char *start, char *end )
   switch ( currentPass )
   {
     case 1:
+      if (irConvert)
+        ir_handler( handle, start, end );
       return handler_pass1( handle, start, end );
       break;
     case 2:
@@ -394,6 +840,16 @@ void add_native_ref( unsigned int addr, char *name, native_ref_node **root )
   *root = ref;
 }
 
+// set_output
+//
+// the file encode_func writes to; with -s the encoder thread starts
+// before betweenPasses is called
+//
+void set_output(FILE *outf)
+{
+  fp = outf;
+}
+
 // this is called between passes and provides the assembler the file
 // pointer to use for outputing the object file
 //
@@ -432,12 +888,12 @@ int betweenPasses(FILE *outf)
   // check for errors concerning import and export
   errorCount += checkForImportExportErrors();
 
-  // if no errors, output headers and then insymbol and outsymbol section
+  // if no errors, output headers and then the insymbol section
+  //   (outsymbols are listed with each block)
   if (!errorCount)
   {
     output_header();
-    //outputInsymbols();
-    //outputOutsymbols();
+    outputInsymbols();
   }
 
   // reset currentLength for pass2
@@ -450,6 +906,39 @@ int betweenPasses(FILE *outf)
  * function processing routines                                     *
  ********************************************************************/
 
+/*
+ * names_only
+ *
+ * Is the statement a directive that only names something (export,
+ * import, attr)? Those take no space.
+ */
+static int names_only( INSTR *instr )
+{
+  int op = instr->format == 2 ? opcode_lookup( instr->opcode, 2 ) : -1;
+  return op >= 0 && opcodes[op].encoding == 0xFF;
+}
+
+/*
+ * stmt_words
+ *
+ * Number of words a statement occupies in the block contents,
+ * matching the accounting assemble_pass1 does with currentLength.
+ */
+unsigned int stmt_words( INSTR *instr )
+{
+  if (instr->format == 0)
+    return 0;
+  if (instr->format == 12)
+    return instr->u.format12.num_values * instr->u.format12.repeat;
+  if (instr->format == 13)
+    return (instr->u.format13.length + 3) / 4;
+  if (opcode_lookup(instr->opcode, instr->format) == OP_ALLOC)
+    return instr->u.format9.constant;
+  if (names_only( instr ))
+    return 0;
+  return 1;
+}
+
 unsigned int stmt_list_length( stmt_node *stmt_list )
 {
   unsigned int length = 0;
@@ -457,8 +946,7 @@ unsigned int stmt_list_length( stmt_node *stmt_list )
 
   while (walk)
   {
-    if (walk->instr->format != 0 )
-      length += 1;
+    length += stmt_words( walk->instr );
     walk = walk->link;
   }
 
@@ -493,6 +981,54 @@ unsigned int native_ref_list_length( native_ref_node *native_ref_list )
   return length;
 }
 
+/*
+ * block_attrs
+ *
+ * The attributes (ANNOT_ flags) that hold for a block by what is in it.
+ * When trusting, divisions and calls are taken not to throw, as an attr
+ * nothrow declares.
+ */
+static unsigned int block_attrs( func_node *func, int trusting )
+{
+  unsigned int attrs = ANNOT_LEAF | ANNOT_NO_THROW | ANNOT_NO_NATIVE;
+  unsigned int can_throw = trusting ? 0 : ANNOT_NO_THROW;
+  stmt_node *walk;
+
+  if (func->handler_list)
+    attrs &= ~ANNOT_NO_THROW;
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    INSTR *instr = walk->instr;
+    if (instr->format == 0)
+      continue;
+    switch (opcode_lookup( instr->opcode, instr->format ))
+    {
+      case OP_CALL:
+        attrs &= ~(ANNOT_LEAF | can_throw);
+        break;
+      case OP_CALLN:
+        attrs &= ~(ANNOT_LEAF | ANNOT_NO_NATIVE | can_throw);
+        break;
+      case OP_LDNATIVE:
+        attrs &= ~ANNOT_NO_NATIVE;
+        break;
+      case OP_THROW:
+        attrs &= ~ANNOT_NO_THROW;
+        break;
+      case OP_DIVL:
+      case OP_DIVL_I:
+      case OP_REML:
+      case OP_REML_I:
+      case OP_DIVD:
+        attrs &= ~can_throw;
+        break;
+    }
+  }
+  if (frame_size( func ) == 16)
+    attrs |= ANNOT_LOW_REGS;
+  return attrs;
+}
+
 /*
  * func_pass1
  *
@@ -502,6 +1038,8 @@ static func_node *func_pass1( char *id, handler_node *handler_list,
                               stmt_node *stmt_list )
 {
   func_node *new = calloc( 1, sizeof *new );
+  unsigned int wrong;
+  int i;
   if ( !new )
     fatal("malloc failed in func_pass1");
   /* FIXME: should functions and labels be separate? */
@@ -515,7 +1053,23 @@ static func_node *func_pass1( char *id, handler_node *handler_list,
   new->stmt_list = stmt_list;
   new->length = stmt_list_length( stmt_list );
   new->num_handlers = handler_list_length( handler_list );
+  new->id = num_blocks;
   num_blocks += 1;
+  // a declared attribute that can be seen not to hold is an error;
+  //   nothrow vouches for the divisions and calls
+  new->attrs = pendingAttrs;
+  pendingAttrs = 0;
+  wrong = new->attrs & ~block_attrs( new, 1 );
+  for (i = 0; attrNames[i].name; i += 1)
+  {
+    if (wrong & attrNames[i].flag)
+    {
+      error("function %s is not %s", id, attrNames[i].name);
+      errorCount += 1;
+    }
+  }
+  // the references of the next function are tagged with its id
+  refBlock = num_blocks;
   return new;
 }
 
@@ -639,6 +1193,8 @@ stmt_node *process_stmt( char *label, INSTR *instr )
   switch ( currentPass )
   {
     case 1:
+      if (irConvert)
+        ir_stmt( label, instr );
       return assemble_pass1( label, instr );
       break;
     case 2:
@@ -659,7 +1215,148 @@ stmt_node *process_stmt_list( stmt_node *node, stmt_node *list )
     return node;
   }
   else
+    return list;
+}
+
+stmt_node *reverse_stmt_list( stmt_node *list )
+{
+  stmt_node *prev = NULL;
+  while (list)
+  {
+    stmt_node *next = list->link;
+    list->link = prev;
+    prev = list;
+    list = next;
+  }
+  return prev;
+}
+
+/*
+ * process_data
+ *
+ * Start the packed values of a words or fill directive with its first
+ * two values; process_data_list appends the rest. The array doubles
+ * whenever its length reaches a power of two, so long lists cost one
+ * allocation per doubling rather than per value.
+ */
+INSTR *process_data( char *opcode, int first, int second )
+{
+  INSTR *instr = calloc( 1, sizeof *instr );
+  if (!instr || !(instr->u.format12.values = malloc( 2 * sizeof(int) )))
+    fatal("malloc failed in process_data");
+  instr->format = 12;
+  instr->opcode = opcode;
+  instr->u.format12.values[0] = first;
+  instr->u.format12.values[1] = second;
+  instr->u.format12.num_values = 2;
+  instr->u.format12.repeat = 1;
+  return instr;
+}
+
+INSTR *process_data_list( INSTR *instr, int value )
+{
+  unsigned int n = instr->u.format12.num_values;
+  if (!(n & (n - 1)))
+  {
+    instr->u.format12.values = realloc( instr->u.format12.values,
+                                        2 * n * sizeof(int) );
+    if (!instr->u.format12.values)
+      fatal("malloc failed in process_data_list");
+  }
+  instr->u.format12.values[n] = value;
+  instr->u.format12.num_values = n + 1;
+  return instr;
+}
+
+/*
+ * process_rept
+ *
+ * Fold a rept block into one packed statement. The body was counted
+ * once by pass 1 as it was parsed; the other count - 1 copies are
+ * added here. Only data directives can be repeated, and the body can't
+ * define labels, since each would be defined count times.
+ */
+stmt_node *process_rept( int count, stmt_node *body )
+{
+  stmt_node *walk, *next, *new;
+  unsigned long long total = 0;
+  unsigned int n = 0, i;
+  int *values;
+
+  if (currentPass != 1)
     return NULL;
+  if (irConvert)
+    ir_rept( count, body );
+  for (walk = body; walk; walk = walk->link)
+  {
+    INSTR *instr = walk->instr;
+    if (instr->format == 0)
+    {
+      error("label %s can't be defined inside rept", walk->label);
+      errorCount += 1;
+      return NULL;
+    }
+    if (instr->format != 9 && instr->format != 12)
+    {
+      error("rept can only repeat data directives");
+      errorCount += 1;
+      return NULL;
+    }
+    total += stmt_words( instr );
+  }
+  if (count <= 0)
+  {
+    error("rept count must be greater than zero");
+    errorCount += 1;
+    return NULL;
+  }
+  if (total == 0)
+    return NULL;
+  if (total > 0xFFFFF || total * count > 0xFFFFF)
+  {
+    error("rept block consumes more than 2^20 words");
+    errorCount += 1;
+    return NULL;
+  }
+
+  values = malloc( total * sizeof *values );
+  new = calloc( 1, sizeof *new );
+  if (!values || !new || !(new->instr = calloc( 1, sizeof *new->instr )))
+    fatal("malloc failed in process_rept");
+  // the body is freed below
+  new->line = body->line;
+  for (walk = body; walk; walk = next)
+  {
+    INSTR *instr = walk->instr;
+    next = walk->link;
+    if (instr->format == 9)
+    {
+      unsigned int words = stmt_words( instr );
+      int value = opcode_lookup(instr->opcode, 9) == OP_WORD ?
+                  instr->u.format9.constant : 0;
+      for (i = 0; i < words; i += 1)
+        values[n++] = value;
+    }
+    else
+    {
+      for (i = 0; i < instr->u.format12.repeat; i += 1)
+      {
+        memcpy( values + n, instr->u.format12.values,
+                instr->u.format12.num_values * sizeof *values );
+        n += instr->u.format12.num_values;
+      }
+      free(instr->u.format12.values);
+    }
+    free(instr);
+    free(walk);
+  }
+  new->instr->format = 12;
+  new->instr->opcode = "rept";
+  new->instr->u.format12.values = values;
+  new->instr->u.format12.num_values = n;
+  new->instr->u.format12.repeat = count;
+  currentLength += (count - 1) * n;
+  return new;
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -674,6 +1371,7 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
   stmt_node *new = calloc( 1, sizeof *new );
   new->label = label;
   new->instr = instr;
+  new->line = sourceLine;
   // first handle the label, if one
   if (label && !symtabInstallDefinition(label, currentLength))
   {
@@ -688,26 +1386,37 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
   }
 
   // sanity check for instruction format
-  if (instr->format > 10)
+  if (instr->format > 13)
   {
     bug("bogus format (%d) seen in assemblePass1", instr->format);
   }
 
+  // words with a single value parses like word; make it a list of one
+  if (instr->format == 9 && !strcmp(instr->opcode, "words"))
+  {
+    int value = instr->u.format9.constant;
+    if (!(instr->u.format12.values = malloc( sizeof(int) )))
+      fatal("malloc failed in assemble_pass1");
+    instr->format = 12;
+    instr->u.format12.values[0] = value;
+    instr->u.format12.num_values = 1;
+    instr->u.format12.repeat = 1;
+  }
+
   // if there is an instruction, go ahead and count its word
   //   so currentLength will be equal to what PC will be when it executes
   currentLength += 1;
 
-  // verify the opcode
-  int format = verifyOpcode(instr->opcode);
-  if (format == 0)
+  // verify the opcode, and that it has a variant matching the
+  // structure of the line
+  int op = opcode_lookup(instr->opcode, instr->format);
+  if (op == -1)
   {
     error("unknown opcode");
     errorCount += 1;
     return NULL;
   }
-
-  // does the opcode match the structure of the line?
-  if (format != instr->format)
+  if (op < 0)
   {
     error("opcode does not match the given operands");
     errorCount += 1;
@@ -715,9 +1424,9 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
   }
 
   // first handle the directives which have the special encoding of 0xFF
-  if(getOpcodeEncoding(instr->opcode) == 0xFF)
+  if (opcodes[op].encoding == 0xFF)
   {
-    if (!strcmp(instr->opcode, "alloc"))
+    if (op == OP_ALLOC)
     {
       // need to verify its constant is greater than zero
       if (instr->u.format9.constant <= 0)
@@ -730,23 +1439,105 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
       // need to add to currentLength, remember one has already been added
       currentLength += (instr->u.format9.constant - 1);
     }
-    else if (!strcmp(instr->opcode, "word"))
+    else if (op == OP_WORD)
     {
       // actually nothing to do here!
       //   constant has already been verified to fit in 32 bits
     }
-    else if (!strcmp(instr->opcode, "export"))
+    else if (op == OP_WORDS)
+    {
+      currentLength += instr->u.format12.num_values - 1;
+    }
+    else if (op == OP_FILL)
+    {
+      // fill count, value: one value, repeated
+      if (instr->u.format12.num_values != 2)
+      {
+        error("fill takes a count and a value");
+        errorCount += 1;
+        instr->u.format12.num_values = 0;
+      }
+      else if (instr->u.format12.values[0] <= 0 ||
+               instr->u.format12.values[0] > 0xFFFFF)
+      {
+        error("fill count must be between 1 and 2^20");
+        errorCount += 1;
+        instr->u.format12.num_values = 0;
+      }
+      else
+      {
+        instr->u.format12.repeat = instr->u.format12.values[0];
+        instr->u.format12.values[0] = instr->u.format12.values[1];
+        instr->u.format12.num_values = 1;
+      }
+      currentLength += stmt_words( instr ) - 1;
+    }
+    else if (op == OP_INCBIN)
+    {
+      // the file is only read when it is copied out, so just check the
+      // range here and pin the length down
+      long long size = incbin_file_size( instr->u.format13.path );
+      long long offset = instr->u.format13.offset;
+      long long length = instr->u.format13.length;
+      if (size < 0)
+      {
+        error("can't read %s", instr->u.format13.path);
+        errorCount += 1;
+        length = 0;
+      }
+      else if (offset < 0 || offset > size ||
+               (length >= 0 && length > size - offset))
+      {
+        error("incbin range is outside %s", instr->u.format13.path);
+        errorCount += 1;
+        length = 0;
+      }
+      else if (length < 0)
+      {
+        length = size - offset;
+      }
+      if (length > 4LL * 0xFFFFF)
+      {
+        error("incbin of %s consumes more than 2^20 words",
+              instr->u.format13.path);
+        errorCount += 1;
+        length = 0;
+      }
+      instr->u.format13.length = length;
+      currentLength += stmt_words( instr );
+      currentLength -= 1;
+    }
+    else if (op == OP_EXPORT)
     {
       // this directive takes no space
       currentLength -= 1;
       symtabInstallExport(instr->u.format2.addr);
     }
-    else if (!strcmp(instr->opcode, "import"))
+    else if (op == OP_IMPORT)
     {
       // this directive takes no space
       currentLength -= 1;
       symtabInstallImport(instr->u.format2.addr);
     }
+    else if (op == OP_ATTR)
+    {
+      // this directive takes no space; func_pass1 checks the attribute
+      // holds
+      int i;
+      currentLength -= 1;
+      for (i = 0; attrNames[i].name; i += 1)
+      {
+        if (!strcmp(instr->u.format2.addr, attrNames[i].name))
+          break;
+      }
+      if (attrNames[i].name)
+        pendingAttrs |= attrNames[i].flag;
+      else
+      {
+        error("unknown attribute %s", instr->u.format2.addr);
+        errorCount += 1;
+      }
+    }
     else
     {
       bug("bogus encoding 0xFF for opcode %s", instr->opcode);
@@ -760,23 +1551,36 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
     switch (instr->format)
     {
       case 2:
-        symtabInstallReference(instr->u.format2.addr, currentLength - 1, 2);
+        symtabInstallReference(instr->u.format2.addr, new, currentLength - 1,
+                               2);
         break;
       case 4:
-        if (!fitIn20(instr->u.format4.constant))
+        if (!fitIn16(instr->u.format4.constant))
         {
-          error("constant %d will not fit in 20 bits",
+          if (op == OP_LDIMM)
+          {
+            // too wide for one ldimm, let expand_constants handle it
+            int constant = instr->u.format4.constant;
+            instr->format = 11;
+            instr->u.format11.value = constant;
+            instr->u.format11.is_double = 0;
+            instr->u.format11.pool = NULL;
+            break;
+          }
+          error("constant %d will not fit in 16 bits",
             instr->u.format4.constant);
           errorCount += 1;
         }
         break;
       case 5:
-        if ( !strcmp(instr->opcode, "ldnative") ) {
+        if (op == OP_LDNATIVE) {
           add_native_ref( currentLength - 1, instr->u.format5.addr,
                           &native_ref_list );
           break;
         }
-        symtabInstallReference(instr->u.format5.addr, currentLength - 1, 5);
+        // ldblkid names a block, the others are PC-relative
+        symtabInstallReference(instr->u.format5.addr, new, currentLength - 1,
+                               op == OP_LDBLKID ? 4 : 5);
         break;
       case 7:
         if (!fit_in_8(instr->u.format7.const8))
@@ -787,7 +1591,8 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
         }
         break;
       case 8:
-        symtabInstallReference(instr->u.format8.addr, currentLength - 1, 8);
+        symtabInstallReference(instr->u.format8.addr, new, currentLength - 1,
+                               8);
         break;
     }
   }
@@ -800,216 +1605,20 @@ static stmt_node *assemble_pass1( char *label, INSTR *instr )
 // outputWord
 //
 // puts a word out one byte at a time in little Endian format
-// Switched to big endian for xpvm.
-//
-static void outputWord(int value)
-{
-#if 0
-  putc(value & 0xFF, fp);
-  putc((value >> 8) & 0xFF, fp);
-  putc((value >> 16) & 0xFF, fp);
-  putc((value >> 24) & 0xFF, fp);
-#endif
-  putc((value >> 24) & 0xFF, fp);
-  putc((value >> 16) & 0xFF, fp);
-  putc((value >> 8) & 0xFF, fp);
-  putc(value & 0xFF, fp);
-}
-
-//////////////////////////////////////////////////////////////////////////
-// process opcodes
-//
-// this array defines the opcodes and the directives, providing their
-// instruction format and their encoding. Of course, only instructions
-// have encodings.
-//
-#if 0
-static struct opcodeInfo
-{
-   char*          opcode;
-   int            format;
-   unsigned char  encoding;
-}
-opcodes[] =
-{
-{"halt",    1, 0x00},
-{"load",    5, 0x01},
-{"store",   5, 0x02},
-{"ldimm",   4, 0x03},
-{"ldaddr",  5, 0x04},
-{"ldind",   7, 0x05},
-{"stind",   7, 0x06},
-{"addf",    6, 0x07},
-{"subf",    6, 0x08},
-{"divf",    6, 0x09},
-{"mulf",    6, 0x0A},
-{"addi",    6, 0x0B},
-{"subi",    6, 0x0C},
-{"divi",    6, 0x0D},
-{"muli",    6, 0x0E},
-{"call",    2, 0x0F},
-{"ret",     1, 0x10},
-{"blt",     8, 0x11},
-{"bgt",     8, 0x12},
-{"beq",     8, 0x13},
-{"jmp",     2, 0x14},
-{"cmpxchg", 8, 0x15},
-{"getpid",  3, 0x16},
-{"getpn",   3, 0x17},
-{"push",    3, 0x18},
-{"pop",     3, 0x19},
-{"word",    9, 0xFF},
-{"alloc",   9, 0xFF},
-{"import",  2, 0xFF},
-{"export",  2, 0xFF}
-};
-#endif
-//
-// xpvm opcodes
-//
-#if 1
-static struct opcodeInfo
-{
-   char*          opcode;
-   int            format;
-   unsigned char  encoding;
-}
-opcodes[] =
-{
-{"ldb",                   0, 0x02},
-{"ldb",                   0, 0x03},
-{"lds",                   0, 0x04},
-{"lds",                   0, 0x05},
-{"ldi",                   0, 0x06},
-{"ldi",                   0, 0x07},
-{"ldl",                   0, 0x08},
-{"ldl",                   0, 0x09},
-{"ldf",                   0, 0x0A},
-{"ldf",                   0, 0x0B},
-{"ldd",                   0, 0x0C},
-{"ldd",                   0, 0x0D},
-{"ldimm",                 4, 0x0E},
-{"ldimm2",                0, 0x0F},
-{"stb",                   0, 0x10},
-{"stb",                   0, 0x11},
-{"sts",                   0, 0x12},
-{"sts",                   0, 0x13},
-{"sti",                   0, 0x14},
-{"sti",                   0, 0x15},
-{"stl",                   0, 0x16},
-{"stl",                   0, 0x17},
-{"stf",                   0, 0x18},
-{"stf",                   0, 0x19},
-{"std",                   0, 0x1A},
-{"std",                   0, 0x1B},
-{"ldblkid",               5, 0x1C}, /* pseudo instruction */
-{"ldnative",              5, 0x1D}, /* pseudo instruction */
-{"addl",                  0, 0x20},
-{"addl",                  0, 0x21},
-{"subl",                  0, 0x22},
-{"subl",                  0, 0x23},
-{"mull",                  0, 0x24},
-{"mull",                  0, 0x25},
-{"divl",                 10, 0x26},
-{"divl",                  7, 0x27},
-{"reml",                  0, 0x28},
-{"reml",                  0, 0x29},
-{"negl",                  0, 0x2A},
-{"addd",                  0, 0x2B},
-{"subd",                  0, 0x2C},
-{"muld",                  0, 0x2D},
-{"divd",                 10, 0x2E},
-{"negd",                  6, 0x2F},
-{"cvtld",                 6, 0x30},
-{"cvtdl",                 6, 0x31},
-{"lshift",                0, 0x32},
-{"lshift",                0, 0x33},
-{"rshift",                0, 0x34},
-{"rshift",                0, 0x35},
-{"rshiftu",               0, 0x36},
-{"rshiftu",               0, 0x37},
-{"and",                   0, 0x38},
-{"or",                    0, 0x39},
-{"xor",                   0, 0x3A},
-{"ornot",                 0, 0x3B},
-{"cmpeq",                 0, 0x40},
-{"cmpeq",                 0, 0x41},
-{"cmple",                 0, 0x42},
-{"cmple",                 0, 0x43},
-{"cmplt",                 0, 0x44},
-{"cmplt",                 0, 0x45},
-{"cmpule",                0, 0x46},
-{"cmpule",                0, 0x47},
-{"cmpult",                0, 0x48},
-{"cmpult",                0, 0x49},
-{"fcmpeq",                0, 0x4A},
-{"fcmple",                0, 0x4B},
-{"fcmplt",                0, 0x4C},
-{"jmp",                   0, 0x50},
-{"jmp",                   0, 0x51},
-{"btrue",                 0, 0x52},
-{"bfalse",                0, 0x53},
-{"alloc_blk",             0, 0x60},
-{"alloc_private_blk",     0, 0x61},
-{"aquire_blk",            0, 0x62},
-{"release_blk",           0, 0x63},
-{"set_volatile",          0, 0x64},
-{"get_owner",             0, 0x65},
-{"call",                  6, 0x72},
-{"calln",                 7, 0x73},
-{"ret",                   3, 0x74},
-{"throw",                 0, 0x80},
-{"retrieve",              0, 0x81},
-{"init_proc",             0, 0x90},
-{"join",                  0, 0x91},
-{"join2",                 0, 0x92},
-{"whoami",                0, 0x93},
-};
-#endif
-
-
-// verifyOpcode
-//
-// given an opcode string get its instruction format
-//
-// returns 0 if opcode is not found
-//
-static int verifyOpcode(char *opcode)
-{
-    int i;
-
-    i = 0;
-    while (opcodes[i].opcode)
-    {
-        if (!strcmp(opcode, opcodes[i].opcode))
-        {
-            return opcodes[i].format;
-        }
-        i++;
-    }
-    return 0;
-}
-
-// getOpcodeEncoding
-//
-// given an opcode string get its encoding
-//
-// returns -1 if opcode is not found
+// Switched to big endian for xpvm.
 //
-static int getOpcodeEncoding(char *opcode)
+static void outputWord(int value)
 {
-    int i;
-
-    i = 0;
-    while (opcodes[i].opcode)
-    {
-        if (!strcmp(opcode, opcodes[i].opcode))
-        {
-            return opcodes[i].encoding;
-        }
-        i++;
-    }
-    return -1;
+#if 0
+  putc(value & 0xFF, fp);
+  putc((value >> 8) & 0xFF, fp);
+  putc((value >> 16) & 0xFF, fp);
+  putc((value >> 24) & 0xFF, fp);
+#endif
+  putc((value >> 24) & 0xFF, fp);
+  putc((value >> 16) & 0xFF, fp);
+  putc((value >> 8) & 0xFF, fp);
+  putc(value & 0xFF, fp);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -1060,11 +1669,35 @@ static void dumpInstrStruct(INSTR instr)
       case 9:
         fprintf(stderr, " %d\n", instr.u.format9.constant);
         break;
+      case 12:
+        fprintf(stderr, " %u value(s) x %u\n", instr.u.format12.num_values,
+                instr.u.format12.repeat);
+        break;
+      case 13:
+        fprintf(stderr, " \"%s\",%lld,%lld\n", instr.u.format13.path,
+                instr.u.format13.offset, instr.u.format13.length);
+        break;
       case 10:
         fprintf(stderr, " r%d,r%d,r%d\n", instr.u.format10.reg1,
                                           instr.u.format10.reg2,
                                           instr.u.format10.reg3 );
         break;
+      case 11:
+        if (instr.u.format11.is_double)
+        {
+          double d;
+          memcpy(&d, &instr.u.format11.value, sizeof d);
+          fprintf(stderr, " r%d,%g", instr.u.format11.reg, d);
+        }
+        else
+        {
+          fprintf(stderr, " r%d,%lld", instr.u.format11.reg,
+                  instr.u.format11.value);
+        }
+        if (instr.u.format11.pool)
+          fprintf(stderr, " (%s)", instr.u.format11.pool);
+        fprintf(stderr, "\n");
+        break;
       default:
         bug("unexpected instruction format (%d) in dumpInstrStruct",
           instr.format);
@@ -1077,38 +1710,48 @@ static void dumpInstrStruct(INSTR instr)
 //////////////////////////////////////////////////////////////////////////
 // symbol table implementation
 
-// struct to track a reference to a symbol
-typedef struct reference {
-  unsigned int addr;         // address of instruction referencing symbol
-  unsigned int format;       // format of instruction referencing symbol
-  struct reference *next;
-} REFERENCE_REC;
-
 // symbol table record itself
 typedef struct symtab {
   char *id;
   int isDefined;      // appears in a label definition?
   int isReferenced;   // is referenced as an operand of an instruction?
+  int isAddressed;    // is referenced by an instruction other than ldblkid?
   int isExported;     // named in export directive?
   int isImported;     // named in import directive?
   unsigned int addr;  // address, if defined
-  struct reference *references; // list of references to the id
   struct symtab *next;
 } SYMTAB_REC;
 
 // symbol table is just a list
 static struct symtab * symtab = 0;   // symbol table initially empty
 
+// the references to symbols, in the order they were made
+//   each is resolved once, by resolveFixups, into the disp of its
+//   statement; with -s resolve_func does that and drops them, and the
+//   ones left once the queue stops may name freed statements, so site
+//   is only used by resolve_func
+typedef struct fixup {
+  stmt_node *site;           // statement referencing the symbol
+  SYMTAB_REC *sym;           // the symbol referenced
+  unsigned int addr;         // address of instruction referencing symbol
+  unsigned int format;       // format of instruction referencing symbol
+  unsigned int block;        // id of the function it is in
+} FIXUP_REC;
+
+static FIXUP_REC *fixups;
+static unsigned int numFixups, maxFixups;
+
 // symtabMakeRecord
 //
-// for internal use: allocate symbol table record for id
+// for internal use: allocate symbol table record for id, with its own
+// copy of id (with -s the statement naming it is freed once encoded)
 //
 // returns pointer to record
 //
-static struct symtab * symtabMakeRecord(void)
+static struct symtab * symtabMakeRecord(char *id)
 {
   SYMTAB_REC *st = (SYMTAB_REC *) malloc(sizeof(SYMTAB_REC));
-  if (st == NULL)
+  if (st == NULL || (st->id = strdup(id)) == NULL)
   {
     fatal("out of memory in symtabMakeRecord");
   }
@@ -1126,6 +1769,29 @@ static void symtabInstallRecord(struct symtab *rec)
   symtab = rec;
 }
 
+// symtabForget
+//
+// for internal use: remove the record for id, unless it is exported or
+// imported, and free it
+//
+static void symtabForget(char *id)
+{
+  SYMTAB_REC **link = &symtab;
+  SYMTAB_REC *st;
+
+  while (*link && strcmp(id, (*link)->id))
+  {
+    link = &(*link)->next;
+  }
+  st = *link;
+  if (st && !st->isExported && !st->isImported)
+  {
+    *link = st->next;
+    free(st->id);
+    free(st);
+  }
+}
+
 // symtabLookup
 //
 // returns abstract pointer to record if id found and 0 otherwise
@@ -1167,14 +1833,13 @@ static int symtabInstallDefinition(char *id, unsigned int addr)
   else
   {
     // make new record
-    st = symtabMakeRecord();
-    st->id = id;
+    st = symtabMakeRecord(id);
     st->addr = addr;
     st->isDefined = 1;
     st->isReferenced = 0;
+    st->isAddressed = 0;
     st->isExported = 0;
     st->isImported = 0;
-    st->references = NULL;
 
     // install it into table
     symtabInstallRecord(st);
@@ -1184,46 +1849,50 @@ static int symtabInstallDefinition(char *id, unsigned int addr)
 
 //  symtabInstallReference
 //
-//  install id which is not yet defined into the symbol table
+//  install id which is not yet defined into the symbol table, and
+//  append the reference to it from site to the fixups
 //
 //  this routine will update an existing record for the id or
 //  it will create a new record if there is none for the id
 //
-static void symtabInstallReference(char *id, unsigned int addr,
-                                   unsigned int format)
+static void symtabInstallReference(char *id, stmt_node *site,
+                                   unsigned int addr, unsigned int format)
 {
   SYMTAB_REC *st = symtabLookup(id);  // is id already in table?
+  FIXUP_REC *p;
 
-  REFERENCE_REC *p = malloc(sizeof(REFERENCE_REC));
-  if (p == NULL)
-  {
-    fatal("out of memory in symtabInstallReference");
-  }
-  p->addr = addr;
-  p->format = format;
-  p->next = NULL;
-
-  if (st)
-  {
-    st->isReferenced = 1;
-    p->next = st->references;
-    st->references = p;
-  }
-  else
+  if (!st)
   {
     // allocate new record
-    st = symtabMakeRecord();
-    st->id = id;
+    st = symtabMakeRecord(id);
     st->addr = 0;
     st->isDefined = 0;
-    st->isReferenced = 1;
+    st->isReferenced = 0;
+    st->isAddressed = 0;
     st->isExported = 0;
     st->isImported = 0;
-    st->references = p;
 
     // install it into the table
     symtabInstallRecord(st);
   }
+  st->isReferenced = 1;
+  st->isAddressed |= format != 4;
+
+  if (numFixups == maxFixups)
+  {
+    maxFixups = maxFixups ? 2 * maxFixups : 256;
+    fixups = realloc(fixups, maxFixups * sizeof(FIXUP_REC));
+    if (fixups == NULL)
+    {
+      fatal("out of memory in symtabInstallReference");
+    }
+  }
+  p = &fixups[numFixups++];
+  p->site = site;
+  p->sym = st;
+  p->addr = addr;
+  p->format = format;
+  p->block = refBlock;
   return;
 }
 
@@ -1254,14 +1923,13 @@ static void symtabInstallExport(char *id)
   else
   {
     // allocate new record
-    st = symtabMakeRecord();
-    st->id = id;
+    st = symtabMakeRecord(id);
     st->addr = 0;
     st->isDefined = 0;
     st->isReferenced = 0;
+    st->isAddressed = 0;
     st->isExported = 1;
     st->isImported = 0;
-    st->references = NULL;
 
     // install it into the table
     symtabInstallRecord(st);
@@ -1296,14 +1964,13 @@ static void symtabInstallImport(char *id)
   else
   {
     // allocate new record
-    st = symtabMakeRecord();
-    st->id = id;
+    st = symtabMakeRecord(id);
     st->addr = 0;
     st->isDefined = 0;
     st->isReferenced = 0;
+    st->isAddressed = 0;
     st->isExported = 0;
     st->isImported = 1;
-    st->references = NULL;
 
     // install it into the table
     symtabInstallRecord(st);
@@ -1355,62 +2022,57 @@ static void *symtabNext(void *inIter)
   return ret;
 }
 
-struct iteratorRef
-{
-  REFERENCE_REC *next;
-};
+//////////////////////////////////////////////////////////////////////////
+// support routines that need to know the symbol table details
 
-//  referenceInitIter
+// resolveFixups
 //
-//  initializes an iterator to traverse reference list for a symbol
+// resolve the fixups from first on, in one pass: store the PC-relative
+// address of each symbol in the statement referencing it, if sites is
+// set, and check that it will fit. a symbol that is not defined
+// resolves to 0 (it is imported, or an error was reported for it)
 //
-//  NOTE: reference list should not be modified during an iterator
-//        sequence!
+// returns the number of addresses that won't fit; if report is set,
+// checkAddr reports them and increments global errorCount
 //
-static void *referenceInitIterator(void *symRec)
+static unsigned int resolveFixups(unsigned int first, int sites, int report)
 {
-  SYMTAB_REC *p = symRec;
-  struct iteratorRef *ret = (struct iteratorRef *)
-    malloc(sizeof(struct iteratorRef));
-  if (ret == NULL)
+  unsigned int i, bad = 0;
+  for (i = first; i < numFixups; i += 1)
   {
-    fatal("out of memory in referenceInitIter");
-  }
-  ret->next = p->references;
-  return (void *) ret;
-}
+    FIXUP_REC *p = &fixups[i];
+    int disp = 0;
 
-//  referenceNext
-//
-//  returns next (addr,format) pair
-//    the addr is the return value
-//    the format is returned through the second parameter
-//
-//  returns -1 when no more (addr,format) pairs
-//
-static unsigned int referenceNext(void *inIter, unsigned int *outFormat)
-{
-  unsigned int ret;
-  struct iteratorRef *iter = (struct iteratorRef *) inIter;
-  if (!iter->next)
-  {
-      free(iter);
-      return -1;
+    // ldblkid names a block, which the encoder looks up itself
+    if (p->format == 4)
+    {
+      continue;
+    }
+    if (p->sym->isDefined)
+    {
+      disp = p->sym->addr - (p->addr + 1);
+      if (!addrFits(disp, p->format))
+      {
+        bad += 1;
+        if (report)
+        {
+          checkAddr(p->sym->id, p->sym->addr, p->addr + 1, p->format);
+        }
+      }
+    }
+    if (sites)
+    {
+      p->site->disp = disp;
+    }
   }
-  ret = iter->next->addr;
-  *outFormat = iter->next->format;
-  iter->next = iter->next->next;
-  return ret;
+  return bad;
 }
 
-//////////////////////////////////////////////////////////////////////////
-// support routines that need to know the symbol table details
-
 // checkForAddressErrors
 //
-// iterate over symbols to do error checking for addresses
-//   for each reference, check to see if the symbol is defined or imported
-//   if defined, be sure that the PC-relative address will fit
+// iterate over symbols to check that each one referenced is defined or
+// imported, then resolve the fixups, checking that the PC-relative
+// addresses will fit
 //
 // uses error() function to report errors and increments global errorCount
 //
@@ -1420,31 +2082,38 @@ void checkForAddressErrors(void)
   SYMTAB_REC *p = symtabNext(iter);
   while (p)
   {
-    if (p->isReferenced)
+    if (p->isReferenced && !p->isDefined && !p->isImported)
     {
-      if (!p->isDefined && !p->isImported)
-      {
-        error("label %s is referenced but not defined or imported", p->id);
-        errorCount += 1;
-      }
-      else
-      {
-        if (p->isDefined)
-        {
-          // iterate over all references
-          void *iter2 = referenceInitIterator(p);
-          unsigned int format;
-          unsigned int addr = referenceNext(iter2, &format);
-          while (addr != -1)
-          {
-            checkAddr(p->id, p->addr, addr + 1, format);
-            addr = referenceNext(iter2, &format);
-          }
-        }
-      }
+      error("label %s is referenced but not defined or imported", p->id);
+      errorCount += 1;
     }
     p = symtabNext(iter);
   }
+
+  // with -s the functions are encoded (or won't be) and freed already,
+  //   so their fixups are only checked
+  resolveFixups(0, !streamFuncs, 1);
+}
+
+// is_block
+//
+// is id the name of a function?
+//
+static int is_block(char *id)
+{
+  func_node *walk;
+  if (streamFuncs)
+  {
+    return stream_lookup(id) >= 0;
+  }
+  for (walk = func_list; walk; walk = walk->link)
+  {
+    if (!strcmp(id, walk->name))
+    {
+      return 1;
+    }
+  }
+  return 0;
 }
 
 //
@@ -1458,6 +2127,8 @@ void checkForAddressErrors(void)
 //   5. if a symbol is referenced but not defined then it should be imported
 //        actually this error is checked in checkForAddressErrors()
 //   6. a symbol that is being imported or exported must be 16 chars or less
+//   7. only blocks can be exported, and an imported symbol can only be
+//        named by ldblkid, since a linker resolves blocks by name
 //
 static unsigned int checkForImportExportErrors(void)
 {
@@ -1496,6 +2167,16 @@ static unsigned int checkForImportExportErrors(void)
       error("symbol %s is exported and longer than 16 characters", p->id);
       ret += 1;
     }
+    if (p->isExported && p->isDefined && !is_block(p->id))
+    {
+      error("symbol %s is exported but is not a function", p->id);
+      ret += 1;
+    }
+    if (p->isImported && p->isAddressed)
+    {
+      error("imported symbol %s can only be loaded by ldblkid", p->id);
+      ret += 1;
+    }
     p = symtabNext(iter);
   }
   return ret;
@@ -1524,8 +2205,8 @@ static void printDefinedLabels(void)
 /*
  * output_header
  *
- * Output the header information necessary for the xpvm object file format.
- * Currently just the magic number and the number of blocks.
+ * Output the header information necessary for the xpvm object file format:
+ * the magic number, the number of blocks and the string table location.
  */
 static void 
 output_header( void )
@@ -1533,6 +2214,54 @@ output_header( void )
   const int MAGIC = 0x31303636; 
   outputWord( MAGIC );
   outputWord( num_blocks );
+  /* string table offset and length, filled in by encode_funcs */
+  outputWord( 0 );
+  outputWord( 0 );
+}
+
+// outputInsymbols
+//
+// output the insymbol section: the number of exported blocks, then the
+// name and block id of each, in block id order
+//
+static void outputInsymbols(void)
+{
+  func_node *walk;
+  unsigned int id, n = 0;
+  char *name;
+
+  // with -s the functions are gone, only their names are left
+  if (streamFuncs)
+  {
+    for (id = 0; (name = stream_block(id)); id += 1)
+    {
+      n += is_exported(name);
+    }
+    outputWord(n);
+    for (id = 0; (name = stream_block(id)); id += 1)
+    {
+      if (is_exported(name))
+      {
+        outputWord(strtab_intern(name));
+        outputWord(id);
+      }
+    }
+    return;
+  }
+
+  for (walk = func_list; walk; walk = walk->link)
+  {
+    n += is_exported(walk->name);
+  }
+  outputWord(n);
+  for (id = 0, walk = func_list; walk; walk = walk->link, id += 1)
+  {
+    if (is_exported(walk->name))
+    {
+      outputWord(strtab_intern(walk->name));
+      outputWord(id);
+    }
+  }
 }
 
 #if DEBUG
@@ -1543,7 +2272,7 @@ output_header( void )
 static void dumpSymbolTable(void)
 {
   fprintf(stderr, "symbol table dump===================================\n");
-  unsigned int outFormat;
+  unsigned int i;
   void *iter = symtabInitIterator();
   SYMTAB_REC *p = symtabNext(iter);
   while (p)
@@ -1554,16 +2283,14 @@ static void dumpSymbolTable(void)
     fprintf(stderr, "  isReferenced %d\n", p->isReferenced);
     fprintf(stderr, "  isExported %d\n", p->isExported);
     fprintf(stderr, "  isImported %d\n", p->isImported);
-    fprintf(stderr, "  references:\n");
-    void *iter2 = referenceInitIterator(p);
-    unsigned int addr = referenceNext(iter2, &outFormat );
-    while (addr != -1)
-    {
-      fprintf(stderr, "    %d\n", addr);
-      addr = referenceNext(iter2, &outFormat );
-    }
     p = symtabNext(iter);
   }
+  fprintf(stderr, "fixups:\n");
+  for (i = 0; i < numFixups; i += 1)
+  {
+    fprintf(stderr, "  %d %s (format %d)\n", fixups[i].addr,
+            fixups[i].sym->id, fixups[i].format);
+  }
   fprintf(stderr, "====================================================\n");
 }
 #endif
@@ -1616,20 +2343,76 @@ static void populate_handler_addrs( handler_node *handler )
   }
 }
 
+/*
+ * label_in_func
+ *
+ * Is the label defined in the function's statement list?
+ */
+static int label_in_func( func_node *func, char *label )
+{
+  stmt_node *walk;
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    if (walk->instr->format == 0 && !strcmp(walk->label, label))
+      return 1;
+  }
+  return 0;
+}
+
 /*
  * verify_handler_list
  *
- * Takes the head of a list of handlers and verifies each one.
- * This involves verifying the symbols are defined and filling
- * in their address in the handler structs.
+ * Takes a function and verifies each of its handlers.
+ * This involves verifying the symbols are defined in the function and
+ * filling in their address in the handler structs, and that the ranges
+ * are not inverted and either nest or stay apart.
  */
-static void verify_handler_list( handler_node *root )
+static void verify_handler_list( func_node *func )
 {
-  handler_node *walk = root;
-  while( walk )
+  handler_node *walk, *other;
+  for (walk = func->handler_list; walk; walk = walk->link)
   {
+    char *labels[3];
+    int i;
     populate_handler_addrs(walk);
-    walk = walk->link;
+    labels[0] = walk->handle_lbl;
+    labels[1] = walk->start_lbl;
+    labels[2] = walk->end_lbl;
+    for (i = 0; i < 3; i += 1)
+    {
+      if (get_symbol_addr( labels[i] ) >= 0 &&
+          !label_in_func( func, labels[i] ))
+      {
+        error("handler label '%s' is not in function %s", labels[i],
+              func->name);
+        errorCount += 1;
+      }
+    }
+    if (walk->start_addr > walk->end_addr)
+    {
+      error("handler range %s..%s is inverted", walk->start_lbl,
+            walk->end_lbl);
+      errorCount += 1;
+    }
+  }
+
+  for (walk = func->handler_list; walk; walk = walk->link)
+  {
+    for (other = walk->link; other; other = other->link)
+    {
+      if ((walk->start_addr < other->start_addr &&
+           other->start_addr < walk->end_addr &&
+           walk->end_addr < other->end_addr) ||
+          (other->start_addr < walk->start_addr &&
+           walk->start_addr < other->end_addr &&
+           other->end_addr < walk->end_addr))
+      {
+        error("handler ranges %s..%s and %s..%s overlap without nesting",
+              walk->start_lbl, walk->end_lbl, other->start_lbl,
+              other->end_lbl);
+        errorCount += 1;
+      }
+    }
   }
 }
 
@@ -1645,81 +2428,182 @@ void verify_handlers( func_node *root )
   func_node *walk = root;
   while (walk)
   {
-    verify_handler_list( walk->handler_list );
+    verify_handler_list( walk );
     walk = walk->link;
   }
 }
 
-// encodeAddr20
-//
-// given a symbol and the current location, encode the reference to
-// the symbol
-//
-static int encodeAddr20(char* id, unsigned int pc)
+/*
+ * define_label
+ *
+ * Install a label the assembler generated itself (constant pool entries
+ * and the like). Its address is filled in by relayout_funcs.
+ */
+void define_label( char *id )
 {
-  SYMTAB_REC *p = symtabLookup(id);
-
-  if (p == NULL)
+  if (!symtabInstallDefinition(id, 0))
   {
-    bug("encodeAddr20: %s not found in symtab", id);
+    bug("generated label %s already defined", id);
   }
+}
+
+/*
+ * is_exported
+ *
+ * Is the id named in an export directive?
+ */
+int is_exported( char *id )
+{
+  SYMTAB_REC *st = symtabLookup(id);
+  return st && st->isExported;
+}
+
+/*
+ * is_defined
+ *
+ * Is the id defined as a label or function?
+ */
+int is_defined( char *id )
+{
+  SYMTAB_REC *st = symtabLookup(id);
+  return st && st->isDefined;
+}
+
+/*
+ * resolve_func
+ *
+ * Get a function ready for the encoder thread (-s): resolve the fixups
+ * it made, so the encoder never reads the symbol table the parser is
+ * adding to. Returns 0 if the function can be encoded, 1 if a label it
+ * uses isn't defined (yet; *label is set to it), or -1 if it can't be
+ * for another reason: an operand out of reach, or errors earlier in
+ * pass 1. Nothing is reported here; betweenPasses does that.
+ *
+ * Once resolved, the function's fixups and labels are dropped, so the
+ * symbol table holds the blocks and the labels of the function being
+ * parsed, not those of the whole source. With -s a label is therefore
+ * local to its function: a later one can't name it, and may define a
+ * label of the same name.
+ */
+int resolve_func( func_node *func, char **label )
+{
+  extern unsigned int parseErrorCount, scanErrorCount;
+  unsigned int i;
+  stmt_node *walk;
 
-  // if the symbol is not defined, then just return 0
-  if (!p->isDefined)
+  if (errorCount + parseErrorCount + scanErrorCount)
+    return -1;
+  // the functions before it were resolved and their fixups dropped, so
+  //   these are all its own
+  for (i = 0; i < numFixups; i += 1)
   {
-    if (!p->isImported)
+    SYMTAB_REC *p = fixups[i].sym;
+    if (fixups[i].format != 4 && !p->isDefined && !p->isImported)
     {
-      bug("encodeAddr20: %s not defined and not imported", id);
+      *label = p->id;
+      return 1;
     }
-    return 0;
   }
-
-  int ret = (p->addr - pc);
-
-  // check if PC-relative address will fit in 20 bits
-  if (!fitIn20(ret))
+  if (resolveFixups( 0, 1, 0 ))
+    return -1;
+  numFixups = 0;
+  for (walk = func->stmt_list; walk; walk = walk->link)
   {
-    bug("encodeAddr20: address will not fit in 20 bits for %s", id);
+    if (walk->label)
+      symtabForget( walk->label );
   }
-
-  // return the PC-relative address
-  return ret;
+  return 0;
 }
 
-// encodeAddr16
-//
-// given a symbol and the current location, encode the reference to
-// the symbol
-//
-static int encodeAddr16(char* id, unsigned int pc)
+/*
+ * relayout_funcs
+ *
+ * Recompute everything pass 1 derived from statement addresses after a
+ * pass has inserted or removed statements: label addresses, symbol
+ * fixups, native reference patch sites, function lengths and
+ * handler addresses. Errors were already reported on pass 1, so none
+ * are reported here.
+ */
+void relayout_funcs( func_node *root )
 {
-  SYMTAB_REC *p = symtabLookup(id);
+  SYMTAB_REC *st;
+  unsigned int i, n;
+  int op;
+  func_node *func;
+  stmt_node *walk;
+  handler_node *h;
 
-  if (p == NULL)
+  // forget the fixups made from root, they are made again below. root
+  //   is the whole program, or with -s the one function just parsed,
+  //   whose predecessors are already encoded
+  for (i = 0, n = 0; i < numFixups; i += 1)
   {
-    bug("encodeAddr16: %s not found in symtab", id);
+    if (root && !root->link && fixups[i].block != root->id)
+      fixups[n++] = fixups[i];
   }
+  numFixups = n;
+  // isReferenced and isAddressed stay as pass 1 set them: they say what
+  //   the source names, so an import whose only ldblkid -O removed is
+  //   still referenced (and with -s the fixups are dropped anyway)
 
-  // if the symbol is not defined, then just return 0
-  if (!p->isDefined)
+  for (func = root; func; func = func->link)
   {
-    if (!p->isImported)
+    unsigned int addr = 0;
+
+    refBlock = func->id;
+
+    while (func->native_ref_list)
     {
-      bug("encodeAddr16: %s not defined and not imported", id);
+      native_ref_node *next = func->native_ref_list->link;
+      free(func->native_ref_list);
+      func->native_ref_list = next;
     }
-    return 0;
-  }
-
-  int ret = (p->addr - pc);
+    for (walk = func->stmt_list; walk; walk = walk->link)
+    {
+      INSTR *instr = walk->instr;
+      if (instr->format == 0)
+      {
+        if ((st = symtabLookup(walk->label)))
+          st->addr = addr;
+        continue;
+      }
+      switch (instr->format)
+      {
+        case 2:
+          if (!names_only( instr ))
+            symtabInstallReference(instr->u.format2.addr, walk, addr, 2);
+          break;
+        case 5:
+          op = opcode_lookup(instr->opcode, 5);
+          if (op == OP_LDNATIVE)
+            add_native_ref( addr, instr->u.format5.addr,
+                            &func->native_ref_list );
+          else
+            symtabInstallReference(instr->u.format5.addr, walk, addr,
+                                   op == OP_LDBLKID ? 4 : 5);
+          break;
+        case 8:
+          symtabInstallReference(instr->u.format8.addr, walk, addr, 8);
+          break;
+        case 11:
+          // pool loads reach their entry with an 8-bit offset
+          if (instr->u.format11.pool)
+            symtabInstallReference(instr->u.format11.pool, walk, addr, 8);
+          break;
+      }
+      addr += stmt_words( instr );
+    }
+    func->length = addr;
+    func->num_native_refs = native_ref_list_length( func->native_ref_list );
 
-  // check if PC-relative address will fit in 16 bits
-  if (!fitIn16(ret))
-  {
-    bug("encodeAddr16: address will not fit in 16 bits for %s", id);
+    for (h = func->handler_list; h; h = h->link)
+    {
+      h->handle_addr = get_symbol_addr( h->handle_lbl );
+      h->start_addr = get_symbol_addr( h->start_lbl );
+      h->end_addr = get_symbol_addr( h->end_lbl );
+    }
   }
-
-  // return the PC-relative address
-  return ret;
+  refBlock = num_blocks;
 }
 
 /*
@@ -1792,30 +2676,68 @@ static unsigned int fitIn20(int value)
   return 1;
 }
 
+// addrFits
+//
+// will a PC-relative address fit in the given format?
+//
+// (format 4 is used for ldblkid references, which name a block rather
+// than a PC-relative address, so anything fits)
+//
+static int addrFits(int disp, unsigned int format)
+{
+  switch (format)
+  {
+    case 8:
+      return fit_in_8(disp);
+    case 5:
+      return fitIn16(disp);
+    case 2:
+      return fitIn20(disp);
+  }
+  return 1;
+}
+
 //
 // check to see if a reference to defined label with fit in the given format
 //
 // calls error to report errors and increments global errorCount
 //
+// (format 4 is used for ldblkid references, which name a block rather
+// than a PC-relative address, so there is nothing to check)
+//
 static void checkAddr(char *id, unsigned int def, unsigned int ref,
                      unsigned int format)
 {
   if (format == 8)
+  {
+    if (!fit_in_8(def - ref))
+    {
+      error("reference to label %s at address %d won't fit in 8 bits", id,
+            ref - 1);
+      errorCount += 1;
+    }
+  }
+  else if (format == 5)
   {
     if (!fitIn16(def - ref))
     {
-      error("reference to label %s at address %d won't fit in 16 bits", id);
+      error("reference to label %s at address %d won't fit in 16 bits", id,
+            ref - 1);
       errorCount += 1;
     }
   }
-  else if ((format == 2) || (format == 5))
+  else if (format == 2)
   {
     if (!fitIn20(def - ref))
     {
-      error("reference to label %s at address %d won't fit in 20 bits", id);
+      error("reference to label %s at address %d won't fit in 20 bits", id,
+            ref - 1);
       errorCount += 1;
     }
   }
+  else if (format == 4)
+  {
+  }
   else
   {
     bug("unexpected format (%d) in checkAddr for label %s", format, id);
@@ -0,0 +1,313 @@
+/*
+ * builder.c - build a program without source (libxpas.a, see xpas.h)
+ *
+ *             Each call makes what the grammar's action makes for the
+ *             same line and hands it to pass 1 through the process_
+ *             functions, so a built program and its source go through
+ *             the same checks and encoding. The library has no scanner
+ *             or parser, so the line number and error counts they keep
+ *             are kept here: the line is the statement number in the
+ *             function, and misuse of the calls counts as a parse error,
+ *             as does an opcode id whose row of isa.def has other operands
+ *             than the call passes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+#include "xpas.h"
+
+int yylineno = 1;
+unsigned int parseErrorCount = 0;
+unsigned int scanErrorCount = 0;
+
+struct xpas_ctx {
+  char          *name;          // of the function being built, or NULL
+  handler_node  *handlers;
+  handler_node  **handler_tail;
+  stmt_node     *stmts;         // in reverse, like stmt_list
+  func_node     *funcs;         // in reverse, like func_list
+};
+
+static int begun = 0;
+
+static char *copy( const char *s )
+{
+  char *ret = strdup( s );
+  if (!ret)
+    fatal("malloc failed in the builder");
+  return ret;
+}
+
+static void misuse( char *what )
+{
+  error("%s", what);
+  parseErrorCount += 1;
+}
+
+xpas_ctx *xpas_begin( void )
+{
+  xpas_ctx *ctx;
+
+  if (begun)
+    return NULL;
+  begun = 1;
+  if (!(ctx = calloc( 1, sizeof *ctx )))
+    fatal("malloc failed in xpas_begin");
+  initAssemble();
+  return ctx;
+}
+
+void xpas_func_begin( xpas_ctx *ctx, const char *name )
+{
+  if (ctx->name)
+  {
+    misuse("xpas_func_begin inside a function");
+    xpas_func_end( ctx );
+  }
+  ctx->name = copy( name );
+  ctx->handlers = NULL;
+  ctx->handler_tail = &ctx->handlers;
+  ctx->stmts = NULL;
+  yylineno = 1;
+}
+
+void xpas_func_end( xpas_ctx *ctx )
+{
+  if (!ctx->name)
+  {
+    misuse("xpas_func_end outside a function");
+    return;
+  }
+  ctx->funcs = process_func_list(
+    finish_func( process_func( ctx->name, ctx->name, ctx->handlers,
+                               reverse_stmt_list( ctx->stmts ) ) ),
+    ctx->funcs );
+  ctx->name = NULL;
+}
+
+void xpas_handler( xpas_ctx *ctx, const char *handle, const char *start,
+                   const char *end )
+{
+  handler_node *h;
+
+  if (!ctx->name || ctx->stmts)
+  {
+    misuse("xpas_handler must come before the statements of a function");
+    return;
+  }
+  // the grammar keeps the handlers in the order they are declared
+  if ((h = process_handler( copy( handle ), copy( start ), copy( end ) )))
+  {
+    *ctx->handler_tail = h;
+    ctx->handler_tail = &h->link;
+  }
+}
+
+/*
+ * stmt
+ *
+ * Hand a statement to pass 1, as the stmt rule does.
+ */
+static void stmt( xpas_ctx *ctx, char *label, INSTR *instr )
+{
+  if (!ctx->name)
+  {
+    misuse("statement outside a function");
+    return;
+  }
+  // a statement instr rejected, left empty
+  if (!label && !instr->format)
+  {
+    free(instr);
+    return;
+  }
+  ctx->stmts = process_stmt_list( process_stmt( label, instr ), ctx->stmts );
+}
+
+// start a statement of the given format; every one starts here, so it
+// counts the lines. op is the OP_ id, whose row must have the format
+// (format 0 is a label, and has none)
+static INSTR *instr( int op, unsigned int format )
+{
+  INSTR *ret = calloc( 1, sizeof *ret );
+  sourceLine = yylineno;
+  yylineno += 1;
+  if (!ret)
+    fatal("malloc failed in the builder");
+  if (!format)
+    return ret;
+  if (op < 0 || op >= NUM_OPS)
+  {
+    misuse("no such opcode id");
+    return ret;
+  }
+  if (opcodes[op].format != format)
+  {
+    error("%s (format %d) does not take the operands of format %u",
+          opcodes[op].opcode, opcodes[op].format, format);
+    parseErrorCount += 1;
+    return ret;
+  }
+  ret->format = format;
+  ret->opcode = opcodes[op].opcode;
+  return ret;
+}
+
+// the scanner only matches r0 to r255
+static unsigned int reg( unsigned int r )
+{
+  if (r > 255)
+  {
+    misuse("register out of range");
+    return 0;
+  }
+  return r;
+}
+
+void xpas_label( xpas_ctx *ctx, const char *name )
+{
+  stmt( ctx, copy( name ), instr( -1, 0 ) );
+}
+
+void xpas_emit( xpas_ctx *ctx, enum opcodeId op )
+{
+  stmt( ctx, NULL, instr( op, 1 ) );
+}
+
+void xpas_emit_l( xpas_ctx *ctx, enum opcodeId op, const char *l )
+{
+  INSTR *i = instr( op, 2 );
+  i->u.format2.addr = copy( l );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_r( xpas_ctx *ctx, enum opcodeId op, unsigned int r )
+{
+  INSTR *i = instr( op, 3 );
+  i->u.format3.reg = reg( r );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rc( xpas_ctx *ctx, enum opcodeId op, unsigned int r, int c )
+{
+  INSTR *i = instr( op, 4 );
+  i->u.format4.reg = reg( r );
+  i->u.format4.constant = c;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rl( xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                   const char *l )
+{
+  INSTR *i = instr( op, 5 );
+  i->u.format5.reg = reg( r );
+  i->u.format5.addr = copy( l );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rr( xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                   unsigned int r2 )
+{
+  INSTR *i = instr( op, 6 );
+  i->u.format6.reg1 = reg( r1 );
+  i->u.format6.reg2 = reg( r2 );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rrc( xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                    unsigned int r2, int c )
+{
+  INSTR *i = instr( op, 7 );
+  i->u.format7.reg1 = reg( r1 );
+  i->u.format7.reg2 = reg( r2 );
+  i->u.format7.const8 = c;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rrl( xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                    unsigned int r2, const char *l )
+{
+  INSTR *i = instr( op, 8 );
+  i->u.format8.reg1 = reg( r1 );
+  i->u.format8.reg2 = reg( r2 );
+  i->u.format8.addr = copy( l );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rrr( xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                    unsigned int r2, unsigned int r3 )
+{
+  INSTR *i = instr( op, 10 );
+  i->u.format10.reg1 = reg( r1 );
+  i->u.format10.reg2 = reg( r2 );
+  i->u.format10.reg3 = reg( r3 );
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_c( xpas_ctx *ctx, enum opcodeId op, int c )
+{
+  INSTR *i = instr( op, 9 );
+  i->u.format9.constant = c;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rlong( xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                      long long c )
+{
+  INSTR *i = instr( op, 11 );
+  i->u.format11.reg = reg( r );
+  i->u.format11.value = c;
+  i->u.format11.is_double = 0;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_rdouble( xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                        double c )
+{
+  INSTR *i = instr( op, 11 );
+  i->u.format11.reg = reg( r );
+  memcpy( &i->u.format11.value, &c, sizeof c );
+  i->u.format11.is_double = 1;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_emit_data( xpas_ctx *ctx, enum opcodeId op, const int *values,
+                     unsigned int n )
+{
+  INSTR *i = instr( op, 12 );
+  if (!(i->u.format12.values = malloc( (n ? n : 1) * sizeof(int) )))
+    fatal("malloc failed in xpas_emit_data");
+  memcpy( i->u.format12.values, values, n * sizeof(int) );
+  i->u.format12.num_values = n;
+  i->u.format12.repeat = 1;
+  stmt( ctx, NULL, i );
+}
+
+void xpas_ldnative( xpas_ctx *ctx, unsigned int r, const char *name )
+{
+  xpas_emit_rl( ctx, OP_LDNATIVE, r, name );
+}
+
+int xpas_end( xpas_ctx *ctx, FILE *out )
+{
+  int errors;
+
+  if (ctx->name)
+  {
+    misuse("xpas_end inside a function");
+    xpas_func_end( ctx );
+  }
+  finish_program( ctx->funcs );
+  free(ctx);
+
+  errors = betweenPasses( out ) + parseErrorCount;
+  if (errors)
+  {
+    error("assembler terminating after first pass with %d error(s)",
+          errors);
+    return errors;
+  }
+  encode_funcs( func_list );
+  return 0;
+}
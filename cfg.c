@@ -0,0 +1,573 @@
+/*
+ * cfg.c - control flow graphs and dead code elimination for the xpvm
+ *         assembler
+ *
+ *         See cfg.h for how blocks are formed. cfg_optimize_funcs runs,
+ *         when xpas is given -O, two passes on top of the graph:
+ *
+ *           unreachable code: the instructions of every block that can't
+ *           be reached from the entry, a handler or a root are removed.
+ *           Labels stay, since handler ranges may still name them.
+ *
+ *           dead stores: an instruction whose only effect is writing a
+ *           register that is not live afterwards is removed. Inside a
+ *           handler range the registers live into the handler count as
+ *           live after every instruction. Registers are taken to be
+ *           local to the frame, so nothing is live after ret, and call
+ *           and calln are taken to read every register.
+ *
+ *         Functions with an indirect jmp are left alone, as are blocks
+ *         that hold data (which are also roots, as are blocks whose label
+ *         is referenced other than by a branch). The caller must run
+ *         relayout_funcs afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+#include "cfg.h"
+
+static void *cfg_alloc( size_t n, size_t size )
+{
+  void *p = calloc( n ? n : 1, size );
+  if (!p)
+    fatal("malloc failed in cfg_build");
+  return p;
+}
+
+// is the instruction the one of the given OP_ id?
+static int is_op( INSTR *instr, enum opcodeId op )
+{
+  return instr->format == opcodes[op].format &&
+         opcode_lookup(instr->opcode, instr->format) == op;
+}
+
+/*
+ * ends_block
+ *
+ * Is the instruction a jmp, btrue, bfalse, ret or throw?
+ */
+static int ends_block( INSTR *instr )
+{
+  return is_op(instr, OP_JMP) || is_op(instr, OP_JMP_R) ||
+         is_op(instr, OP_RET) || is_op(instr, OP_THROW) ||
+         is_op(instr, OP_BTRUE) || is_op(instr, OP_BFALSE);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// label lookup, private to cfg_build
+
+struct label_entry {
+  const char *name;
+  basic_block *block;
+  struct label_entry *link;
+};
+
+struct label_table {
+  struct label_entry **buckets;
+  struct label_entry *entries;
+  unsigned int mask;
+  unsigned int num_entries;
+};
+
+static unsigned int hash_label( const char *s )
+{
+  unsigned int h = 5381;
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+static void label_add( struct label_table *t, const char *name,
+                       basic_block *block )
+{
+  struct label_entry *e = &t->entries[t->num_entries++];
+  unsigned int h = hash_label( name ) & t->mask;
+  e->name = name;
+  e->block = block;
+  e->link = t->buckets[h];
+  t->buckets[h] = e;
+}
+
+static basic_block *label_block( struct label_table *t, const char *name )
+{
+  struct label_entry *e;
+  for (e = t->buckets[hash_label( name ) & t->mask]; e; e = e->link)
+  {
+    if (!strcmp(e->name, name))
+      return e->block;
+  }
+  return NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// building
+
+/*
+ * is_leader
+ *
+ * Does statement i start a block?
+ */
+static int is_leader( cfg *g, unsigned int i )
+{
+  INSTR *prev;
+  if (i == 0)
+    return 1;
+  prev = g->stmts[i - 1]->instr;
+  if (prev->format == 0)
+    return 0;
+  return g->stmts[i]->instr->format == 0 || ends_block( prev );
+}
+
+cfg *cfg_build( func_node *func )
+{
+  cfg *g = cfg_alloc( 1, sizeof *g );
+  struct label_table labels;
+  stmt_node *walk;
+  handler_node *h;
+  unsigned int i, b, num_labels = 0, num_handlers = 0;
+
+  g->func = func;
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    g->num_stmts += 1;
+    num_labels += walk->instr->format == 0;
+  }
+  g->stmts = cfg_alloc( g->num_stmts, sizeof *g->stmts );
+  for (i = 0, walk = func->stmt_list; walk; walk = walk->link)
+  {
+    g->stmts[i++] = walk;
+  }
+  for (i = 0; i < g->num_stmts; i += 1)
+  {
+    g->num_blocks += is_leader( g, i );
+  }
+  for (h = func->handler_list; h; h = h->link)
+  {
+    num_handlers += 1;
+  }
+
+  // lay out the blocks and index their labels
+  labels.mask = 1;
+  while (labels.mask < 2 * num_labels)
+    labels.mask <<= 1;
+  labels.buckets = cfg_alloc( labels.mask, sizeof *labels.buckets );
+  labels.entries = cfg_alloc( num_labels, sizeof *labels.entries );
+  labels.num_entries = 0;
+  labels.mask -= 1;
+
+  g->blocks = cfg_alloc( g->num_blocks, sizeof *g->blocks );
+  for (i = 0, b = 0; i < g->num_stmts; i += 1)
+  {
+    INSTR *instr = g->stmts[i]->instr;
+    basic_block *blk;
+    if (i > 0 && is_leader( g, i ))
+    {
+      g->blocks[b].end = i;
+      b += 1;
+      g->blocks[b].first = i;
+    }
+    blk = &g->blocks[b];
+    if (instr->format == 0)
+      label_add( &labels, g->stmts[i]->label, blk );
+    else if (instr->format == 9 || instr->format == 12 ||
+             instr->format == 13)
+      blk->has_data = blk->is_root = 1;
+  }
+  if (g->num_blocks)
+    g->blocks[b].end = g->num_stmts;
+
+  // flow edges
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    basic_block *blk = &g->blocks[b];
+    basic_block *next = b + 1 < g->num_blocks ? blk + 1 : NULL;
+    INSTR *last = g->stmts[blk->end - 1]->instr;
+
+    blk->succs = cfg_alloc( 2 + num_handlers, sizeof *blk->succs );
+    if (last->format == 0 || !ends_block( last ))
+      blk->fall = next;
+    else if (last->format == 2)
+    {
+      if (!(blk->target = label_block( &labels, last->u.format2.addr )))
+        g->opaque = 1;
+    }
+    else if (last->format == 5)
+    {
+      if (!(blk->target = label_block( &labels, last->u.format5.addr )))
+        g->opaque = 1;
+      blk->fall = next;
+    }
+    else if (is_op(last, OP_JMP_R))
+      g->opaque = 1;
+
+    if (blk->target)
+      blk->succs[blk->num_succs++] = blk->target;
+    if (blk->fall && blk->fall != blk->target)
+      blk->succs[blk->num_succs++] = blk->fall;
+    blk->first_handler = blk->num_succs;
+  }
+
+  // handler edges, from every block of the range
+  for (h = func->handler_list; h; h = h->link)
+  {
+    basic_block *start = label_block( &labels, h->start_lbl );
+    basic_block *end = label_block( &labels, h->end_lbl );
+    basic_block *handle = label_block( &labels, h->handle_lbl );
+    basic_block *blk;
+    if (!start || !end || !handle)
+    {
+      g->opaque = 1;
+      continue;
+    }
+    handle->is_root = 1;
+    for (blk = start; blk < end; blk += 1)
+    {
+      blk->succs[blk->num_succs++] = handle;
+    }
+  }
+
+  // labels referenced other than by a branch
+  for (i = 0; i < g->num_stmts; i += 1)
+  {
+    INSTR *instr = g->stmts[i]->instr;
+    char *name = NULL;
+    basic_block *blk;
+    if (instr->format == 8)
+      name = instr->u.format8.addr;
+    else if (instr->format == 11)
+      name = instr->u.format11.pool;
+    if (name && (blk = label_block( &labels, name )))
+      blk->is_root = 1;
+  }
+
+  free(labels.buckets);
+  free(labels.entries);
+  return g;
+}
+
+void cfg_free( cfg *g )
+{
+  unsigned int b;
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    free(g->blocks[b].succs);
+  }
+  free(g->blocks);
+  free(g->stmts);
+  free(g);
+}
+
+void cfg_mark_reachable( cfg *g )
+{
+  basic_block **stack;
+  unsigned int sp = 0, b, s;
+
+  if (!g->num_blocks)
+    return;
+  stack = cfg_alloc( g->num_blocks, sizeof *stack );
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    if (b == 0 || g->blocks[b].is_root)
+    {
+      g->blocks[b].reachable = 1;
+      stack[sp++] = &g->blocks[b];
+    }
+  }
+  while (sp)
+  {
+    basic_block *blk = stack[--sp];
+    for (s = 0; s < blk->num_succs; s += 1)
+    {
+      if (!blk->succs[s]->reachable)
+      {
+        blk->succs[s]->reachable = 1;
+        stack[sp++] = blk->succs[s];
+      }
+    }
+  }
+  free(stack);
+}
+
+void cfg_remove( cfg *g, unsigned int i )
+{
+  free(g->stmts[i]->instr);
+  free(g->stmts[i]);
+  g->stmts[i] = NULL;
+}
+
+void cfg_commit( cfg *g )
+{
+  stmt_node **link = &g->func->stmt_list;
+  unsigned int i;
+  for (i = 0; i < g->num_stmts; i += 1)
+  {
+    if (g->stmts[i])
+    {
+      *link = g->stmts[i];
+      link = &g->stmts[i]->link;
+    }
+  }
+  *link = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// liveness
+
+#define REG_BIT(set, r)  ((set)[(r) >> 5] & (1u << ((r) & 31)))
+#define SET_REG(set, r)  ((set)[(r) >> 5] |= 1u << ((r) & 31))
+
+/*
+ * is_pure
+ *
+ * Does the instruction (formats 6, 7 and 10) only compute its register
+ * from its operands? An id not listed is taken to have side effects.
+ */
+static int is_pure( int op )
+{
+  switch (op)
+  {
+    case OP_ADDL:   case OP_ADDL_I:   case OP_SUBL:    case OP_SUBL_I:
+    case OP_MULL:   case OP_MULL_I:   case OP_NEGL:
+    case OP_ADDD:   case OP_SUBD:     case OP_MULD:    case OP_NEGD:
+    case OP_CVTLD:  case OP_CVTDL:
+    case OP_LSHIFT: case OP_LSHIFT_I: case OP_RSHIFT:  case OP_RSHIFT_I:
+    case OP_RSHIFTU: case OP_RSHIFTU_I:
+    case OP_AND:    case OP_OR:       case OP_XOR:     case OP_ORNOT:
+    case OP_CMPEQ:  case OP_CMPEQ_I:  case OP_CMPLE:   case OP_CMPLE_I:
+    case OP_CMPLT:  case OP_CMPLT_I:  case OP_CMPULE:  case OP_CMPULE_I:
+    case OP_CMPULT: case OP_CMPULT_I:
+    case OP_FCMPEQ: case OP_FCMPLE:   case OP_FCMPLT:
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * cfg_instr_regs
+ *
+ * Anything not known to be free of side effects reads both of its
+ * registers and is never removable; under-reporting a write is always
+ * safe, under-reporting a read never is.
+ */
+int cfg_instr_regs( INSTR *instr, regset use, int *def )
+{
+  int removable = 0;
+  int op;
+
+  memset( use, 0, sizeof(regset) );
+  *def = -1;
+  switch (instr->format)
+  {
+    case 3:
+      SET_REG(use, instr->u.format3.reg);
+      break;
+    case 4:
+      *def = instr->u.format4.reg;
+      if (is_op(instr, OP_LDIMM2))
+        SET_REG(use, instr->u.format4.reg);
+      removable = 1;
+      break;
+    case 5:
+      if (is_op(instr, OP_LDBLKID) || is_op(instr, OP_LDNATIVE))
+      {
+        *def = instr->u.format5.reg;
+        removable = is_op(instr, OP_LDBLKID);
+      }
+      else
+        SET_REG(use, instr->u.format5.reg);
+      break;
+    case 6:
+    case 7:
+    case 10:
+      op = opcode_lookup(instr->opcode, instr->format);
+      if (op == OP_CALL || op == OP_CALLN)
+      {
+        memset( use, 0xFF, sizeof(regset) );
+        break;
+      }
+      // formats 6, 7 and 10 share the layout of their registers
+      SET_REG(use, instr->u.format10.reg2);
+      if (instr->format == 10)
+        SET_REG(use, instr->u.format10.reg3);
+      // the stores, and below the loads, are adjacent rows of isa.def
+      if (op >= OP_STB && op <= OP_STD_I)
+      {
+        SET_REG(use, instr->u.format10.reg1);
+        break;
+      }
+      *def = instr->u.format10.reg1;
+      removable = is_pure(op);
+      // side effects may read the register they write, too
+      if (!removable && !(op >= OP_LDB && op <= OP_LDD_I) &&
+          op != OP_DIVL && op != OP_DIVL_I && op != OP_DIVD &&
+          op != OP_REML && op != OP_REML_I)
+        SET_REG(use, instr->u.format10.reg1);
+      break;
+    case 8:
+      SET_REG(use, instr->u.format8.reg1);
+      SET_REG(use, instr->u.format8.reg2);
+      break;
+    case 11:
+      *def = instr->u.format11.reg;
+      removable = 1;
+      break;
+  }
+  // the frame and stack pointers and the pc are never dead
+  if (*def >= 13 && *def <= 15)
+    removable = 0;
+  return removable;
+}
+
+/*
+ * handler_live
+ *
+ * The registers live into any handler covering the block.
+ */
+static void handler_live( basic_block *blk, regset out )
+{
+  unsigned int s, w;
+  memset( out, 0, sizeof(regset) );
+  for (s = blk->first_handler; s < blk->num_succs; s += 1)
+  {
+    for (w = 0; w < REGSET_WORDS; w += 1)
+      out[w] |= blk->succs[s]->live_in[w];
+  }
+}
+
+/*
+ * transfer
+ *
+ * Walk the block backwards from live_out, leaving the registers live at
+ * its start in live. With remove set, statements writing a dead register
+ * are removed on the way. Returns the number removed.
+ */
+static int transfer( cfg *g, basic_block *blk, regset live, int remove )
+{
+  regset handlers, use;
+  unsigned int i, w;
+  int def, removed = 0;
+
+  handler_live( blk, handlers );
+  memcpy( live, blk->live_out, sizeof(regset) );
+  for (w = 0; w < REGSET_WORDS; w += 1)
+    live[w] |= handlers[w];
+
+  for (i = blk->end; i-- > blk->first; )
+  {
+    int removable;
+    if (!g->stmts[i] || g->stmts[i]->instr->format == 0)
+      continue;
+    removable = cfg_instr_regs( g->stmts[i]->instr, use, &def );
+    if (def >= 0)
+    {
+      if (remove && removable && !REG_BIT(live, def))
+      {
+        cfg_remove( g, i );
+        removed += 1;
+        continue;
+      }
+      live[def >> 5] &= ~(1u << (def & 31));
+    }
+    for (w = 0; w < REGSET_WORDS; w += 1)
+      live[w] |= use[w] | handlers[w];
+  }
+  return removed;
+}
+
+void cfg_liveness( cfg *g )
+{
+  int changed = 1;
+  unsigned int b, s, w;
+
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    memset( g->blocks[b].live_in, 0, sizeof(regset) );
+    memset( g->blocks[b].live_out, 0, sizeof(regset) );
+  }
+  // blocks are mostly in forward order, so go backwards
+  while (changed)
+  {
+    changed = 0;
+    for (b = g->num_blocks; b-- > 0; )
+    {
+      basic_block *blk = &g->blocks[b];
+      regset in;
+      for (s = 0; s < blk->first_handler; s += 1)
+      {
+        for (w = 0; w < REGSET_WORDS; w += 1)
+          blk->live_out[w] |= blk->succs[s]->live_in[w];
+      }
+      transfer( g, blk, in, 0 );
+      if (memcmp( in, blk->live_in, sizeof(regset) ))
+      {
+        memcpy( blk->live_in, in, sizeof(regset) );
+        changed = 1;
+      }
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////////
+// the passes
+
+/*
+ * optimize_func
+ *
+ * Remove unreachable code and then dead stores, until no more die.
+ */
+static void optimize_func( func_node *func, int *unreachable, int *dead )
+{
+  cfg *g = cfg_build( func );
+  unsigned int b, i;
+  int removed;
+
+  if (g->opaque || !g->num_blocks)
+  {
+    cfg_free( g );
+    return;
+  }
+
+  cfg_mark_reachable( g );
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    basic_block *blk = &g->blocks[b];
+    if (blk->reachable)
+      continue;
+    for (i = blk->first; i < blk->end; i += 1)
+    {
+      if (g->stmts[i]->instr->format != 0)
+      {
+        cfg_remove( g, i );
+        *unreachable += 1;
+      }
+    }
+  }
+
+  do
+  {
+    removed = 0;
+    cfg_liveness( g );
+    for (b = 0; b < g->num_blocks; b += 1)
+    {
+      regset in;
+      if (g->blocks[b].reachable && !g->blocks[b].has_data)
+        removed += transfer( g, &g->blocks[b], in, 1 );
+    }
+    *dead += removed;
+  } while (removed);
+
+  cfg_commit( g );
+  cfg_free( g );
+}
+
+void cfg_optimize_funcs( func_node *root, int *unreachable, int *dead )
+{
+  func_node *walk;
+  *unreachable = 0;
+  *dead = 0;
+  for (walk = root; walk; walk = walk->link)
+  {
+    optimize_func( walk, unreachable, dead );
+  }
+}
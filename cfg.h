@@ -0,0 +1,66 @@
+//
+// cfg.h - control flow graphs over xpvm function statement lists
+//
+// include defs.h first.
+//
+// cfg_build copies the function's statements into an array and splits
+// it into basic blocks. a block starts at the first statement, at a run
+// of labels, and after a jmp, btrue, bfalse, ret or throw, which end it.
+// blocks are kept in layout order, so block i + 1 is what block i falls
+// through to. every block inside an exception handler range also has an
+// edge to the handler, since any instruction in it may throw.
+//
+// passes change the function by removing statements from the array
+// (cfg_remove) and then writing the array back with cfg_commit.
+//
+
+// one bit per register
+#define REGSET_WORDS 8
+typedef unsigned int regset[REGSET_WORDS];
+
+typedef struct basic_block {
+  unsigned int        first;         // statements [first, end) of the cfg
+  unsigned int        end;
+  struct basic_block  *fall;         // block it falls through to, or NULL
+  struct basic_block  *target;       // block it branches to, or NULL
+  struct basic_block  **succs;       // all successors: flow, then handlers
+  unsigned int        num_succs;
+  unsigned int        first_handler; // succs[first_handler..] are handlers
+  int                 has_data;      // contains word or alloc directives
+  int                 is_root;       // entered other than by control flow
+  int                 reachable;
+  regset              live_in;
+  regset              live_out;
+} basic_block;
+
+typedef struct cfg {
+  func_node     *func;
+  stmt_node     **stmts;             // removed statements are NULL
+  unsigned int  num_stmts;
+  basic_block   *blocks;
+  unsigned int  num_blocks;
+  int           opaque;              // indirect jump, or a branch or
+                                     //   handler label outside the function
+} cfg;
+
+// build the graph for one function
+extern cfg *cfg_build( func_node * );
+
+// free the graph (not the statements)
+extern void cfg_free( cfg * );
+
+// set reachable on every block reachable from the entry or a root
+extern void cfg_mark_reachable( cfg * );
+
+// compute live_in and live_out for every block
+extern void cfg_liveness( cfg * );
+
+// registers instr reads and the one it writes (-1 if none)
+//   returns 1 if the instruction has no effect other than the write
+extern int cfg_instr_regs( INSTR *, regset use, int *def );
+
+// free statement i and remove it from the graph
+extern void cfg_remove( cfg *, unsigned int );
+
+// write the remaining statements back to the function
+extern void cfg_commit( cfg * );
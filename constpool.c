@@ -0,0 +1,402 @@
+/*
+ * constpool.c - wide constant materialization for the xpvm assembler
+ *
+ *               ldimm only carries a sign extended 16-bit constant, so
+ *               pass 1 leaves wider constants (and doubles) as format 11
+ *               statements. expand_constants then picks, per use site,
+ *               the cheapest way to get the value into the register:
+ *
+ *                 ldimm r, lo16                        (16-bit values)
+ *                 ldimm r, lo16; ldimm2 r, hi16        (32-bit values)
+ *                 ... followed by cvtld r, r           (integral doubles)
+ *                 ldl/ldd r, pc, offset                (constant pool)
+ *
+ *               ldimm2 replaces bits 16 and up of the register with its
+ *               sign extended constant, keeping bits 0-15.
+ *
+ *               The cost of a choice is the number of words it adds to
+ *               the block: a pool load is one instruction plus two words
+ *               of pool data the first time the value is pooled, so a
+ *               sequence wins for a value seen for the first time, and
+ *               the pool wins once the entry exists. Ties go to the pool,
+ *               which executes fewer instructions.
+ *
+ *               Pool loads reach their entry with an 8-bit offset, so
+ *               pool entries are dumped in islands within reach of their
+ *               first use: after an unconditional jmp, ret or throw when
+ *               there is one, otherwise behind a jmp around the island,
+ *               and at the end of the function. Entries are shared by
+ *               every later use that can still reach them.
+ *
+ *               The offset of ldl/ldd r, pc, offset is in words, like
+ *               the PC-relative displacements of the branches (with any
+ *               other base register it is in bytes). Each island starts
+ *               on an even word, padded with a zero word if need be, so
+ *               every entry is as 8-byte aligned as the block is.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+// furthest a pool load can reach forward (and one more back)
+#define POOL_REACH 127
+
+struct pool_entry {
+  long long value;
+  char *label;
+  unsigned int addr;      // address, once the island is placed
+  unsigned int first_use; // address of the first load from it
+  struct pool_entry *link;
+};
+
+// running count for generated labels
+static unsigned int num_labels = 0;
+
+static char *new_label( const char *prefix )
+{
+  char *label = malloc( strlen(prefix) + 12 );
+  if (!label)
+    fatal("malloc failed in new_label");
+  sprintf( label, "%s%u", prefix, num_labels++ );
+  // generated labels start with '_', which user labels can't
+  define_label( label );
+  return label;
+}
+
+// each statement has its own copy of a label it names, as one the
+// parser built does (with -s it is freed along with the statement)
+static char *copy_label( const char *label )
+{
+  char *copy = strdup( label );
+  if (!copy)
+    fatal("malloc failed in copy_label");
+  return copy;
+}
+
+static stmt_node *new_stmt( char *label, unsigned int format, char *opcode )
+{
+  stmt_node *stmt = calloc( 1, sizeof *stmt );
+  if (!stmt || !(stmt->instr = calloc( 1, sizeof *stmt->instr )))
+    fatal("malloc failed in new_stmt");
+  stmt->label = label;
+  stmt->instr->format = format;
+  stmt->instr->opcode = opcode;
+  return stmt;
+}
+
+static stmt_node *new_word( int value )
+{
+  stmt_node *stmt = new_stmt( NULL, 9, "word" );
+  stmt->instr->u.format9.constant = value;
+  return stmt;
+}
+
+static stmt_node *new_ldimm( char *opcode, unsigned int reg, int constant )
+{
+  stmt_node *stmt = new_stmt( NULL, 4, opcode );
+  stmt->instr->u.format4.reg = reg;
+  stmt->instr->u.format4.constant = constant;
+  return stmt;
+}
+
+static int fits_in( long long value, int bits )
+{
+  long long limit = 1LL << (bits - 1);
+  return value >= -limit && value < limit;
+}
+
+/*
+ * as_integer
+ *
+ * The integer a format 11 constant materializes from, if it has one
+ * that fits in 32 bits: the value itself, or the value of an integral
+ * double (exactly, so -0.0 does not qualify).
+ */
+static int as_integer( INSTR *instr, long long *out )
+{
+  long long value = instr->u.format11.value;
+  if (instr->u.format11.is_double)
+  {
+    double d, back;
+    memcpy( &d, &value, sizeof d );
+    if (!(d >= -2147483648.0 && d < 2147483648.0))
+      return 0;
+    value = (long long) d;
+    back = (double) value;
+    if (memcmp( &back, &instr->u.format11.value, sizeof back ))
+      return 0;
+  }
+  if (!fits_in( value, 32 ))
+    return 0;
+  *out = value;
+  return 1;
+}
+
+/*
+ * sequence_length
+ *
+ * Number of instructions needed to build the constant without the pool,
+ * or 0 if it can't be done.
+ */
+static unsigned int sequence_length( INSTR *instr )
+{
+  long long value;
+  if (!as_integer( instr, &value ))
+    return 0;
+  return (fits_in( value, 16 ) ? 1 : 2) + instr->u.format11.is_double;
+}
+
+/*
+ * expand_sequence
+ *
+ * Rewrite the statement in place into the ldimm (ldimm2, cvtld) sequence.
+ * Returns the last statement of the sequence.
+ */
+static stmt_node *expand_sequence( stmt_node *stmt )
+{
+  INSTR *instr = stmt->instr;
+  unsigned int reg = instr->u.format11.reg;
+  int is_double = instr->u.format11.is_double;
+  long long value;
+  stmt_node *last = stmt;
+
+  as_integer( instr, &value );
+  instr->format = 4;
+  instr->opcode = "ldimm";
+  instr->u.format4.reg = reg;
+  instr->u.format4.constant = (short) (value & 0xFFFF);
+
+  if (!fits_in( value, 16 ))
+  {
+    stmt_node *hi = new_ldimm( "ldimm2", reg, (short) ((value >> 16) & 0xFFFF) );
+    hi->link = last->link;
+    last->link = hi;
+    last = hi;
+  }
+  if (is_double)
+  {
+    stmt_node *cvt = new_stmt( NULL, 6, "cvtld" );
+    cvt->instr->u.format6.reg1 = reg;
+    cvt->instr->u.format6.reg2 = reg;
+    cvt->link = last->link;
+    last->link = cvt;
+    last = cvt;
+  }
+  return last;
+}
+
+static int is_unconditional( stmt_node *stmt )
+{
+  int op;
+  if (!stmt || stmt->instr->format == 0)
+    return 0;
+  op = opcode_lookup( stmt->instr->opcode, stmt->instr->format );
+  return op == OP_JMP || op == OP_RET || op == OP_THROW;
+}
+
+/*
+ * place_island
+ *
+ * Insert the pending pool entries at *link, which is at address addr,
+ * behind a jmp unless last (the instruction before) never falls through.
+ * Returns the link to continue from; *addr is advanced past the island.
+ */
+static stmt_node **place_island( stmt_node **link, unsigned int *addr,
+                                 stmt_node *last, struct pool_entry *pending,
+                                 int at_end )
+{
+  stmt_node *rest = *link;
+  char *over = NULL;
+
+  if (!at_end && !is_unconditional( last ))
+  {
+    stmt_node *jmp = new_stmt( NULL, 2, "jmp" );
+    over = new_label( "_island" );
+    jmp->instr->u.format2.addr = copy_label( over );
+    *link = jmp;
+    link = &jmp->link;
+    *addr += 1;
+  }
+
+  // 64-bit entries go on an even word
+  if (*addr & 1)
+  {
+    *link = new_word( 0 );
+    link = &(*link)->link;
+    *addr += 1;
+  }
+
+  for (; pending; pending = pending->link)
+  {
+    stmt_node *hi, *lo;
+    *link = new_stmt( pending->label, 0, NULL );
+    link = &(*link)->link;
+    pending->addr = *addr;
+    hi = new_word( (int) (pending->value >> 32) );
+    lo = new_word( (int) pending->value );
+    *link = hi;
+    hi->link = lo;
+    link = &lo->link;
+    *addr += 2;
+  }
+
+  if (over)
+  {
+    *link = new_stmt( over, 0, NULL );
+    link = &(*link)->link;
+  }
+  *link = rest;
+  return link;
+}
+
+/*
+ * expand_func
+ *
+ * Materialize every format 11 statement in the function.
+ * Returns 1 if anything changed.
+ */
+static int expand_func( func_node *func )
+{
+  struct pool_entry *placed = NULL;
+  struct pool_entry *pending = NULL;
+  struct pool_entry **pending_tail = &pending;
+  unsigned int num_pending = 0;
+  stmt_node **link = &func->stmt_list;
+  stmt_node *last = NULL;
+  unsigned int addr = 0;
+  int changed = 0;
+
+  while (*link)
+  {
+    stmt_node *stmt = *link;
+    INSTR *instr = stmt->instr;
+    unsigned int words = 1;
+
+    // would the pending entries fall out of reach after this statement?
+    // (the island adds a jmp, maybe a pad word, and the entries)
+    if (pending)
+    {
+      if (instr->format == 9 || instr->format == 12 || instr->format == 13)
+        words = stmt_words( instr );
+      else if (instr->format == 11)
+        words = 3;
+      if (addr + words + 2 + 2 * (num_pending + 1) >
+          pending->first_use + POOL_REACH)
+      {
+        link = place_island( link, &addr, last, pending, 0 );
+        while (pending)
+        {
+          struct pool_entry *next = pending->link;
+          pending->link = placed;
+          placed = pending;
+          pending = next;
+        }
+        pending_tail = &pending;
+        num_pending = 0;
+        last = NULL;
+        changed = 1;
+        continue;
+      }
+    }
+
+    if (instr->format == 11)
+    {
+      struct pool_entry *entry = NULL;
+      unsigned int seq = sequence_length( instr );
+
+      // an entry already placed behind us and still in reach?
+      for (entry = placed; entry; entry = entry->link)
+      {
+        if (entry->value == instr->u.format11.value &&
+            addr + 1 - entry->addr <= POOL_REACH + 1)
+          break;
+      }
+      // or one waiting for the next island?
+      if (!entry)
+      {
+        for (entry = pending; entry; entry = entry->link)
+        {
+          if (entry->value == instr->u.format11.value)
+            break;
+        }
+      }
+
+      if (!entry && seq && seq < 3)
+      {
+        last = expand_sequence( stmt );
+        addr += seq;
+        link = &last->link;
+        changed = 1;
+        continue;
+      }
+      if (!entry)
+      {
+        entry = calloc( 1, sizeof *entry );
+        if (!entry)
+          fatal("malloc failed in expand_func");
+        entry->value = instr->u.format11.value;
+        entry->label = new_label( "_pool" );
+        entry->first_use = addr;
+        *pending_tail = entry;
+        pending_tail = &entry->link;
+        num_pending += 1;
+      }
+      instr->opcode = instr->u.format11.is_double ? "ldd" : "ldl";
+      instr->u.format11.pool = copy_label( entry->label );
+      changed = 1;
+    }
+
+    if (instr->format != 0)
+    {
+      addr += stmt_words( instr );
+      last = stmt;
+    }
+    else
+    {
+      // an island right after a label would sit where the label points
+      last = NULL;
+    }
+    link = &stmt->link;
+  }
+
+  if (pending)
+  {
+    place_island( link, &addr, last, pending, 1 );
+    while (pending)
+    {
+      struct pool_entry *next = pending->link;
+      pending->link = placed;
+      placed = pending;
+      pending = next;
+    }
+  }
+
+  while (placed)
+  {
+    struct pool_entry *next = placed->link;
+    free(placed);
+    placed = next;
+  }
+  return changed;
+}
+
+/*
+ * expand_constants
+ *
+ * Materialize the wide constants of every function, then bring the
+ * addresses pass 1 computed up to date.
+ */
+void expand_constants( func_node *root )
+{
+  int changed = 0;
+  func_node *walk;
+  for (walk = root; walk; walk = walk->link)
+  {
+    changed |= expand_func( walk );
+  }
+  if (changed)
+  {
+    relayout_funcs( root );
+  }
+}
@@ -16,6 +16,12 @@
 //        0 indicates there is no instruction, only a label on the line
 //        1-8 indicate the eight instruction formats for vm520
 //        9 indicates that it is the "word" or "alloc" directive
+//        10 indicates three registers
+//        11 indicates a register and a constant that needs more than 16
+//          bits (64-bit integer or double); see constpool.c
+//        12 indicates a packed run of data words: a "words" or "fill"
+//          directive, or a "rept" block of data directives
+//        13 indicates an incbin directive; see incbin.c
 //   2. opcode
 //   3. union
 //        the union has a member for formats 2-8, which contain the
@@ -26,9 +32,9 @@
 //   registers are represented by their register number as an int
 //     sp, fp and pc has been converted already to 13, 14 and 15 respectively
 //   constants and offsets have been converted from ASCII and have been
-//     checked to be sure they fit in an int, but they have not been
-//     checked to see if they fit in either the 20 bits required by
-//     format 4 or the 16 bits required by format 7.
+//     checked to be sure they fit in an int (64 bits for format 11), but
+//     they have not been checked to see if they fit in either the 16 bits
+//     required by format 4 or the 8 bits required by format 7.
 //
 typedef struct instruction {
     unsigned int format;
@@ -70,12 +76,30 @@ typedef struct instruction {
         unsigned int reg2;
         unsigned int reg3;
       } format10;
+      struct format11 {
+        unsigned int reg;
+        long long value;      // the integer, or the bits of the double
+        int is_double;
+        char * pool;          // label of its constant pool entry, once pooled
+      } format11;
+      struct format12 {
+        int * values;
+        unsigned int num_values;
+        unsigned int repeat;  // the values are emitted this many times
+      } format12;
+      struct format13 {
+        char * path;
+        long long offset;     // in bytes
+        long long length;     // in bytes, -1 for the rest of the file
+      } format13;
     } u;
 } INSTR;
 
 struct stmt_node {
   char *label;
   INSTR *instr;
+  int disp;           // PC-relative label operand, from its fixup
+  int line;           // source line, 0 for one the assembler made
   struct stmt_node *link;
 } typedef stmt_node;
 
@@ -104,21 +128,104 @@ struct func_node {
   native_ref_node *native_ref_list;
   unsigned int num_native_refs;
   stmt_node *stmt_list;
+  unsigned long long *profile;  // execution count per word, from -p
+  unsigned int id;              // block id, in the order parsed
+  unsigned int attrs;           // ANNOT_ flags declared with attr
   struct func_node *link;
 } typedef func_node;
 
 void encode_funcs( func_node * );
+void encode_func( func_node * );
+
+// annotation word 0 flags
+//   the handler table is sorted by start and its ranges don't overlap
+#define ANNOT_SORTED_HANDLERS 0x1
+//   the attributes of the block, found by encode_func or declared with
+//   the attr directive (attr leaf, ...)
+//     leaf: no call or calln
+#define ANNOT_LEAF            0x2
+//     nothrow: no handlers, and nothing in it throws (throw, a division
+//     that can fault, or a call an exception can come back from)
+#define ANNOT_NO_THROW        0x4
+//     nonative: no calln or ldnative
+#define ANNOT_NO_NATIVE       0x8
+//     lowregs: names no register above r15, so its frame is 16
+#define ANNOT_LOW_REGS        0x10
+
+// set ANNOT_SORTED_HANDLERS on blocks with handlers (-x)
+extern int indexHandlers;
+
+// write a table of source lines by word offset in the aux data of each
+// block (-g): a word holding the number of entries, then per entry the
+// word offset and the line as deltas from the entry before (or 0),
+// varints of 7 bits a byte, low first, the line's zigzag encoded; zero
+// padded to a word
+extern int lineTable;
+
+// source line of the statement pass 1 is given next: set by the parser
+// as it reduces the opcode (yylineno is past the line by the time the
+// statement is), by read_ir from its line records, and by the builder
+// to the statement number
+extern int sourceLine;
 
 extern func_node *func_list;
 /* FIXME: Native refs should be handled in a cleaner way */
 extern native_ref_node *native_ref_list;
 extern func_node *process_func( char *, char *, handler_node *, stmt_node * );
 extern func_node *process_func_list( func_node *, func_node * );
+// func_list is built in reverse too, for the same reason
+extern func_node *reverse_func_list( func_node * );
+// attach the native references to a function just processed (and
+//   stream it, with -s); returns it, or NULL if it isn't kept
+extern func_node *finish_func( func_node * );
+// the rest of pass 1 on the whole (reversed) func_list
+extern void finish_program( func_node * );
 extern handler_node *process_handler( char *, char *, char *);
 extern handler_node *process_handler_list( handler_node *, handler_node *);
 extern stmt_node *process_stmt( char *, INSTR * );
 extern stmt_node *process_stmt_list( stmt_node *, stmt_node * );
+// stmt_list is built in reverse, so long functions don't grow the
+//   parser stack; the func and rept rules put it back in order
+extern stmt_node *reverse_stmt_list( stmt_node * );
+// data directives (format 12)
+extern INSTR *process_data( char *, int, int );
+extern INSTR *process_data_list( INSTR *, int );
+extern stmt_node *process_rept( int, stmt_node * );
 extern void verify_handlers( func_node * );
+extern unsigned int native_ref_list_length( native_ref_node * );
+// number of words a statement takes in the block
+extern unsigned int stmt_words( INSTR * );
+// recompute addresses after statements were inserted or removed
+extern void relayout_funcs( func_node * );
+// the number of registers a call of the function needs (at least 16)
+extern unsigned int frame_size( func_node * );
+// define a label generated by the assembler itself
+extern void define_label( char * );
+// is the id named in an export directive?
+extern int is_exported( char * );
+// is the id defined as a label or function?
+extern int is_defined( char * );
+// wide constant materialization (constpool.c)
+extern void expand_constants( func_node * );
+// peephole optimizer (peephole.c)
+//   returns the number of instructions removed
+extern int peephole_funcs( func_node * );
+// unreachable code and dead store elimination (cfg.c)
+//   sets the number of instructions removed by each
+extern void cfg_optimize_funcs( func_node *, int *unreachable, int *dead );
+// profile guided block layout (layout.c)
+//   read_profile returns 0, or -1 if the profile is malformed
+//   layout_funcs returns the number of functions laid out again
+extern int read_profile( FILE *, func_node * );
+extern int layout_funcs( func_node * );
+// profile guided function ordering (funcorder.c)
+//   returns the new list and sets the number of functions that moved;
+//   main and exported functions keep their places
+extern func_node *order_funcs( func_node *, int *moved );
+// register compaction (regcompact.c)
+//   reports each function it renamed registers in on report, unless it
+//   is NULL, and returns their number
+extern int compact_regs_funcs( func_node *, FILE *report );
 // called to process one line of input
 //   called on each pass
 extern void assemble(char *, INSTR);
@@ -128,6 +235,146 @@ extern void initAssemble(void);
 //   returns number of errors detected during the first pass
 extern int betweenPasses(FILE *);
 
+// the file the blocks are encoded to
+extern void set_output(FILE *);
+
+// resolve the label operands of a function for the encoder thread
+//   returns 0, 1 if a label isn't defined (and sets it), or -1
+extern int resolve_func( func_node *, char **label );
+
+////////////////////////////////////////////////////////////////////////////
+// object file string table (strtab.c)
+
+// offset of the string in the table, adding it if it is new
+extern unsigned int strtab_intern( const char * );
+
+// the table so far and its length in bytes
+extern const char *strtab_data( unsigned int * );
+
+// the same for a table of another file's own
+struct strtab;
+extern struct strtab *strtab_new( void );
+extern unsigned int strtab_add( struct strtab *, const char * );
+extern const char *strtab_contents( struct strtab *, unsigned int * );
+
+////////////////////////////////////////////////////////////////////////////
+// binary file inclusion (incbin.c)
+
+// size of the regular file in bytes, or -1
+extern long long incbin_file_size( const char * );
+
+// set once an incbin is seen, since the output then depends on more
+//   than the source
+extern int incbin_used;
+
+// copy length bytes at offset of the file to the object file, padded
+//   with zeros to a whole word
+extern void incbin_copy( const char *, long long offset, unsigned int length,
+                         FILE * );
+
+// copy n bytes at offset of the file descriptor to the end of the file
+//   returns 0, or -1 if the bytes couldn't be read or written
+extern int copy_range( int, long long offset, unsigned long long n, FILE * );
+
+////////////////////////////////////////////////////////////////////////////
+// streaming encoder (stream.c)
+
+// encode each function as soon as it is parsed (-s)
+extern int streamFuncs;
+
+// start and stop the encoder thread around the first pass
+//   stream_end returns the number of errors it reported
+extern void stream_begin( void );
+extern int stream_end( void );
+
+// hand a parsed function to the encoder thread
+//   returns the function if it isn't streamed, else NULL
+extern func_node *stream_func( func_node * );
+
+// id of the named block, or 0 with the word at that offset patched
+//   once the block is known (called by the encoder thread)
+extern unsigned int stream_blk_id( const char *, long at, unsigned int word );
+
+// id of the named block, or -1; and the name of a block, or NULL
+extern int stream_lookup( const char * );
+extern char *stream_block( unsigned int id );
+
+// copy the encoded blocks to the object file and patch them
+extern void stream_finish( FILE * );
+
+////////////////////////////////////////////////////////////////////////////
+// binary input format (ir.c)
+
+// convert the source to the binary format as it is parsed (-c)
+extern int irConvert;
+
+// record the parser's calls into pass 1 (from the process_ functions)
+extern void ir_handler( char *, char *, char * );
+extern void ir_stmt( char *, INSTR * );
+extern void ir_rept( int, stmt_node * );
+extern void ir_func( char *, char * );
+
+// write the records so far as a binary input file
+extern void ir_write( FILE * );
+
+// is the input a binary input file?
+extern int is_ir( FILE * );
+
+// run pass 1 over a binary input file, in place of the parser
+//   returns 0, or -1 if it is malformed (and counted as a parse error)
+extern int read_ir( FILE * );
+
+////////////////////////////////////////////////////////////////////////////
+// driver (main.c)
+
+// run both passes over a source, writing the object file
+//   returns the number of errors
+extern int assembleFile( FILE *in, FILE *out );
+
+////////////////////////////////////////////////////////////////////////////
+// assembler server (serve.c)
+
+// accept sources on the Unix domain socket until killed
+extern int serve( const char *path );
+
+////////////////////////////////////////////////////////////////////////////
+// object cache (objcache.c)
+
+// look the assembly up in the cache named by XPAS_CACHE_DIR, if any
+//   returns 1 if the object file was placed at the output name
+extern int cache_lookup( const char *in, const char *options,
+                         const char *profile, const char *out );
+
+// store the object file of an assembly that missed
+extern void cache_store( const char *out );
+
+////////////////////////////////////////////////////////////////////////////
+// opcode table (opcodes.c), generated from isa.def
+//
+// one entry per (mnemonic, format), indexed by OP_ id; encoding 0xFF
+// marks a directive. the table is terminated by an entry with a NULL
+// opcode.
+//
+struct opcodeInfo
+{
+   char*          opcode;
+   int            format;
+   unsigned char  encoding;
+};
+
+extern struct opcodeInfo opcodes[];
+
+// the OP_ ids
+#include "isa.h"
+
+// look up the row of a mnemonic for an instruction format
+//   returns its OP_ id, -1 for an unknown mnemonic, or -2 if the mnemonic
+//   doesn't take that format
+extern int opcode_lookup( const char *mnemonic, unsigned int format );
+
+// the table's own copy of a mnemonic, or NULL if there is no such opcode
+extern char *opcode_name( const char *mnemonic );
+
 ////////////////////////////////////////////////////////////////////////////
 // error message routines (error.c)
 
@@ -0,0 +1,58 @@
+//
+// exception_build.c - exception_test.asm, built with libxpas.a
+//
+// an example of the xpas.h calls: it builds the program of
+// exception_test.asm statement by statement and writes its object file,
+// which is the one xpas writes for the source ("make check_build"
+// compares the two).
+//
+// usage: exception_build file.obj
+//
+
+#include <stdio.h>
+#include "xpas.h"
+
+int main(int argc, char *argv[])
+{
+  xpas_ctx *ctx;
+  FILE *out;
+  int errors;
+
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: exception_build file.obj\n");
+    return 1;
+  }
+  if (!(out = fopen(argv[1], "w")))
+  {
+    fprintf(stderr, "can't open %s\n", argv[1]);
+    return 1;
+  }
+
+  ctx = xpas_begin();
+
+  // func main
+  xpas_func_begin(ctx, "main");
+  xpas_handler(ctx, "handle", "start", "stop");
+  xpas_emit_rc(ctx, OP_LDIMM, 5, 0);
+  xpas_emit_rc(ctx, OP_LDIMM, 6, 1);
+  xpas_label(ctx, "start");
+  xpas_emit_rrr(ctx, OP_DIVL, 7, 6, 5);
+  xpas_label(ctx, "stop");
+  xpas_emit_r(ctx, OP_RET, 7);
+  xpas_label(ctx, "handle");
+  xpas_emit_rc(ctx, OP_LDIMM, 10, -1);
+  xpas_emit_rr(ctx, OP_CVTLD, 10, 10);
+  xpas_emit_r(ctx, OP_RET, 10);
+  xpas_func_end(ctx);
+
+  errors = xpas_end(ctx, out);
+  if (fclose(out) && !errors)
+  {
+    fprintf(stderr, "write failed for %s\n", argv[1]);
+    errors = 1;
+  }
+  if (errors)
+    remove(argv[1]);
+  return errors != 0;
+}
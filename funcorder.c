@@ -0,0 +1,317 @@
+/*
+ * funcorder.c - profile guided function ordering for the xpvm assembler
+ *
+ *               Uses the counts read_profile attached to the functions
+ *               (see layout.c), so it has to run before layout_funcs.
+ *
+ *               Each call site weighs the edge between caller and callee
+ *               with its execution count. The callee is found by following
+ *               the ldblkid that loaded the register call names, within
+ *               the same block. Functions are then clustered greedily along
+ *               the heaviest edges, each merge putting the two ends of the
+ *               edge next to each other, and the clusters are laid out
+ *               hottest first (by the total count of their functions).
+ *
+ *               main and exported functions keep their place in the list,
+ *               so their block ids don't change; the rest fill the other
+ *               places in cluster order. ldblkid operands need no fixing,
+ *               since get_blk_id numbers blocks by their place in the list
+ *               when they are encoded.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+struct call_edge {
+  unsigned int caller;
+  unsigned int callee;
+  unsigned long long weight;
+};
+
+struct cluster {
+  unsigned int *members;       // function indices, in order
+  unsigned int num_members;
+  unsigned long long heat;
+  unsigned int first;          // lowest original index, for ties
+};
+
+struct name_index {
+  char *name;
+  unsigned int index;
+};
+
+static void *order_alloc( size_t n, size_t size )
+{
+  void *p = calloc( n ? n : 1, size );
+  if (!p)
+    fatal("malloc failed in order_funcs");
+  return p;
+}
+
+static int compare_names( const void *a, const void *b )
+{
+  return strcmp(((const struct name_index *) a)->name,
+                ((const struct name_index *) b)->name);
+}
+
+static int compare_pairs( const void *a, const void *b )
+{
+  const struct call_edge *x = a;
+  const struct call_edge *y = b;
+  if (x->caller != y->caller)
+    return x->caller < y->caller ? -1 : 1;
+  return x->callee < y->callee ? -1 : x->callee > y->callee;
+}
+
+static int compare_weights( const void *a, const void *b )
+{
+  const struct call_edge *x = a;
+  const struct call_edge *y = b;
+  if (x->weight != y->weight)
+    return x->weight < y->weight ? 1 : -1;
+  return compare_pairs( a, b );
+}
+
+static int compare_clusters( const void *a, const void *b )
+{
+  const struct cluster *x = *(const struct cluster * const *) a;
+  const struct cluster *y = *(const struct cluster * const *) b;
+  if (x->heat != y->heat)
+    return x->heat < y->heat ? 1 : -1;
+  return x->first < y->first ? -1 : x->first > y->first;
+}
+
+static void reverse( unsigned int *v, unsigned int n )
+{
+  unsigned int i, t;
+  for (i = 0; i < n / 2; i += 1)
+  {
+    t = v[i];
+    v[i] = v[n - 1 - i];
+    v[n - 1 - i] = t;
+  }
+}
+
+/*
+ * find_calls
+ *
+ * Append an edge for every profiled call site of func to edges.
+ * Returns the new number of edges.
+ */
+static unsigned int find_calls( func_node *func, unsigned int caller,
+                                struct name_index *names, unsigned int n,
+                                struct call_edge **edges,
+                                unsigned int num_edges, unsigned int *max )
+{
+  char *loaded[256];
+  stmt_node *walk;
+  unsigned int addr = 0;
+
+  memset( loaded, 0, sizeof loaded );
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    INSTR *instr = walk->instr;
+    unsigned int words = stmt_words( instr );
+
+    if (instr->format == 0)
+      memset( loaded, 0, sizeof loaded );
+    else if (instr->format == 5 &&
+             opcode_lookup(instr->opcode, 5) == OP_LDBLKID)
+      loaded[instr->u.format5.reg & 0xFF] = instr->u.format5.addr;
+    else if (instr->format == 6 && opcode_lookup(instr->opcode, 6) == OP_CALL)
+    {
+      char *callee = loaded[instr->u.format6.reg2 & 0xFF];
+      struct name_index key, *found;
+      key.name = callee;
+      if (callee && addr < func->length && func->profile[addr] &&
+          (found = bsearch( &key, names, n, sizeof *names, compare_names )))
+      {
+        if (num_edges == *max)
+        {
+          *max = *max ? 2 * *max : 64;
+          *edges = realloc( *edges, *max * sizeof **edges );
+          if (!*edges)
+            fatal("malloc failed in order_funcs");
+        }
+        (*edges)[num_edges].caller = caller;
+        (*edges)[num_edges].callee = found->index;
+        (*edges)[num_edges].weight = func->profile[addr];
+        num_edges += 1;
+      }
+      // the call may write any register
+      memset( loaded, 0, sizeof loaded );
+    }
+    else if (instr->format == 4 || instr->format == 5 ||
+             instr->format == 6 || instr->format == 7 ||
+             instr->format == 10 || instr->format == 11)
+    {
+      // every format with a register writes its first one, or not at all
+      loaded[instr->u.format10.reg1 & 0xFF] = NULL;
+    }
+    else if (instr->format == 2 || instr->format == 3)
+      memset( loaded, 0, sizeof loaded );
+    addr += words;
+  }
+  return num_edges;
+}
+
+func_node *order_funcs( func_node *root, int *moved )
+{
+  func_node **funcs, *walk;
+  struct name_index *names;
+  struct call_edge *edges = NULL;
+  struct cluster *clusters, **sorted;
+  unsigned int *cluster_of, *pinned, *order;
+  unsigned int n = 0, num_edges = 0, max_edges = 0, i, j, k, slot;
+  int profiled = 0;
+
+  *moved = 0;
+  for (walk = root; walk; walk = walk->link)
+  {
+    n += 1;
+    profiled |= walk->profile != NULL;
+  }
+  if (!profiled || n < 2)
+    return root;
+
+  funcs = order_alloc( n, sizeof *funcs );
+  names = order_alloc( n, sizeof *names );
+  for (i = 0, walk = root; walk; walk = walk->link, i += 1)
+  {
+    funcs[i] = walk;
+    names[i].name = walk->name;
+    names[i].index = i;
+  }
+  qsort( names, n, sizeof *names, compare_names );
+
+  // the call graph, with the edges between two functions added up
+  for (i = 0; i < n; i += 1)
+  {
+    if (funcs[i]->profile)
+      num_edges = find_calls( funcs[i], i, names, n, &edges, num_edges,
+                              &max_edges );
+  }
+  if (num_edges)
+  {
+    for (k = 0; k < num_edges; k += 1)
+    {
+      // undirected
+      if (edges[k].caller > edges[k].callee)
+      {
+        unsigned int t = edges[k].caller;
+        edges[k].caller = edges[k].callee;
+        edges[k].callee = t;
+      }
+    }
+    qsort( edges, num_edges, sizeof *edges, compare_pairs );
+    for (j = 0, k = 1; k < num_edges; k += 1)
+    {
+      if (!compare_pairs( &edges[j], &edges[k] ))
+        edges[j].weight += edges[k].weight;
+      else
+        edges[++j] = edges[k];
+    }
+    num_edges = j + 1;
+    qsort( edges, num_edges, sizeof *edges, compare_weights );
+  }
+
+  // one cluster per function to start
+  clusters = order_alloc( n, sizeof *clusters );
+  cluster_of = order_alloc( n, sizeof *cluster_of );
+  pinned = order_alloc( n, sizeof *pinned );
+  for (i = 0; i < n; i += 1)
+  {
+    unsigned int w;
+    clusters[i].members = order_alloc( 1, sizeof *clusters[i].members );
+    clusters[i].members[0] = i;
+    clusters[i].num_members = 1;
+    clusters[i].first = i;
+    for (w = 0; funcs[i]->profile && w < funcs[i]->length; w += 1)
+      clusters[i].heat += funcs[i]->profile[w];
+    cluster_of[i] = i;
+    pinned[i] = !strcmp(funcs[i]->name, "main") || is_exported(funcs[i]->name);
+  }
+
+  // merge along the heaviest edges, ends of the edge adjacent
+  for (k = 0; k < num_edges; k += 1)
+  {
+    unsigned int u = edges[k].caller, v = edges[k].callee;
+    struct cluster *a = &clusters[cluster_of[u]];
+    struct cluster *b = &clusters[cluster_of[v]];
+    unsigned int pu, pv;
+
+    if (a == b || pinned[u] || pinned[v])
+      continue;
+    for (pu = 0; a->members[pu] != u; pu += 1)
+      ;
+    for (pv = 0; b->members[pv] != v; pv += 1)
+      ;
+    if (pu < a->num_members - 1 - pu)
+      reverse( a->members, a->num_members );
+    if (pv > b->num_members - 1 - pv)
+      reverse( b->members, b->num_members );
+
+    a->members = realloc( a->members, (a->num_members + b->num_members) *
+                                      sizeof *a->members );
+    if (!a->members)
+      fatal("malloc failed in order_funcs");
+    for (j = 0; j < b->num_members; j += 1)
+    {
+      a->members[a->num_members++] = b->members[j];
+      cluster_of[b->members[j]] = a - clusters;
+    }
+    a->heat += b->heat;
+    if (b->first < a->first)
+      a->first = b->first;
+    free(b->members);
+    b->members = NULL;
+    b->num_members = 0;
+  }
+
+  // hottest clusters first into the places the pinned functions leave
+  sorted = order_alloc( n, sizeof *sorted );
+  order = order_alloc( n, sizeof *order );
+  for (i = 0, j = 0; i < n; i += 1)
+  {
+    if (clusters[i].num_members && !pinned[clusters[i].members[0]])
+      sorted[j++] = &clusters[i];
+  }
+  qsort( sorted, j, sizeof *sorted, compare_clusters );
+
+  for (slot = 0; slot < n && pinned[slot]; slot += 1)
+    ;
+  for (i = 0; i < j; i += 1)
+  {
+    for (k = 0; k < sorted[i]->num_members; k += 1)
+    {
+      unsigned int f = sorted[i]->members[k];
+      *moved += f != slot;
+      order[slot] = f;
+      for (slot += 1; slot < n && pinned[slot]; slot += 1)
+        ;
+    }
+  }
+  for (i = 0; i < n; i += 1)
+  {
+    if (pinned[i])
+      order[i] = i;
+  }
+  for (i = 0; i < n; i += 1)
+  {
+    funcs[order[i]]->link = i + 1 < n ? funcs[order[i + 1]] : NULL;
+  }
+  root = funcs[order[0]];
+
+  for (i = 0; i < n; i += 1)
+    free(clusters[i].members);
+  free(clusters);
+  free(cluster_of);
+  free(pinned);
+  free(sorted);
+  free(order);
+  free(edges);
+  free(names);
+  free(funcs);
+  return root;
+}
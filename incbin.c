@@ -0,0 +1,105 @@
+/*
+ * incbin.c - splice binary files into the object file
+ *
+ *            The bytes of an incbin directive go straight from the input
+ *            file to the object file: copy_file_range lets the kernel
+ *            move (or share) them without a trip through user space, and
+ *            a read/write loop covers the file systems it doesn't
+ *            support. Either way they never pass through outputWord.
+ *            An object file in memory (the server's, see serve.c) has no
+ *            descriptor, and is written through stdio.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "defs.h"
+
+int incbin_used = 0;
+
+long long incbin_file_size( const char *path )
+{
+  struct stat st;
+  incbin_used = 1;
+  if (stat( path, &st ) < 0 || !S_ISREG(st.st_mode))
+    return -1;
+  return st.st_size;
+}
+
+/*
+ * copy_chunks
+ *
+ * The fallback: copy n bytes from in to out through a buffer, to its
+ * descriptor fd, or through stdio if fd is -1.
+ */
+static int copy_chunks( int in, off_t offset, FILE *out, int fd, size_t n )
+{
+  static char buf[1 << 16];
+
+  if (lseek( in, offset, SEEK_SET ) < 0)
+    return -1;
+  while (n)
+  {
+    ssize_t got = read( in, buf, n < sizeof buf ? n : sizeof buf );
+    ssize_t put, done;
+    if (got <= 0)
+      return -1;
+    if (fd < 0 && fwrite( buf, 1, got, out ) != (size_t) got)
+      return -1;
+    for (done = 0; fd >= 0 && done < got; done += put)
+    {
+      if ((put = write( fd, buf + done, got - done )) < 0)
+        return -1;
+    }
+    n -= got;
+  }
+  return 0;
+}
+
+int copy_range( int in, long long offset, unsigned long long n, FILE *out )
+{
+  off_t at = offset;
+  int fd;
+
+  // the bytes go out under stdio, so empty its buffer first
+  if (fflush( out ))
+    return -1;
+  fd = fileno( out );
+
+  while (n && fd >= 0)
+  {
+    ssize_t copied = copy_file_range( in, &at, fd, NULL, n, 0 );
+    if (copied < 0 && (errno == EXDEV || errno == EINVAL ||
+                       errno == ENOSYS || errno == EOPNOTSUPP))
+      break;
+    if (copied <= 0)
+      return -1;
+    n -= copied;
+  }
+  if (n && copy_chunks( in, at, out, fd, n ))
+    return -1;
+
+  // and stdio picks up where the copy left off
+  return fseek( out, 0, SEEK_END ) ? -1 : 0;
+}
+
+void incbin_copy( const char *path, long long offset, unsigned int length,
+                  FILE *out )
+{
+  static const char zeros[3];
+  unsigned int pad = -length & 3;
+  int in;
+
+  if ((in = open( path, O_RDONLY )) < 0)
+    fatal("can't open %s for incbin", path);
+  if (copy_range( in, offset, length, out ))
+    fatal("%s changed or could not be read during incbin", path);
+  close( in );
+
+  // words are whole, so the last one is padded with zeros
+  if (pad && fwrite( zeros, 1, pad, out ) != pad)
+    fatal("write failed for the object file");
+}
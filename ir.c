@@ -0,0 +1,557 @@
+/*
+ * ir.c - binary input format for the xpvm assembler
+ *
+ *        A compiler can hand xpas its program as binary records rather
+ *        than as text, so nothing is lexed or parsed. The records are
+ *        the calls the parser makes into the assembler, in the order it
+ *        makes them; read_ir maps the file and makes the same calls, so
+ *        the functions go down the same pipeline and the object file is
+ *        the same. xpas -c file.asm converts a source to file.xir.
+ *
+ *        Words are big endian, like the object file:
+ *
+ *          header   word magic ("XPIR"), word version (3),
+ *                   word string table offset, word its length in bytes
+ *          records  from byte 16 up to the string table
+ *          strings  NUL terminated; every name in a record is the byte
+ *                   offset of its string. the table is the file's own,
+ *                   not the one of the object file being assembled
+ *
+ *        Each record starts with a word kind << 24 | a << 16 | b << 8 | c.
+ *
+ *          kind 0-13   a statement of that INSTR format (0 is a label);
+ *                      a, b and c are its registers in operand order
+ *          kind 0x40   exception; words handle, start and end label
+ *          kind 0x41   rept; words count and n, folding the n statements
+ *                      before it into one
+ *          kind 0x42   func; words name and end name, closing the
+ *                      exception records and statements since the last
+ *          kind 0x43   line; word the source line of the statements
+ *                      after it (version 2; xpas -c writes one wherever
+ *                      the line changes)
+ *
+ *        A statement is followed by a word naming its label (kind 0) or
+ *        by its opcode id, then by its other operands. The id is the
+ *        OP_ id of the row of isa.def for the opcode and format, so the
+ *        reader needs no lookup, and the version changes whenever rows
+ *        are reordered (versions 1 and 2 named the opcode instead):
+ *
+ *          2, 5, 8     word label
+ *          4, 7, 9     word constant
+ *          11          word is_double, then the value, high word first
+ *          12          words num_values and repeat, then the values
+ *                      (words with one value, which the parser makes a
+ *                      format 9 statement, is written as format 12)
+ *          13          word path, then offset and length, high words
+ *                      first
+ *
+ *        Errors in the program are reported with the record number as
+ *        the line, or with the source line once there are line records.
+ *        An opcode without a row for its operands can't be written, so
+ *        xpas -c counts it as an error (pass 1 reports it).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defs.h"
+
+#define IR_MAGIC 0x58504952
+#define IR_VERSION 3
+
+#define IR_HANDLER 0x40
+#define IR_REPT 0x41
+#define IR_FUNC 0x42
+#define IR_LINE 0x43
+
+extern int yylineno;
+extern unsigned int parseErrorCount;
+
+int irConvert = 0;
+
+// the records converted so far (xpas -c), and the names they hold
+static unsigned int *words;
+static unsigned int numWords, maxWords;
+static struct strtab *names;
+
+static unsigned int put_name( const char *s )
+{
+  if (!names)
+    names = strtab_new();
+  return strtab_add( names, s );
+}
+
+static void put( unsigned int word )
+{
+  if (numWords == maxWords)
+  {
+    maxWords = maxWords ? 2 * maxWords : 1024;
+    if (!(words = realloc( words, maxWords * sizeof *words )))
+      fatal("malloc failed in the IR converter");
+  }
+  words[numWords++] = word;
+}
+
+static void put_long( long long value )
+{
+  put( (unsigned long long) value >> 32 );
+  put( value );
+}
+
+// the source line of the statement records after it, if it changed
+static void put_line( void )
+{
+  static int line = 0;
+  if (sourceLine != line)
+  {
+    line = sourceLine;
+    put( IR_LINE << 24 );
+    put( line );
+  }
+}
+
+void ir_handler( char *handle, char *start, char *end )
+{
+  put( IR_HANDLER << 24 );
+  put( put_name( handle ) );
+  put( put_name( start ) );
+  put( put_name( end ) );
+}
+
+void ir_stmt( char *label, INSTR *instr )
+{
+  unsigned int format = instr->format, a = 0, b = 0, c = 0, i;
+  int op = 0;
+
+  // words with one value is a format 12 run of one, as pass 1 makes it
+  if (format == 9 && opcode_lookup( instr->opcode, 12 ) == OP_WORDS)
+    format = 12;
+  if (format != 0 && (op = opcode_lookup( instr->opcode, format )) < 0)
+  {
+    parseErrorCount += 1;
+    return;
+  }
+
+  put_line();
+  switch (format)
+  {
+    case 3: a = instr->u.format3.reg; break;
+    case 4: a = instr->u.format4.reg; break;
+    case 5: a = instr->u.format5.reg; break;
+    case 6: a = instr->u.format6.reg1; b = instr->u.format6.reg2; break;
+    case 7: a = instr->u.format7.reg1; b = instr->u.format7.reg2; break;
+    case 8: a = instr->u.format8.reg1; b = instr->u.format8.reg2; break;
+    case 10:
+      a = instr->u.format10.reg1;
+      b = instr->u.format10.reg2;
+      c = instr->u.format10.reg3;
+      break;
+    case 11: a = instr->u.format11.reg; break;
+  }
+  put( format << 24 | (a & 0xFF) << 16 | (b & 0xFF) << 8 | (c & 0xFF) );
+  if (format == 0)
+  {
+    put( put_name( label ) );
+    return;
+  }
+  put( op );
+  switch (format)
+  {
+    case 2: put( put_name( instr->u.format2.addr ) ); break;
+    case 5: put( put_name( instr->u.format5.addr ) ); break;
+    case 8: put( put_name( instr->u.format8.addr ) ); break;
+    case 4: put( instr->u.format4.constant ); break;
+    case 7: put( instr->u.format7.const8 ); break;
+    case 9: put( instr->u.format9.constant ); break;
+    case 11:
+      put( instr->u.format11.is_double );
+      put_long( instr->u.format11.value );
+      break;
+    case 12:
+      if (instr->format == 9)
+      {
+        put( 1 );
+        put( 1 );
+        put( instr->u.format9.constant );
+        break;
+      }
+      put( instr->u.format12.num_values );
+      put( instr->u.format12.repeat );
+      for (i = 0; i < instr->u.format12.num_values; i += 1)
+        put( instr->u.format12.values[i] );
+      break;
+    case 13:
+      put( put_name( instr->u.format13.path ) );
+      put_long( instr->u.format13.offset );
+      put_long( instr->u.format13.length );
+      break;
+  }
+}
+
+void ir_rept( int count, stmt_node *body )
+{
+  unsigned int n = 0;
+  for (; body; body = body->link)
+    n += 1;
+  put_line();
+  put( IR_REPT << 24 );
+  put( count );
+  put( n );
+}
+
+void ir_func( char *id1, char *id2 )
+{
+  put( IR_FUNC << 24 );
+  put( put_name( id1 ) );
+  put( put_name( id2 ) );
+}
+
+static void output_word( unsigned int word, FILE *out )
+{
+  putc( word >> 24, out );
+  putc( word >> 16, out );
+  putc( word >> 8, out );
+  putc( word, out );
+}
+
+void ir_write( FILE *out )
+{
+  unsigned int length = 0, i;
+  const char *strings = names ? strtab_contents( names, &length ) : NULL;
+
+  output_word( IR_MAGIC, out );
+  output_word( IR_VERSION, out );
+  output_word( 16 + 4 * numWords, out );
+  output_word( length, out );
+  for (i = 0; i < numWords; i += 1)
+    output_word( words[i], out );
+  if (length)
+    fwrite( strings, 1, length, out );
+}
+
+int is_ir( FILE *in )
+{
+  unsigned char head[4];
+  int ir = fread( head, 1, 4, in ) == 4 &&
+           (head[0] << 24 | head[1] << 16 | head[2] << 8 | head[3]) ==
+           IR_MAGIC;
+  rewind( in );
+  return ir;
+}
+
+// the file being read
+static const unsigned char *image;
+static unsigned int at, end, version;
+static const char *strings;
+static unsigned int stringsLength;
+
+static int get( unsigned int *word )
+{
+  if (end - at < 4)
+    return 0;
+  *word = image[at] << 24 | image[at + 1] << 16 | image[at + 2] << 8 |
+          image[at + 3];
+  at += 4;
+  return 1;
+}
+
+static int get_long( long long *value )
+{
+  unsigned int high, low;
+  if (!get( &high ) || !get( &low ))
+    return 0;
+  *value = (long long) ((unsigned long long) high << 32 | low);
+  return 1;
+}
+
+// the string at offset in the table, or NULL if it isn't one
+static char *get_string( void )
+{
+  unsigned int offset;
+  if (!get( &offset ) || offset >= stringsLength ||
+      !memchr( strings + offset, '\0', stringsLength - offset ))
+    return NULL;
+  return (char *) strings + offset;
+}
+
+// a string the statements or handlers keep; with -s they are freed once
+// encoded (see stream.c), as the parser's would be, so it is a copy
+static char *get_kept_string( void )
+{
+  char *s = get_string();
+  if (s && streamFuncs && !(s = strdup( s )))
+    fatal("malloc failed in read_ir");
+  return s;
+}
+
+/*
+ * read_stmt
+ *
+ * Read the rest of a statement record into a new INSTR, as the grammar
+ * would have built it. Returns NULL if the record is cut short.
+ */
+static INSTR *read_stmt( unsigned int head, char **label )
+{
+  unsigned int format = head >> 24, a = head >> 16 & 0xFF;
+  unsigned int b = head >> 8 & 0xFF, c = head & 0xFF;
+  unsigned int n, i, word;
+  INSTR *instr = calloc( 1, sizeof *instr );
+
+  if (!instr)
+    fatal("malloc failed in read_ir");
+  instr->format = format;
+  *label = NULL;
+  if (format == 0)
+  {
+    if (!(*label = get_kept_string()))
+      return NULL;
+    return instr;
+  }
+  if (version < 3)
+  {
+    if (!(instr->opcode = get_string()))
+      return NULL;
+  }
+  else
+  {
+    // the row must be for this format, so pass 1 finds it again
+    if (!get( &word ) || word >= NUM_OPS || opcodes[word].format != format)
+      return NULL;
+    instr->opcode = opcodes[word].opcode;
+  }
+  switch (format)
+  {
+    case 1:
+      break;
+    case 2:
+      if (!(instr->u.format2.addr = get_kept_string()))
+        return NULL;
+      break;
+    case 3:
+      instr->u.format3.reg = a;
+      break;
+    case 4:
+      instr->u.format4.reg = a;
+      if (!get( &word ))
+        return NULL;
+      instr->u.format4.constant = word;
+      break;
+    case 5:
+      instr->u.format5.reg = a;
+      if (!(instr->u.format5.addr = get_kept_string()))
+        return NULL;
+      break;
+    case 6:
+      instr->u.format6.reg1 = a;
+      instr->u.format6.reg2 = b;
+      break;
+    case 7:
+      instr->u.format7.reg1 = a;
+      instr->u.format7.reg2 = b;
+      if (!get( &word ))
+        return NULL;
+      instr->u.format7.const8 = word;
+      break;
+    case 8:
+      instr->u.format8.reg1 = a;
+      instr->u.format8.reg2 = b;
+      if (!(instr->u.format8.addr = get_kept_string()))
+        return NULL;
+      break;
+    case 9:
+      if (!get( &word ))
+        return NULL;
+      instr->u.format9.constant = word;
+      break;
+    case 10:
+      instr->u.format10.reg1 = a;
+      instr->u.format10.reg2 = b;
+      instr->u.format10.reg3 = c;
+      break;
+    case 11:
+      instr->u.format11.reg = a;
+      if (!get( &word ) || !get_long( &instr->u.format11.value ))
+        return NULL;
+      instr->u.format11.is_double = word != 0;
+      break;
+    case 12:
+      if (!get( &n ) || !get( &word ) || n > (end - at) / 4)
+        return NULL;
+      if (!(instr->u.format12.values = malloc( (n ? n : 1) * sizeof(int) )))
+        fatal("malloc failed in read_ir");
+      for (i = 0; i < n; i += 1)
+        get( (unsigned int *) &instr->u.format12.values[i] );
+      instr->u.format12.num_values = n;
+      instr->u.format12.repeat = word;
+      break;
+    case 13:
+      if (!(instr->u.format13.path = get_kept_string()) ||
+          !get_long( &instr->u.format13.offset ) ||
+          !get_long( &instr->u.format13.length ))
+        return NULL;
+      break;
+    default:
+      return NULL;
+  }
+  return instr;
+}
+
+/*
+ * read_records
+ *
+ * Replay the records, building the functions the way the grammar does.
+ * Returns 0, or -1 if a record is malformed.
+ */
+static int read_records( void )
+{
+  func_node *funcs = NULL;
+  handler_node *handlers = NULL, **handler_tail = &handlers;
+  stmt_node *stmts = NULL;      // in reverse, like stmt_list
+  unsigned int head, record = 0, line = 0;
+
+  while (at < end)
+  {
+    record += 1;
+    sourceLine = line ? line : record;
+    yylineno = sourceLine + 1;
+    if (!get( &head ))
+      return -1;
+    switch (head >> 24)
+    {
+      case IR_HANDLER:
+      {
+        char *handle = get_kept_string(), *start = get_kept_string();
+        char *stop = get_kept_string();
+        handler_node *h;
+        if (!handle || !start || !stop)
+          return -1;
+        // handler_list is right recursive, so the first is first
+        if ((h = process_handler( handle, start, stop )))
+        {
+          *handler_tail = h;
+          handler_tail = &h->link;
+        }
+        break;
+      }
+      case IR_REPT:
+      {
+        unsigned int count, n, i;
+        stmt_node *body = NULL;
+        if (!get( &count ) || !get( &n ))
+          return -1;
+        for (i = 0; i < n; i += 1)
+        {
+          stmt_node *next;
+          if (!stmts)
+            return -1;
+          next = stmts->link;
+          stmts->link = body;
+          body = stmts;
+          stmts = next;
+        }
+        stmts = process_stmt_list( process_rept( count, body ), stmts );
+        break;
+      }
+      case IR_LINE:
+        if (!get( &line ))
+          return -1;
+        break;
+      case IR_FUNC:
+      {
+        char *id1 = get_kept_string(), *id2 = get_string();
+        if (!id1 || !id2)
+          return -1;
+        funcs = process_func_list(
+          finish_func( process_func( id1, id2, handlers,
+                                     reverse_stmt_list( stmts ) ) ),
+          funcs );
+        handlers = NULL;
+        handler_tail = &handlers;
+        stmts = NULL;
+        break;
+      }
+      default:
+      {
+        char *label;
+        INSTR *instr = read_stmt( head, &label );
+        if (!instr)
+          return -1;
+        stmts = process_stmt_list( process_stmt( label, instr ), stmts );
+      }
+    }
+  }
+  // a function that isn't closed is cut off, as at the end of a source
+  if (handlers || stmts)
+    return -1;
+  finish_program( funcs );
+  return 0;
+}
+
+// read_stream
+//
+// a stream with no descriptor (the server's source, see serve.c) is
+// read into memory, which is kept like the mapping; returns its length
+//
+static unsigned long long read_stream( FILE *in, void **image )
+{
+  unsigned long long length = 0, size = 0;
+  char *buf = NULL;
+  size_t got;
+
+  do
+  {
+    if (length == size)
+    {
+      size = size ? 2 * size : 1 << 16;
+      if (!(buf = realloc( buf, size )))
+        fatal("malloc failed in read_ir");
+    }
+    got = fread( buf + length, 1, size - length, in );
+    length += got;
+  } while (got && length <= 0xFFFFFFFFLL);
+  *image = buf;
+  return length;
+}
+
+int read_ir( FILE *in )
+{
+  struct stat st;
+  void *map;
+  unsigned int word;
+
+  if (fileno( in ) < 0)
+    st.st_size = read_stream( in, &map );
+  else if (fstat( fileno( in ), &st ))
+    st.st_size = 0;
+  if (st.st_size < 16 || st.st_size > 0xFFFFFFFFLL)
+  {
+    error("IR input is too short");
+    parseErrorCount += 1;
+    return -1;
+  }
+  if (fileno( in ) >= 0 &&
+      (map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno( in ),
+                   0 )) == MAP_FAILED)
+    fatal("can't map the IR input");
+
+  // the strings are named by the records, so the file stays mapped
+  image = map;
+  at = 0;
+  end = st.st_size;
+  get( &word );
+  if (word == IR_MAGIC && get( &version ) && version >= 1 &&
+      version <= IR_VERSION &&
+      get( &word ) && get( &stringsLength ) && word >= 16 && !(word & 3) &&
+      word <= end && stringsLength <= end - word)
+  {
+    strings = (const char *) image + word;
+    end = word;
+    if (!read_records())
+      return 0;
+  }
+  error("IR input is malformed");
+  parseErrorCount += 1;
+  return -1;
+}
@@ -0,0 +1,21 @@
+//
+// isa.h - the opcode ids of the xpvm assembler, generated from isa.def
+//
+// one OP_ id per row of isa.def, in its order, so opcodes[OP_DIVL] is
+// the divl row. included by defs.h for the assembler and by xpas.h for
+// programs that build their functions with libxpas.a, which is why,
+// unlike the other headers, it may be included twice.
+//
+
+#ifndef ISA_H
+#define ISA_H
+
+enum opcodeId
+{
+#define OP(id, mnemonic, format, encoding) OP_##id,
+#define DIR(id, mnemonic, format) OP_##id,
+#include "isa.def"
+  NUM_OPS
+};
+
+#endif
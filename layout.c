@@ -0,0 +1,466 @@
+/*
+ * layout.c - profile guided basic block layout for the xpvm assembler
+ *
+ *            read_profile attaches execution counts to the functions from
+ *            a text profile of lines
+ *
+ *              function address count
+ *
+ *            where address is a word offset into the function's block as
+ *            assembled with the same options minus -p, and counts for the
+ *            same word add up. '#' starts a comment. Lines for functions
+ *            or addresses that no longer exist are ignored.
+ *
+ *            layout_funcs then chains each function's basic blocks
+ *            greedily along its hottest edges, so the hot path falls
+ *            through: edges are taken in order of decreasing weight (the
+ *            smaller of the two block counts) and join two chains when
+ *            the edge leaves the tail of one and enters the head of the
+ *            other. The entry chain goes first and the rest follow
+ *            hottest first. Branches are inverted, or a jmp added, where
+ *            a block no longer falls through to where it used to.
+ *
+ *            The blocks of an exception handler range, and the block its
+ *            end label starts, are glued together in their original
+ *            order, so every range still covers exactly what it did.
+ *            Functions with an indirect jmp, data, 8-bit PC-relative
+ *            references, or more than 0x7FFF words are left alone. The
+ *            caller must run relayout_funcs afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+#include "cfg.h"
+
+// longest line in a profile
+#define MAX_LINE 1024
+
+struct edge {
+  unsigned int src;
+  unsigned int dst;
+  unsigned long long weight;
+  int fall;
+};
+
+// running count for generated labels
+static unsigned int num_labels = 0;
+
+static void *layout_alloc( size_t n, size_t size )
+{
+  void *p = calloc( n ? n : 1, size );
+  if (!p)
+    fatal("malloc failed in layout_funcs");
+  return p;
+}
+
+int read_profile( FILE *in, func_node *root )
+{
+  char line[MAX_LINE];
+  char name[MAX_LINE];
+  func_node *func = NULL;
+  unsigned long long count;
+  unsigned int addr;
+  int lineno = 0;
+
+  while (fgets( line, sizeof line, in ))
+  {
+    char *hash = strchr( line, '#' );
+    char extra;
+    int n;
+
+    lineno += 1;
+    if (hash)
+      *hash = '\0';
+    n = sscanf( line, "%s %u %llu %c", name, &addr, &count, &extra );
+    if (n <= 0)
+      continue;
+    if (n != 3)
+    {
+      fprintf(stderr, "profile line %d: expected \"function address count\"\n",
+              lineno);
+      return -1;
+    }
+
+    // lines for one function usually come together
+    if (!func || strcmp(func->name, name))
+    {
+      for (func = root; func; func = func->link)
+      {
+        if (!strcmp(func->name, name))
+          break;
+      }
+    }
+    if (!func || addr >= func->length)
+      continue;
+    if (!func->profile)
+      func->profile = layout_alloc( func->length, sizeof *func->profile );
+    func->profile[addr] += count;
+  }
+  return 0;
+}
+
+// is the instruction the one of the given OP_ id?
+static int is_op( INSTR *instr, enum opcodeId op )
+{
+  return instr->format == opcodes[op].format &&
+         opcode_lookup(instr->opcode, instr->format) == op;
+}
+
+// does control never go past the instruction?
+static int is_unconditional( INSTR *instr )
+{
+  return is_op(instr, OP_JMP) || is_op(instr, OP_JMP_R) ||
+         is_op(instr, OP_RET) || is_op(instr, OP_THROW);
+}
+
+static unsigned int find_chain( unsigned int *parent, unsigned int b )
+{
+  while (parent[b] != b)
+  {
+    parent[b] = parent[parent[b]];
+    b = parent[b];
+  }
+  return b;
+}
+
+static int compare_edges( const void *a, const void *b )
+{
+  const struct edge *x = a;
+  const struct edge *y = b;
+  if (x->weight != y->weight)
+    return x->weight < y->weight ? 1 : -1;
+  if (x->fall != y->fall)
+    return y->fall - x->fall;
+  return x->src < y->src ? -1 : x->src > y->src;
+}
+
+/*
+ * block_label
+ *
+ * The label at the start of the block, making one if it has none.
+ * New labels are returned through *extra for the caller to emit.
+ */
+static char *block_label( cfg *g, basic_block *blk, stmt_node **extra )
+{
+  stmt_node *first = g->stmts[blk->first];
+  char *label;
+  if (first->instr->format == 0)
+    return first->label;
+  if (*extra)
+    return (*extra)->label;
+
+  label = malloc( 16 );
+  *extra = layout_alloc( 1, sizeof **extra );
+  (*extra)->instr = layout_alloc( 1, sizeof *(*extra)->instr );
+  if (!label)
+    fatal("malloc failed in layout_funcs");
+  sprintf( label, "_bb%u", num_labels++ );
+  // generated labels start with '_', which user labels can't
+  define_label( label );
+  (*extra)->label = label;
+  (*extra)->instr->format = 0;
+  return label;
+}
+
+static stmt_node *new_jmp( char *label )
+{
+  stmt_node *stmt = layout_alloc( 1, sizeof *stmt );
+  stmt->instr = layout_alloc( 1, sizeof *stmt->instr );
+  stmt->instr->format = 2;
+  stmt->instr->opcode = "jmp";
+  stmt->instr->u.format2.addr = label;
+  return stmt;
+}
+
+/*
+ * order_blocks
+ *
+ * Chain the blocks and fill in order with their new sequence. Returns 0
+ * if the function has to keep its layout.
+ */
+static int order_blocks( cfg *g, unsigned long long *count, basic_block **order )
+{
+  unsigned int n = g->num_blocks;
+  unsigned int *parent = layout_alloc( n, sizeof *parent );
+  unsigned int *head = layout_alloc( n, sizeof *head );
+  unsigned int *tail = layout_alloc( n, sizeof *tail );
+  int *next = layout_alloc( n, sizeof *next );
+  unsigned long long *heat = layout_alloc( n, sizeof *heat );
+  struct edge *edges = layout_alloc( 2 * n, sizeof *edges );
+  unsigned int *chains = layout_alloc( n, sizeof *chains );
+  unsigned int num_edges = 0, num_chains = 0, b, c, k;
+  basic_block *last = &g->blocks[n - 1];
+  int falls_off = !last->fall &&
+                  !is_unconditional( g->stmts[last->end - 1]->instr );
+  int ok = 1;
+
+  for (b = 0; b < n; b += 1)
+  {
+    parent[b] = head[b] = tail[b] = b;
+    next[b] = -1;
+  }
+
+  // glue handler ranges (and their end blocks) in order
+  for (b = 0; b + 1 < n; b += 1)
+  {
+    if (g->blocks[b].num_succs > g->blocks[b].first_handler)
+    {
+      unsigned int r = find_chain( parent, b );
+      next[b] = b + 1;
+      parent[b + 1] = r;
+      tail[r] = tail[b + 1];
+    }
+  }
+
+  for (b = 0; b < n; b += 1)
+  {
+    basic_block *blk = &g->blocks[b];
+    if (blk->target)
+    {
+      struct edge *e = &edges[num_edges++];
+      e->src = b;
+      e->dst = blk->target - g->blocks;
+      e->fall = 0;
+    }
+    if (blk->fall && blk->fall != blk->target)
+    {
+      struct edge *e = &edges[num_edges++];
+      e->src = b;
+      e->dst = blk->fall - g->blocks;
+      e->fall = 1;
+    }
+  }
+  for (k = 0; k < num_edges; k += 1)
+  {
+    struct edge *e = &edges[k];
+    e->weight = count[e->src] < count[e->dst] ? count[e->src] : count[e->dst];
+  }
+  qsort( edges, num_edges, sizeof *edges, compare_edges );
+
+  for (k = 0; k < num_edges; k += 1)
+  {
+    unsigned int a = find_chain( parent, edges[k].src );
+    unsigned int z = find_chain( parent, edges[k].dst );
+    // the entry has to stay at the head of its chain, and nothing
+    // can follow a block that falls off the end
+    if (a == z || tail[a] != edges[k].src || head[z] != edges[k].dst ||
+        edges[k].dst == 0 || (falls_off && edges[k].src == n - 1))
+      continue;
+    next[tail[a]] = head[z];
+    parent[z] = a;
+    tail[a] = tail[z];
+  }
+
+  // entry chain first, then the hottest, ties in source order
+  for (b = 0; b < n; b += 1)
+  {
+    unsigned int r = find_chain( parent, b );
+    if (count[b] > heat[r])
+      heat[r] = count[b];
+    if (r == b)
+      chains[num_chains++] = b;
+  }
+  for (c = 1; c < num_chains; c += 1)
+  {
+    unsigned int r = chains[c];
+    for (k = c; k > 1; k -= 1)
+    {
+      unsigned int q = chains[k - 1];
+      if (heat[q] > heat[r] || (heat[q] == heat[r] && head[q] < head[r]))
+        break;
+      chains[k] = q;
+    }
+    chains[k] = r;
+  }
+
+  // so its chain has to go last
+  if (falls_off)
+  {
+    unsigned int r = find_chain( parent, n - 1 );
+    if (r == chains[0])
+      ok = num_chains == 1;
+    else
+    {
+      for (c = 1; chains[c] != r; c += 1)
+        ;
+      for (; c + 1 < num_chains; c += 1)
+        chains[c] = chains[c + 1];
+      chains[num_chains - 1] = r;
+    }
+  }
+
+  for (c = 0, k = 0; c < num_chains; c += 1)
+  {
+    int walk;
+    for (walk = head[chains[c]]; walk >= 0; walk = next[walk])
+      order[k++] = &g->blocks[walk];
+  }
+  if (k != n)
+    bug("layout lost a block (%u of %u)", k, n);
+
+  free(parent);
+  free(head);
+  free(tail);
+  free(next);
+  free(heat);
+  free(edges);
+  free(chains);
+  return ok;
+}
+
+/*
+ * can_layout
+ *
+ * Is the function safe to move blocks around in?
+ */
+static int can_layout( cfg *g )
+{
+  unsigned int i;
+  if (g->opaque || g->num_blocks < 2)
+    return 0;
+  for (i = 0; i < g->num_stmts; i += 1)
+  {
+    unsigned int format = g->stmts[i]->instr->format;
+    if (format == 8 || format == 9 || format == 11 ||
+        format == 12 || format == 13)
+      return 0;
+  }
+  return 1;
+}
+
+/*
+ * layout_func
+ *
+ * Lay out one function from its profile. Returns 1 if the order changed.
+ */
+static int layout_func( func_node *func )
+{
+  cfg *g;
+  unsigned long long *count;
+  basic_block **order;
+  stmt_node **extra;
+  stmt_node **link;
+  unsigned int b, i, addr = 0;
+  int moved = 0;
+
+  if (!func->profile || func->length > 0x7FFF)
+    return 0;
+  g = cfg_build( func );
+  if (!can_layout( g ))
+  {
+    cfg_free( g );
+    return 0;
+  }
+
+  // a block is as hot as its hottest word
+  count = layout_alloc( g->num_blocks, sizeof *count );
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    for (i = g->blocks[b].first; i < g->blocks[b].end; i += 1)
+    {
+      unsigned int words = stmt_words( g->stmts[i]->instr );
+      for (; words; words -= 1, addr += 1)
+      {
+        if (addr < func->length && func->profile[addr] > count[b])
+          count[b] = func->profile[addr];
+      }
+    }
+  }
+
+  order = layout_alloc( g->num_blocks, sizeof *order );
+  if (order_blocks( g, count, order ))
+  {
+    for (b = 0; b < g->num_blocks; b += 1)
+      moved |= order[b] != &g->blocks[b];
+  }
+  free(count);
+  if (!moved)
+  {
+    free(order);
+    cfg_free( g );
+    return 0;
+  }
+
+  // label every block that loses its fall through, then relink
+  extra = layout_alloc( g->num_blocks, sizeof *extra );
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    basic_block *blk = order[b];
+    basic_block *nb = b + 1 < g->num_blocks ? order[b + 1] : NULL;
+    if (blk->fall && blk->fall != nb)
+      block_label( g, blk->fall, &extra[blk->fall - g->blocks] );
+  }
+
+  link = &func->stmt_list;
+  for (b = 0; b < g->num_blocks; b += 1)
+  {
+    basic_block *blk = order[b];
+    basic_block *nb = b + 1 < g->num_blocks ? order[b + 1] : NULL;
+    stmt_node *last = g->stmts[blk->end - 1];
+    INSTR *instr = last->instr;
+    stmt_node **last_link = link;
+    stmt_node *fix = NULL;
+
+    if (extra[blk - g->blocks])
+    {
+      *link = extra[blk - g->blocks];
+      link = &(*link)->link;
+    }
+    for (i = blk->first; i < blk->end; i += 1)
+    {
+      last_link = link;
+      *link = g->stmts[i];
+      link = &g->stmts[i]->link;
+    }
+
+    // a block that doesn't end in a branch has no target, which the
+    //   last block's NULL nb must not match
+    if (blk->target && blk->target == nb && is_op(instr, OP_JMP))
+    {
+      // jmp to what now follows: drop it
+      link = last_link;
+      free(instr);
+      free(last);
+    }
+    else if (blk->fall && blk->fall != nb && blk->target &&
+             blk->target == nb &&
+             (is_op(instr, OP_BTRUE) || is_op(instr, OP_BFALSE)))
+    {
+      // branch to what now follows: invert it
+      instr->opcode = is_op(instr, OP_BTRUE) ? "bfalse" : "btrue";
+      instr->u.format5.addr =
+        block_label( g, blk->fall, &extra[blk->fall - g->blocks] );
+    }
+    else if (blk->fall && blk->fall != nb)
+    {
+      fix = new_jmp( block_label( g, blk->fall,
+                                  &extra[blk->fall - g->blocks] ) );
+    }
+    if (fix)
+    {
+      *link = fix;
+      link = &fix->link;
+    }
+  }
+  *link = NULL;
+
+  free(extra);
+  free(order);
+  cfg_free( g );
+  // the counts are by the old addresses
+  free(func->profile);
+  func->profile = NULL;
+  return 1;
+}
+
+int layout_funcs( func_node *root )
+{
+  int laid_out = 0;
+  func_node *walk;
+  for (walk = root; walk; walk = walk->link)
+  {
+    laid_out += layout_func( walk );
+  }
+  return laid_out;
+}
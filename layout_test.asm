@@ -0,0 +1,21 @@
+#
+# layout_test.asm
+#
+# A loop, then a cold block that ends in no branch and falls through to
+# the return. With layout_test.prof, -p moves the cold block last, so it
+# needs a jmp back to out ("make check_layout").
+#
+
+func main
+  ldimm r1, 0
+  ldimm r2, 10
+loop:
+  addl r1, r1, 1
+  cmplt r3, r1, r2
+  btrue r3, loop
+  cmpeq r3, r1, 0
+  bfalse r3, out
+  ldimm r4, 1
+out:
+  ret r1
+end main
@@ -2,23 +2,53 @@
 //
 // main.c - main routine for cs520 assembler
 //
-//          Usage: as520 file.asm
+//          Usage: xpas [-O | -s] [-r] [-p profile [-f]] [-x] [-g] [-v] file.asm
+//                 xpas [-O | -s] [-r] [-p profile [-f]] [-x] [-g] [-v] --serve socket
+//                 xpas -c file.asm
 //
-//          Output: file.obj
+//                 -O  run the optimizer (peephole, then unreachable code
+//                     and dead store elimination) after the first pass
+//                 -r  rename each function's registers into a dense
+//                     range, for smaller frames (see regcompact.c)
+//                 -p  lay out basic blocks along the execution counts in
+//                     profile (see layout.c for its format)
+//                 -f  also order the functions along the profile
+//                 -x  flag handler tables as sorted, so the VM can binary
+//                     search them (they are always written sorted)
+//                 -g  write a table of source lines by address into the
+//                     aux data of each block (see lineTable in defs.h)
+//                 -v  report what -O, -r, -p and -f changed on stderr
+//                 -s  encode each function on another thread as soon as
+//                     it is parsed, freeing it after (see stream.c); not
+//                     with -O, -r or -p, which work on the whole program
+//                 --serve  stay resident and assemble the sources sent to
+//                     the Unix domain socket (see serve.c)
+//                 -c  convert the source to the binary input format
+//                     instead (see ir.c)
 //
+//          Input: the source, or a binary input file in its place
+//
+//          Output: file.obj, or file.xir with -c
+//
+//          Environment: XPAS_CACHE_DIR names a directory to keep object
+//                       files in, keyed by their inputs (see objcache.c)
 //
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <sys/stat.h>
 #include "defs.h"
 
 // parser generated by bison
 void yyparse(void);
 
-// forward reference
-static void nameOutFile(char *, char *);
+// forward references
+static void nameOutFile(char *, char *, char *);
+static int convertFile(FILE *in, FILE *outf);
+static void usage(void);
 
 // file pointer to be used by message functions 
 FILE *yyerrfp;
@@ -29,47 +59,127 @@ unsigned int parseErrorCount = 0;
 // count of errors detected by the scanner
 unsigned int scanErrorCount = 0;
 
+// run the optimizer? (-O)
+static int optimize = 0;
+
+// compact the registers? (-r)
+static int compactRegs = 0;
+
+// execution profile to lay out blocks by (-p)
+static char *profileName = NULL;
+
+// order the functions by the profile as well? (-f)
+static int orderFuncs = 0;
+
+// report what the optimizations changed? (-v)
+static int verbose = 0;
+
+// the output is written here and renamed to its own name once complete,
+//   so an exit part way through (bug, fatal) leaves no partial object
+//   file for later tools or the cache to pick up
+static char *tmpName = NULL;
+
+// removeTmpName
+//
+// atexit handler: remove the output that was never completed
+//
+static void removeTmpName(void)
+{
+  if (tmpName)
+  {
+    unlink(tmpName);
+  }
+}
+
 //
 //      main
 //
 //
 int main(int argc, char *argv[])
 {
+  char *inName;
   char *outn;
-  FILE *outf;
-  extern FILE *yyin;
-  extern int yylineno;
+  FILE *in, *outf;
+  char options[64];
+  char *socketName = NULL;
+  int c, errorCount, fd;
+  mode_t mask;
+  static struct option longOptions[] = {
+    {"serve", required_argument, NULL, 'S'},
+    {NULL, 0, NULL, 0}
+  };
  
   yyerrfp = stderr;
 
   // initialize assembler
   initAssemble();
 
-  // check that single argument is all that is there
-  if ((argc != 2))
+  // process the options
+  while ((c = getopt_long(argc, argv, "Orp:fxgvsc", longOptions, NULL)) != -1)
   {
-    fprintf(stderr,"usage: as520 file.obj\n");
-    exit(1);
+    switch (c)
+    {
+      case 'O':
+        optimize = 1;
+        break;
+      case 'r':
+        compactRegs = 1;
+        break;
+      case 'p':
+        profileName = optarg;
+        break;
+      case 'f':
+        orderFuncs = 1;
+        break;
+      case 'x':
+        indexHandlers = 1;
+        break;
+      case 'g':
+        lineTable = 1;
+        break;
+      case 'v':
+        verbose = 1;
+        break;
+      case 's':
+        streamFuncs = 1;
+        break;
+      case 'S':
+        socketName = optarg;
+        break;
+      case 'c':
+        irConvert = 1;
+        break;
+      default:
+        usage();
+    }
   }
-
-  // tell yacc to start on line 1
-  yylineno = 1;
-
-  // open the input file
-  if (!(yyin = fopen(argv[1],"r")))
+  if ((orderFuncs && !profileName) ||
+      (streamFuncs && (optimize || compactRegs || profileName)) ||
+      (irConvert && (optimize || compactRegs || profileName || streamFuncs ||
+                     socketName)))
   {
-    fprintf(stderr, "can't open %s\n", argv[1]);
-    exit(1);
+    usage();
   }
 
-  // invoke parser to drive the first pass
-  yyparse();
+  // the server takes its sources from the socket
+  if (socketName)
+  {
+    if (optind != argc)
+    {
+      usage();
+    }
+    return serve(socketName);
+  }
 
-  // close input file
-  fclose(yyin);
+  // check that single argument is all that is left
+  if (optind != argc - 1)
+  {
+    usage();
+  }
+  inName = argv[optind];
 
   // allocate space for output filename (+1 for null; +4 for ".obj")
-  outn = malloc(strlen(argv[1]) + 1 + 4);
+  outn = malloc(strlen(inName) + 1 + 4);
   if (outn == 0)
   {
     fprintf(stderr, "malloc failed for output filename\n");
@@ -77,66 +187,251 @@ int main(int argc, char *argv[])
   }
 
   // name the output file
-  nameOutFile(argv[1], outn);
+  nameOutFile(inName, outn, irConvert ? ".xir" : ".obj");
 
-  // open the output file
-  if (!(outf = fopen(outn,"w")))
+  // the same inputs assembled before need no assembling
+  if (!irConvert)
+  {
+    snprintf(options, sizeof options, "O%d r%d f%d x%d g%d p%d", optimize,
+             compactRegs, orderFuncs, indexHandlers, lineTable,
+             profileName != NULL);
+    if (cache_lookup(inName, options, profileName, outn))
+    {
+      return 0;
+    }
+  }
+
+  // open the input file
+  if (!(in = fopen(inName,"r")))
+  {
+    fprintf(stderr, "can't open %s\n", inName);
+    exit(1);
+  }
+
+  // open the output file, under a temporary name beside it
+  //   the object file of an earlier run doesn't outlive a failed one,
+  //   and the rename replaces a hard link to a cache entry that an
+  //   earlier cache hit may have left, rather than writing through it
+  unlink(outn);
+  tmpName = malloc(strlen(outn) + 8);
+  if (tmpName == 0)
+  {
+    fprintf(stderr, "malloc failed for output filename\n");
+    exit(1);
+  }
+  sprintf(tmpName, "%s.XXXXXX", outn);
+  atexit(removeTmpName);
+  fd = mkstemp(tmpName);
+  if (fd < 0 || !(outf = fdopen(fd, "w")))
   {
     fprintf(stderr, "can't open %s\n", outn);
     exit(1);
   }
+  // mkstemp makes it private; give it the mode fopen would have
+  mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0666 & ~mask);
 
-  // let the assembler know that the first pass is done
-  //   it will tell us how many errors were detected and therefore
-  //   whether to continue with the second pass
-  int errorCount = betweenPasses(outf);
-  if (errorCount + scanErrorCount + parseErrorCount)
+  errorCount = irConvert ? convertFile(in, outf) : assembleFile(in, outf);
+  fclose(in);
+  if (errorCount)
   {
-    // close output file that was not used
+    // close output file that was not used, removed on exit
     fclose(outf);
+    return errorCount;
+  }
+
+  // close the output file, and give it its name
+  if (fclose(outf) || rename(tmpName, outn))
+  {
+    fprintf(stderr, "write failed for %s\n", outn);
+    exit(1);
+  }
+  free(tmpName);
+  tmpName = NULL;
+
+  if (!irConvert)
+  {
+    cache_store(outn);
+  }
 
-    // remove the output file
-    if (unlink(outn))
+  return 0;
+}
+
+//
+//      assembleFile
+//
+//      run both passes over the source in, writing the object file to
+//      outf. returns the number of errors; outf holds nothing useful
+//      unless it is 0
+//
+int assembleFile(FILE *in, FILE *outf)
+{
+  extern FILE *yyin;
+  extern int yylineno;
+  int streamErrors = 0;
+
+  // tell yacc to start on line 1
+  yylineno = 1;
+  yyin = in;
+
+  // binary input takes the parser's place
+  int binary = is_ir(in);
+
+  // invoke parser to drive the first pass
+  //   with -s the functions are encoded meanwhile
+  if (streamFuncs)
+  {
+    stream_begin();
+  }
+  if (binary)
+  {
+    read_ir(in);
+  }
+  else
+  {
+    yyparse();
+  }
+  if (streamFuncs)
+  {
+    streamErrors = stream_end();
+  }
+
+  // optimize the statement lists, unless the parse went wrong
+  if (optimize && !(scanErrorCount + parseErrorCount))
+  {
+    int removed = peephole_funcs(func_list);
+    int unreachable, dead;
+    cfg_optimize_funcs(func_list, &unreachable, &dead);
+    relayout_funcs(func_list);
+    if (verbose)
     {
-      bug("can't remove output file?");
+      fprintf(stderr, "peephole: removed %d instruction(s)\n", removed);
+      fprintf(stderr, "cfg: removed %d unreachable and %d dead instruction(s)\n",
+              unreachable, dead);
     }
+  }
 
-    error("assembler terminating after first pass with %d error(s)",
-      errorCount + scanErrorCount + parseErrorCount);
-    return errorCount + scanErrorCount + parseErrorCount;
+  // compact the registers, once dead stores no longer use any
+  if (compactRegs && !(scanErrorCount + parseErrorCount))
+  {
+    int compacted = compact_regs_funcs(func_list, verbose ? stderr : NULL);
+    if (verbose)
+    {
+      fprintf(stderr, "regcompact: compacted %d function(s)\n", compacted);
+    }
   }
 
-  // tell yacc again to start on line 1
-  yylineno = 1;
+  // lay out the blocks along the profile, unless the parse went wrong
+  if (profileName && !(scanErrorCount + parseErrorCount))
+  {
+    FILE *prof;
+    int laidOut;
+    if (!(prof = fopen(profileName, "r")))
+    {
+      fprintf(stderr, "can't open %s\n", profileName);
+      return 1;
+    }
+    if (read_profile(prof, func_list))
+    {
+      fclose(prof);
+      return 1;
+    }
+    fclose(prof);
+    // the counts are by address, so functions go before blocks move
+    if (orderFuncs)
+    {
+      int moved;
+      func_list = order_funcs(func_list, &moved);
+      if (verbose)
+      {
+        fprintf(stderr, "funcorder: moved %d function(s)\n", moved);
+      }
+    }
+    laidOut = layout_funcs(func_list);
+    relayout_funcs(func_list);
+    if (verbose)
+    {
+      fprintf(stderr, "layout: reordered %d function(s)\n", laidOut);
+    }
+  }
 
-  // re-open the file
-  if (!(yyin = fopen(argv[1],"r")))
+  // let the assembler know that the first pass is done
+  //   it will tell us how many errors were detected and therefore
+  //   whether to continue with the second pass
+  int errorCount = betweenPasses(outf) + streamErrors;
+  if (errorCount + scanErrorCount + parseErrorCount)
   {
-    fprintf(stderr, "can't open input file for second pass\n");
-    exit(1);
+    error("assembler terminating after first pass with %d error(s)",
+      errorCount + scanErrorCount + parseErrorCount);
+    return errorCount + scanErrorCount + parseErrorCount;
   }
 
   // invoke parser to drive the second pass
-  yyparse();
+  //   (binary input has nothing left for it to do, and with -s the
+  //   functions are encoded already)
+  if (!binary && !streamFuncs)
+  {
+    // tell yacc again to start on line 1, at the top of the file
+    yylineno = 1;
+    rewind(in);
+    yyparse();
+  }
 
   encode_funcs( func_list );
-  // close the files
-  fclose(outf);
-  fclose(yyin);
+  return 0;
+}
 
+//
+//      convertFile
+//
+//      parse the source in, writing it to outf in the binary input
+//      format. returns the number of errors, which are the syntax errors
+//      only; the rest are found when the converted file is assembled
+//
+static
+int convertFile(FILE *in, FILE *outf)
+{
+  extern FILE *yyin;
+  extern int yylineno;
+
+  yylineno = 1;
+  yyin = in;
+  yyparse();
+  if (scanErrorCount + parseErrorCount)
+  {
+    error("not converted, with %d error(s)",
+      scanErrorCount + parseErrorCount);
+    return scanErrorCount + parseErrorCount;
+  }
+  ir_write(outf);
   return 0;
 }
 
+//
+//      usage
+//
+static
+void usage(void)
+{
+  fprintf(stderr,"usage: xpas [-O | -s] [-r] [-p profile [-f]] [-x] [-g] [-v] file.asm\n"
+                 "       xpas [-O | -s] [-r] [-p profile [-f]] [-x] [-g] [-v] --serve socket\n"
+                 "       xpas -c file.asm\n");
+  exit(1);
+}
+
 //
 //      nameOutFile
 //
-//      if input filename is "x.asm" then output filename is "x.obj"
+//      if input filename is "x.asm" (or "x.xir") then output filename is
+//      "x.obj"
 //      else if input filename is "xyz" then output filename is "xyz.obj"
+//      (or ".xir", or whatever four character extension is given)
 //
 //      memory is assumed to be allocated already for outName
 //
 static
-void nameOutFile(char *inName, char *outName)
+void nameOutFile(char *inName, char *outName, char *ext)
 {
   int i;
 
@@ -147,13 +442,14 @@ void nameOutFile(char *inName, char *outName)
     i--;
   }
   if (i > 0 &&
-     (!strcmp(inName+i,".asm")))
+     (!strcmp(inName+i,".asm") ||
+      (!strcmp(inName+i,".xir") && strcmp(ext,".xir"))))
   {
-    strcpy(outName+i,".obj");
+    strcpy(outName+i,ext);
   }
   else
   {
-    strcat(outName,".obj");
+    strcat(outName,ext);
   }
 }
 
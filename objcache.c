@@ -0,0 +1,242 @@
+/*
+ * objcache.c - whole file object cache for the xpvm assembler
+ *
+ *              Enabled by naming a directory in XPAS_CACHE_DIR. The key
+ *              of an assembly is a hash of the assembler executable, the
+ *              options, the source bytes and the profile bytes (-p); the
+ *              object file is kept in the directory as <key>.obj. On a
+ *              hit the output is hard linked to the entry (or copied, if
+ *              the directory is on another file system) and the source
+ *              is never parsed.
+ *
+ *              Output that depends on more than those inputs (incbin) is
+ *              not stored. Entries are written to a temporary file and
+ *              renamed into place, so concurrent builds sharing the
+ *              directory never see a partial entry, and are read-only,
+ *              so an object linked to one can't be changed in place. The
+ *              hash is not cryptographic; the directory is trusted.
+ *
+ *              Hit and miss counts for the directory are kept in its
+ *              "stats" file and reported on every run.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include "defs.h"
+
+// two independent 64-bit hashes, for a 128-bit key
+struct hash {
+  unsigned long long a;
+  unsigned long long b;
+};
+
+static const char *dir = NULL;
+static char key[33];
+
+static void hash_init( struct hash *h )
+{
+  h->a = 0xcbf29ce484222325ULL;
+  h->b = 0x9e3779b97f4a7c15ULL;
+}
+
+static void hash_bytes( struct hash *h, const unsigned char *p, size_t n )
+{
+  size_t i;
+  for (i = 0; i < n; i += 1)
+  {
+    // FNV-1a, and a multiply-rotate mix
+    h->a = (h->a ^ p[i]) * 0x100000001b3ULL;
+    h->b = (h->b + p[i]) * 0xff51afd7ed558ccdULL;
+    h->b ^= h->b >> 29;
+  }
+}
+
+/*
+ * hash_file
+ *
+ * Add the contents of the file, and its length so the fields can't run
+ * together. Returns -1 if the file can't be read.
+ */
+static int hash_file( struct hash *h, const char *path )
+{
+  unsigned char buf[1 << 16];
+  unsigned long long total = 0;
+  size_t n;
+  FILE *f = fopen( path, "rb" );
+
+  if (!f)
+    return -1;
+  while ((n = fread( buf, 1, sizeof buf, f )) > 0)
+  {
+    hash_bytes( h, buf, n );
+    total += n;
+  }
+  fclose( f );
+  hash_bytes( h, (unsigned char *) &total, sizeof total );
+  return 0;
+}
+
+static char *entry_path( const char *name )
+{
+  char *path = malloc( strlen( dir ) + strlen( name ) + 6 );
+  if (!path)
+    fatal("malloc failed in objcache");
+  sprintf( path, "%s/%s", dir, name );
+  return path;
+}
+
+/*
+ * count
+ *
+ * Add one to the hits or misses in the stats file and report the totals.
+ */
+static void count( int hit )
+{
+  char *path = entry_path( "stats" );
+  unsigned long hits = 0, misses = 0;
+  char buf[64];
+  ssize_t n;
+  int fd = open( path, O_RDWR | O_CREAT, 0666 );
+
+  free(path);
+  if (fd < 0 || flock( fd, LOCK_EX ))
+  {
+    fprintf(stderr, "cache: %s\n", hit ? "hit" : "miss");
+    if (fd >= 0)
+      close( fd );
+    return;
+  }
+  if ((n = read( fd, buf, sizeof buf - 1 )) > 0)
+  {
+    buf[n] = '\0';
+    sscanf( buf, "%lu %lu", &hits, &misses );
+  }
+  hits += hit;
+  misses += !hit;
+  n = snprintf( buf, sizeof buf, "%lu %lu\n", hits, misses );
+  // the counts are only advisory; if they can't be saved, say so and
+  // report the result alone, as when the file can't be locked
+  if (lseek( fd, 0, SEEK_SET ) != 0 || ftruncate( fd, 0 ) != 0 ||
+      write( fd, buf, n ) != n)
+  {
+    close( fd );
+    fprintf(stderr, "cache: %s (can't update the stats in %s)\n",
+            hit ? "hit" : "miss", dir);
+    return;
+  }
+  close( fd );
+  fprintf(stderr, "cache: %s (%lu hit(s), %lu miss(es) in %s)\n",
+          hit ? "hit" : "miss", hits, misses, dir);
+}
+
+/*
+ * copy_file
+ *
+ * Copy the file from to a new file to.
+ */
+static int copy_file( const char *from, const char *to )
+{
+  char buf[1 << 16];
+  size_t n;
+  FILE *in = fopen( from, "rb" );
+  FILE *out;
+  int ret = 0;
+
+  if (!in)
+    return -1;
+  if (!(out = fopen( to, "wb" )))
+  {
+    fclose( in );
+    return -1;
+  }
+  while ((n = fread( buf, 1, sizeof buf, in )) > 0)
+  {
+    if (fwrite( buf, 1, n, out ) != n)
+      ret = -1;
+  }
+  if (ferror( in ))
+    ret = -1;
+  fclose( in );
+  if (fclose( out ))
+    ret = -1;
+  return ret;
+}
+
+int cache_lookup( const char *inName, const char *options,
+                  const char *profileName, const char *outName )
+{
+  struct hash h;
+  struct stat st;
+  char name[40];
+  char *path;
+
+  if (!(dir = getenv( "XPAS_CACHE_DIR" )) || !*dir)
+  {
+    dir = NULL;
+    return 0;
+  }
+  // if it can't be made, every lookup misses and nothing is stored
+  if (stat( dir, &st ) < 0)
+    mkdir( dir, 0777 );
+
+  hash_init( &h );
+  if (hash_file( &h, "/proc/self/exe" ))
+    hash_bytes( &h, (unsigned char *) __DATE__ __TIME__,
+                sizeof __DATE__ __TIME__ );
+  hash_bytes( &h, (const unsigned char *) options, strlen( options ) + 1 );
+  if (hash_file( &h, inName ) ||
+      (profileName && hash_file( &h, profileName )))
+  {
+    // assembly reports the missing file
+    dir = NULL;
+    return 0;
+  }
+  sprintf( key, "%016llx%016llx", h.a, h.b );
+
+  sprintf( name, "%s.obj", key );
+  path = entry_path( name );
+  // never write through a link to an entry
+  unlink( outName );
+  if (access( path, R_OK ) == 0 &&
+      (link( path, outName ) == 0 || copy_file( path, outName ) == 0))
+  {
+    free(path);
+    count( 1 );
+    return 1;
+  }
+  free(path);
+  count( 0 );
+  return 0;
+}
+
+void cache_store( const char *outName )
+{
+  char name[40];
+  char *tmp, *path;
+  int fd;
+
+  if (!dir)
+    return;
+  if (incbin_used)
+  {
+    fprintf(stderr, "cache: not stored, the output depends on incbin\n");
+    return;
+  }
+  tmp = entry_path( "tmp.XXXXXX" );
+  if ((fd = mkstemp( tmp )) < 0)
+  {
+    free(tmp);
+    return;
+  }
+  close( fd );
+  sprintf( name, "%s.obj", key );
+  path = entry_path( name );
+  if (copy_file( outName, tmp ) || chmod( tmp, 0444 ) || rename( tmp, path ))
+    unlink( tmp );
+  free(tmp);
+  free(path);
+}
@@ -0,0 +1,409 @@
+/*
+ * objread.c - zero-copy reader for xpvm object files
+ *
+ *             See objread.h for the object file layout.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "objread.h"
+
+#define OBJ_MAGIC 0x31303636
+
+// message for the last failure
+static char errbuf[256];
+
+// cursor over the mapped file, used while building the block index
+struct cursor {
+  const unsigned char *p;
+  const unsigned char *end;
+  const char *strings;               // the string table
+  unsigned int strings_length;
+};
+
+static int setError(const char *fmt, const char *arg)
+{
+  snprintf(errbuf, sizeof errbuf, fmt, arg);
+  return -1;
+}
+
+// getWord
+//
+// consume one word; returns 0 if the file is truncated
+//
+static int getWord(struct cursor *c, unsigned int *out)
+{
+  if (c->end - c->p < 4)
+  {
+    return 0;
+  }
+  *out = objWord(c->p);
+  c->p += 4;
+  return 1;
+}
+
+// getName
+//
+// consume a string table offset and return the string there; returns
+// NULL if the file is truncated or the offset is out of the table
+//
+static const char *getName(struct cursor *c)
+{
+  unsigned int offset;
+  if (!getWord(c, &offset) || offset >= c->strings_length)
+  {
+    return NULL;
+  }
+  return c->strings + offset;
+}
+
+// skipBytes
+//
+// step over n bytes; returns 0 if the file is truncated
+//
+static int skipBytes(struct cursor *c, size_t n, const unsigned char **at)
+{
+  if ((size_t) (c->end - c->p) < n)
+  {
+    return 0;
+  }
+  *at = c->p;
+  c->p += n;
+  return 1;
+}
+
+// getRefs
+//
+// index a list of (name, offset) references
+//
+static int getRefs(struct cursor *c, unsigned int n, obj_ref **out)
+{
+  unsigned int i;
+
+  *out = NULL;
+  if (n == 0)
+  {
+    return 1;
+  }
+  // each reference is a name and an offset word
+  if ((size_t) (c->end - c->p) / 8 < n)
+  {
+    return 0;
+  }
+  *out = malloc(n * sizeof **out);
+  if (*out == NULL)
+  {
+    return 0;
+  }
+  for (i = 0; i < n; i += 1)
+  {
+    if (!((*out)[i].name = getName(c)) || !getWord(c, &(*out)[i].offset))
+    {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// getNativeRefs
+//
+// index the native reference table, one view entry per patch site
+//
+static int getNativeRefs(struct cursor *c, obj_block *blk)
+{
+  const unsigned char *table = c->p;
+  const unsigned char *sites;
+  unsigned int i, j, n, k = 0;
+  const char *name;
+
+  blk->native_refs = NULL;
+  blk->num_native_refs = 0;
+  // every native takes at least a name and a site count
+  if (blk->num_natives > (size_t) (c->end - c->p) / 8)
+  {
+    return 0;
+  }
+  for (i = 0; i < blk->num_natives; i += 1)
+  {
+    if (!getName(c) || !getWord(c, &n) ||
+        n > (size_t) (c->end - c->p) / 4 || !skipBytes(c, n * 4, &sites))
+    {
+      return 0;
+    }
+    blk->num_native_refs += n;
+  }
+  if (blk->num_native_refs == 0)
+  {
+    return 1;
+  }
+
+  blk->native_refs = malloc(blk->num_native_refs * sizeof *blk->native_refs);
+  if (blk->native_refs == NULL)
+  {
+    return 0;
+  }
+  c->p = table;
+  for (i = 0; i < blk->num_natives; i += 1)
+  {
+    name = getName(c);
+    getWord(c, &n);
+    for (j = 0; j < n; j += 1, k += 1)
+    {
+      blk->native_refs[k].name = name;
+      getWord(c, &blk->native_refs[k].offset);
+    }
+  }
+  return 1;
+}
+
+// indexBlock
+//
+// fill in the view for the block at the cursor
+//
+static int indexBlock(struct cursor *c, obj_block *blk)
+{
+  unsigned int len;
+
+  if (!(blk->name = getName(c)) ||
+      !getWord(c, &blk->annotations[0]) ||
+      !getWord(c, &blk->annotations[1]) ||
+      !getWord(c, &blk->frame_size) ||
+      !getWord(c, &len) ||
+      (len & 3) ||
+      !skipBytes(c, len, &blk->contents))
+  {
+    return 0;
+  }
+  blk->num_words = len / 4;
+
+  if (!getWord(c, &blk->num_handlers) ||
+      blk->num_handlers > (size_t) (c->end - c->p) / 12 ||
+      !skipBytes(c, (size_t) blk->num_handlers * 12, &blk->handlers))
+  {
+    return 0;
+  }
+
+  if (!getWord(c, &blk->num_outsyms) ||
+      !getRefs(c, blk->num_outsyms, &blk->outsyms) ||
+      !getWord(c, &blk->num_natives) ||
+      !getNativeRefs(c, blk))
+  {
+    return 0;
+  }
+
+  if (!getWord(c, &blk->aux_length) ||
+      !skipBytes(c, blk->aux_length, &blk->aux))
+  {
+    return 0;
+  }
+  return 1;
+}
+
+// indexFile
+//
+// check the header of the object at obj->base and build the block index
+//
+static int indexFile(obj_file *obj, const char *path)
+{
+  struct cursor c;
+  unsigned int i;
+
+  if (obj->size < 16)
+  {
+    objClose(obj);
+    return setError("%s is not an xpvm object file", path);
+  }
+  c.p = obj->base;
+  c.end = obj->base + obj->size;
+  c.strings = NULL;
+  c.strings_length = 0;
+
+  getWord(&c, &obj->magic);
+  getWord(&c, &obj->num_blocks);
+  getWord(&c, &obj->strings_offset);
+  getWord(&c, &obj->strings_length);
+  if (obj->magic != OBJ_MAGIC)
+  {
+    objClose(obj);
+    return setError("%s: bad magic number", path);
+  }
+
+  // the string table ends the file, and its last string is terminated
+  if (obj->strings_offset < 16 || obj->strings_offset > obj->size ||
+      obj->strings_length != obj->size - obj->strings_offset ||
+      (obj->strings_length && obj->base[obj->size - 1] != 0))
+  {
+    objClose(obj);
+    return setError("%s: bad string table", path);
+  }
+  obj->strings = (const char *) obj->base + obj->strings_offset;
+  c.strings = obj->strings;
+  c.strings_length = obj->strings_length;
+  c.end = obj->base + obj->strings_offset;
+
+  if (!getWord(&c, &obj->num_insyms) ||
+      !getRefs(&c, obj->num_insyms, &obj->insyms))
+  {
+    objClose(obj);
+    return setError("%s: truncated or malformed insymbols", path);
+  }
+  for (i = 0; i < obj->num_insyms; i += 1)
+  {
+    if (obj->insyms[i].offset >= obj->num_blocks)
+    {
+      objClose(obj);
+      return setError("%s: insymbol names a missing block", path);
+    }
+  }
+
+  // every block takes at least 36 bytes, which bounds the allocation
+  if (obj->num_blocks > obj->size / 36)
+  {
+    objClose(obj);
+    return setError("%s: bad block count", path);
+  }
+  obj->blocks = calloc(obj->num_blocks ? obj->num_blocks : 1,
+                       sizeof *obj->blocks);
+  if (obj->blocks == NULL)
+  {
+    objClose(obj);
+    return setError("out of memory reading %s", path);
+  }
+
+  for (i = 0; i < obj->num_blocks; i += 1)
+  {
+    if (!indexBlock(&c, &obj->blocks[i]))
+    {
+      objClose(obj);
+      return setError("%s: truncated or malformed block", path);
+    }
+  }
+  if (c.p != c.end)
+  {
+    objClose(obj);
+    return setError("%s: trailing bytes before the string table", path);
+  }
+  return 0;
+}
+
+int objOpen(const char *path, obj_file *obj)
+{
+  struct stat st;
+  void *map;
+  int fd;
+
+  memset(obj, 0, sizeof *obj);
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+  {
+    return setError("can't open %s", path);
+  }
+  if (fstat(fd, &st) < 0 || st.st_size < 16)
+  {
+    close(fd);
+    return setError("%s is not an xpvm object file", path);
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+  {
+    return setError("can't map %s", path);
+  }
+  // the file is read front to back exactly once
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  obj->base = map;
+  obj->size = st.st_size;
+  obj->mapped = 1;
+  return indexFile(obj, path);
+}
+
+int objLinesBegin(const obj_block *blk, obj_lines *lines)
+{
+  memset(lines, 0, sizeof *lines);
+  if (blk->aux_length < 4)
+  {
+    return 0;
+  }
+  lines->left = objWord(blk->aux);
+  lines->p = blk->aux + 4;
+  lines->end = blk->aux + blk->aux_length;
+  return 1;
+}
+
+// getVarint
+//
+// consume a varint of the line table; returns 0 if it runs off the end
+//
+static int getVarint(obj_lines *lines, unsigned int *out)
+{
+  unsigned int shift;
+
+  *out = 0;
+  for (shift = 0; lines->p < lines->end && shift < 32; shift += 7)
+  {
+    unsigned char b = *lines->p++;
+    *out |= (unsigned int) (b & 0x7F) << shift;
+    if (!(b & 0x80))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int objLinesNext(obj_lines *lines)
+{
+  unsigned int offset, line;
+
+  if (!lines->left || !getVarint(lines, &offset) || !getVarint(lines, &line))
+  {
+    lines->left = 0;
+    return 0;
+  }
+  lines->left -= 1;
+  lines->offset += offset;
+  // the line delta is zigzag encoded
+  lines->line += (line & 1) ? (int) ~(line >> 1) : (int) (line >> 1);
+  return 1;
+}
+
+int objOpenBuffer(const unsigned char *base, size_t size, const char *name,
+                  obj_file *obj)
+{
+  memset(obj, 0, sizeof *obj);
+  obj->base = base;
+  obj->size = size;
+  return indexFile(obj, name);
+}
+
+void objClose(obj_file *obj)
+{
+  unsigned int i;
+
+  if (obj->blocks)
+  {
+    for (i = 0; i < obj->num_blocks; i += 1)
+    {
+      free(obj->blocks[i].outsyms);
+      free(obj->blocks[i].native_refs);
+    }
+    free(obj->blocks);
+  }
+  free(obj->insyms);
+  if (obj->base && obj->mapped)
+  {
+    munmap((void *) obj->base, obj->size);
+  }
+  memset(obj, 0, sizeof *obj);
+}
+
+const char *objError(void)
+{
+  return errbuf;
+}
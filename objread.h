@@ -0,0 +1,124 @@
+//
+// objread.h - zero-copy reader for xpvm object files
+//
+// the object file is mapped read-only with mmap and every view handed
+// out below points directly into the mapping. the only allocation is the
+// block index built by objOpen (plus the native reference index per
+// block), which holds pointers and counts, never copies of the data.
+//
+// object file layout (all words are 32-bit big endian):
+//
+//   header:  magic (0x31303636), number of blocks,
+//            string table offset and length in bytes
+//   insymbols: number of exported blocks, then a (name, block id) pair
+//            for each
+//   block:   name
+//            annotation words (2)
+//            frame size
+//            contents length in bytes
+//            contents (code and data words)
+//            number of exception handlers
+//            handlers: (start, end, handle) byte offsets
+//            number of outsymbol references
+//            outsymbol references: name, byte offset, one per ldblkid
+//              (its const16 is the block id in this file, 0 if imported)
+//            number of distinct natives referenced
+//            per native: name, number of sites, then the byte offset
+//              of each site
+//            auxiliary data length in bytes
+//            auxiliary data (the table of source lines, with xpas -g)
+//   strings: NUL terminated strings, to the end of the file
+//
+// every name is a word holding the byte offset of the string in the
+// string table, so a name used by many blocks is stored only once.
+//
+
+#include <stddef.h>
+
+// a (name, byte offset) pair, used for outsymbol and native references
+// (one per site, so a native's name appears once for each of its sites),
+// and a (name, block id) pair for insymbols
+typedef struct obj_ref {
+  const char   *name;
+  unsigned int offset;
+} obj_ref;
+
+typedef struct obj_block {
+  const char          *name;
+  unsigned int        annotations[2];
+  unsigned int        frame_size;
+  const unsigned char *contents;     // first word of the block contents
+  unsigned int        num_words;     // contents length in words
+  const unsigned char *handlers;     // (start, end, handle) word triples
+  unsigned int        num_handlers;
+  obj_ref             *outsyms;
+  unsigned int        num_outsyms;
+  obj_ref             *native_refs;   // grouped by name
+  unsigned int        num_native_refs;
+  unsigned int        num_natives;    // distinct names
+  const unsigned char *aux;
+  unsigned int        aux_length;    // in bytes
+} obj_block;
+
+typedef struct obj_file {
+  const unsigned char *base;         // start of the mapping
+  size_t              size;
+  int                 mapped;        // base is our own mapping
+  unsigned int        magic;
+  unsigned int        num_blocks;
+  const char          *strings;      // the string table
+  unsigned int        strings_offset;
+  unsigned int        strings_length;
+  obj_ref             *insyms;       // offset is the block id
+  unsigned int        num_insyms;
+  obj_block           *blocks;
+} obj_file;
+
+// map the named object file and index its blocks
+//   returns 0 on success, -1 on failure (see objError)
+extern int objOpen(const char *path, obj_file *obj);
+
+// index an object file already in memory (an archive member, say);
+//   name is only used in messages. the bytes must outlive the view.
+extern int objOpenBuffer(const unsigned char *base, size_t size,
+                         const char *name, obj_file *obj);
+
+// unmap the file and release the block index
+extern void objClose(obj_file *obj);
+
+// message describing the last objOpen failure
+extern const char *objError(void);
+
+// the table of source lines in a block's aux data (xpas -g; see
+// lineTable in defs.h), read an entry at a time
+typedef struct obj_lines {
+  const unsigned char *p;
+  const unsigned char *end;
+  unsigned int        left;          // entries not read yet
+  unsigned int        offset;        // word offset of the entry read
+  int                 line;          //   and its source line
+} obj_lines;
+
+// start on the table of a block
+//   returns 0 if the block has none
+extern int objLinesBegin(const obj_block *blk, obj_lines *lines);
+
+// read the next entry
+//   returns 0 after the last one, or if the table is malformed
+extern int objLinesNext(obj_lines *lines);
+
+// read a big endian word from (possibly unaligned) p
+static inline unsigned int objWord(const unsigned char *p)
+{
+  return ((unsigned int) p[0] << 24) |
+         ((unsigned int) p[1] << 16) |
+         ((unsigned int) p[2] << 8)  |
+          (unsigned int) p[3];
+}
+
+// get word i of a block's contents
+static inline unsigned int objContentsWord(const obj_block *blk,
+                                           unsigned int i)
+{
+  return objWord(blk->contents + 4 * i);
+}
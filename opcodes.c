@@ -0,0 +1,98 @@
+/*
+ * opcodes.c - opcode table for the xpvm assembler and disassembler
+ */
+#include <stddef.h>
+#include <string.h>
+#include "defs.h"
+
+//////////////////////////////////////////////////////////////////////////
+// process opcodes
+//
+// this array defines the opcodes and the directives, providing their
+// instruction format and their encoding. Of course, only instructions
+// have encodings. it is generated from isa.def, in the same order as
+// the OP_ ids, so opcodes[OP_DIVL] is the divl row.
+//
+// the table is shared by the assembler (assemble.c) and the
+// disassembler (xpdis.c), so it lives in its own module.
+//
+struct opcodeInfo opcodes[] =
+{
+#define OP(id, mnemonic, format, encoding) {mnemonic, format, encoding},
+#define DIR(id, mnemonic, format) {mnemonic, format, 0xFF},
+#include "isa.def"
+{NULL,                    0, 0x00}  /* sentinel */
+};
+
+//////////////////////////////////////////////////////////////////////////
+// lookup by (mnemonic, format)
+//
+// an open addressing hash table of the first row of each mnemonic; its
+// other rows follow it in the table. built by the first lookup, which
+// pass 1 makes before any encoder thread (-s) starts looking up.
+
+// a power of two, over twice the number of mnemonics
+#define NUM_SLOTS 256
+
+static short slots[NUM_SLOTS];    // row + 1, or 0
+static int built = 0;
+
+static unsigned int hash_mnemonic( const char *s )
+{
+  unsigned int h = 5381;
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h & (NUM_SLOTS - 1);
+}
+
+static void build_slots( void )
+{
+  unsigned int row, h;
+
+  for (row = 0; row < NUM_OPS; row += 1)
+  {
+    if (row && !strcmp(opcodes[row].opcode, opcodes[row - 1].opcode))
+      continue;
+    for (h = hash_mnemonic( opcodes[row].opcode ); slots[h];
+         h = (h + 1) & (NUM_SLOTS - 1))
+      ;
+    slots[h] = row + 1;
+  }
+  built = 1;
+}
+
+// the first row of the mnemonic, or -1
+static int first_row( const char *mnemonic )
+{
+  unsigned int h;
+
+  if (!built)
+    build_slots();
+  for (h = hash_mnemonic( mnemonic ); slots[h]; h = (h + 1) & (NUM_SLOTS - 1))
+  {
+    if (!strcmp(mnemonic, opcodes[slots[h] - 1].opcode))
+      return slots[h] - 1;
+  }
+  return -1;
+}
+
+int opcode_lookup( const char *mnemonic, unsigned int format )
+{
+  int row = first_row( mnemonic );
+
+  if (row < 0)
+    return -1;
+  for (; opcodes[row].opcode && !strcmp(mnemonic, opcodes[row].opcode);
+       row += 1)
+  {
+    if (opcodes[row].format == format)
+      return row;
+  }
+  return -2;
+}
+
+char *opcode_name( const char *mnemonic )
+{
+  int row = first_row( mnemonic );
+  return row < 0 ? NULL : opcodes[row].opcode;
+}
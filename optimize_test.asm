@@ -0,0 +1,13 @@
+#
+# optimize_test.asm
+#
+# helper is imported and named only by an ldblkid into a register nothing
+# reads, so -O removes it. The source is still valid and must assemble
+# with -O ("make check_optimize").
+#
+func main
+  import helper
+  ldblkid r2, helper
+  ldimm r1, 0
+  ret r1
+end main
@@ -8,9 +8,11 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "defs.h"
 
 extern unsigned int parseErrorCount;
+extern int yylineno;
 
 int yydebug=1;
 
@@ -29,6 +31,8 @@ void yyerror(char *s);
         char          *y_str;
         unsigned int  y_reg;
         int           y_int;
+        long long     y_long;
+        double        y_dbl;
         INSTR         *y_instr;
         handler_node  *y_handle;
         stmt_node     *y_stmt;
@@ -39,7 +43,10 @@ void yyerror(char *s);
 //        terminal symbols
 //
 %token <y_str> ID
+%token <y_str> STRING
 %token <y_int> INT_CONST
+%token <y_long> LONG_CONST
+%token <y_dbl> DBL_CONST
 %token <y_reg> REG
 %token EOL
 %token COLON
@@ -49,6 +56,8 @@ void yyerror(char *s);
 %token FUNC
 %token END
 %token EXCEPTION
+%token REPT
+%token ENDR
 
 //
 //      typed non-terminal symbols
@@ -56,6 +65,7 @@ void yyerror(char *s);
 %type         <y_str>        opcode
 %type         <y_str>        label
 %type         <y_instr>      instruction
+%type         <y_instr>      data_list
 %type         <y_handle>     handler
 %type         <y_handle>     handler_list
 %type         <y_stmt>       stmt
@@ -68,11 +78,7 @@ void yyerror(char *s);
 program
         : func_list
         {
-          if ( $1 )
-          {
-            func_list = $1;
-            verify_handlers( func_list );
-          }
+          finish_program( $1 );
         }
         ;
 
@@ -81,23 +87,19 @@ func_list
         {
           $$ = NULL;
         }
-        | func func_list
+        | func_list func
         {
-          $$ = process_func_list( $1, $2 );
+          $$ = process_func_list( $2, $1 );
         }
         ;
 
 func
         : FUNC ID handler_list stmt_list END ID 
           {
-            $$ = process_func( $2, $6, $3, $4 );
-            if ($$) {
-              $$->native_ref_list = native_ref_list;
-              $$->num_native_refs = native_ref_list_length(native_ref_list);
-            }
-            /* Reset global variable to NULL, which was filled in
-             * as native references were found during instruction parsing. */
-            native_ref_list = NULL;
+            $$ = finish_func(
+                   process_func( $2, $6, $3, reverse_stmt_list( $4 ) ) );
+            // only the first is kept, as the function's name
+            free( $6 );
           }
         ;
 
@@ -124,9 +126,9 @@ stmt_list
           {
             $$ = NULL;
           }
-        | stmt stmt_list
+        | stmt_list stmt
           {
-            $$ = process_stmt_list( $1, $2 );
+            $$ = process_stmt_list( $2, $1 );
           }
         ;
 
@@ -150,6 +152,10 @@ stmt
              null_instr->format = 0;
              $$ = process_stmt( $1, null_instr );
           }
+        | REPT INT_CONST stmt_list ENDR
+          {
+             $$ = process_rept( $2, reverse_stmt_list( $3 ) );
+          }
         | error
           {
              $$ = NULL;// error recovery - sync with end-of-line
@@ -251,12 +257,75 @@ instruction
             $$->u.format10.reg2 = $4;
             $$->u.format10.reg3 = $6;
           }
+        |
+          opcode REG COMMA LONG_CONST
+          {
+            $$ = calloc( 1, sizeof(INSTR) );
+            $$->format = 11;
+            $$->opcode = $1;
+            $$->u.format11.reg = $2;
+            $$->u.format11.value = $4;
+            $$->u.format11.is_double = 0;
+          }
+        |
+          opcode REG COMMA DBL_CONST
+          {
+            $$ = calloc( 1, sizeof(INSTR) );
+            $$->format = 11;
+            $$->opcode = $1;
+            $$->u.format11.reg = $2;
+            memcpy( &$$->u.format11.value, &$4, sizeof $4 );
+            $$->u.format11.is_double = 1;
+          }
+        |
+          data_list
+          {
+            $$ = $1;
+          }
+        |
+          opcode STRING
+          {
+            $$ = calloc( 1, sizeof(INSTR) );
+            $$->format = 13;
+            $$->opcode = $1;
+            $$->u.format13.path = $2;
+            $$->u.format13.offset = 0;
+            $$->u.format13.length = -1;
+          }
+        |
+          opcode STRING COMMA INT_CONST COMMA INT_CONST
+          {
+            $$ = calloc( 1, sizeof(INSTR) );
+            $$->format = 13;
+            $$->opcode = $1;
+            $$->u.format13.path = $2;
+            $$->u.format13.offset = $4;
+            $$->u.format13.length = $6;
+          }
+        ;
+
+data_list
+        : opcode INT_CONST COMMA INT_CONST
+          {
+            $$ = process_data( $1, $2, $4 );
+          }
+        | data_list COMMA INT_CONST
+          {
+            $$ = process_data_list( $1, $3 );
+          }
         ;
 
 opcode
         : ID
           {
-             $$ = $1;
+             // the lookahead is an operand, so this is still its line
+             sourceLine = yylineno;
+             // a known opcode is the table's string, so statements
+             //   don't each hold a copy
+             if (($$ = opcode_name( $1 )))
+               free( $1 );
+             else
+               $$ = $1;
           }
         ;
 
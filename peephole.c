@@ -0,0 +1,318 @@
+/*
+ * peephole.c - peephole optimizer for the xpvm assembler
+ *
+ *              Runs over each function's statement list after pass 1
+ *              (and verify_handlers) when xpas is given -O. Labels are
+ *              statements of their own, so "adjacent" below always means
+ *              no label between, which keeps every rewrite inside one
+ *              exception handler range as well. The caller must run
+ *              relayout_funcs afterwards.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+// longest jump chain that will be followed
+#define MAX_CHAIN 16
+
+// is the statement the instruction of the given OP_ id?
+static int is_instr( stmt_node *stmt, enum opcodeId op )
+{
+  return stmt && stmt->instr->format == opcodes[op].format &&
+         opcode_lookup(stmt->instr->opcode, stmt->instr->format) == op;
+}
+
+/*
+ * next_instr
+ *
+ * Returns the first instruction at or after stmt, skipping labels, or
+ * NULL if the function ends first.
+ */
+static stmt_node *next_instr( stmt_node *stmt )
+{
+  while (stmt && stmt->instr->format == 0)
+    stmt = stmt->link;
+  return stmt;
+}
+
+/*
+ * find_label
+ *
+ * Returns the label statement for name in the statement list, or NULL.
+ */
+static stmt_node *find_label( stmt_node *list, const char *name )
+{
+  stmt_node *walk;
+  for (walk = list; walk; walk = walk->link)
+  {
+    if (walk->instr->format == 0 && !strcmp(walk->label, name))
+      return walk;
+  }
+  return NULL;
+}
+
+/*
+ * is_const_load
+ *
+ * ldimm and ldblkid only write their register, so one that is
+ * immediately overwritten by another is dead.
+ */
+static int is_const_load( stmt_node *stmt, unsigned int *reg )
+{
+  if (is_instr(stmt, OP_LDIMM))
+  {
+    *reg = stmt->instr->u.format4.reg;
+    return 1;
+  }
+  if (is_instr(stmt, OP_LDBLKID))
+  {
+    *reg = stmt->instr->u.format5.reg;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * is_reload
+ *
+ * Is load a full width load of exactly what store just stored, with the
+ * same registers? Then the value is already in the register.
+ */
+static int is_reload( stmt_node *store, stmt_node *load )
+{
+  static const enum opcodeId pairs[][2] = {
+    { OP_STL, OP_LDL }, { OP_STL_I, OP_LDL_I },
+    { OP_STD, OP_LDD }, { OP_STD_I, OP_LDD_I }
+  };
+  unsigned int i;
+  INSTR *s = store->instr;
+  INSTR *l = load->instr;
+  int store_op, load_op;
+
+  if (s->format != l->format || (s->format != 7 && s->format != 10))
+    return 0;
+  store_op = opcode_lookup(s->opcode, s->format);
+  load_op = opcode_lookup(l->opcode, l->format);
+  for (i = 0; i < sizeof pairs / sizeof pairs[0]; i += 1)
+  {
+    if (store_op == pairs[i][0] && load_op == pairs[i][1])
+    {
+      if (s->format == 7)
+        return s->u.format7.reg1 == l->u.format7.reg1 &&
+               s->u.format7.reg2 == l->u.format7.reg2 &&
+               s->u.format7.const8 == l->u.format7.const8;
+      return s->u.format10.reg1 == l->u.format10.reg1 &&
+             s->u.format10.reg2 == l->u.format10.reg2 &&
+             s->u.format10.reg3 == l->u.format10.reg3;
+    }
+  }
+  return 0;
+}
+
+/*
+ * branch_target
+ *
+ * Returns a pointer to the label operand of a jmp/btrue/bfalse, or NULL
+ * if stmt is not a direct branch.
+ */
+static char **branch_target( stmt_node *stmt )
+{
+  if (is_instr(stmt, OP_JMP))
+    return &stmt->instr->u.format2.addr;
+  if (is_instr(stmt, OP_BTRUE) || is_instr(stmt, OP_BFALSE))
+    return &stmt->instr->u.format5.addr;
+  return NULL;
+}
+
+/*
+ * final_target
+ *
+ * Follow a chain of labels that lead straight to unconditional jumps,
+ * returning the last label in the chain. Chains that are too long (or
+ * loop) are left alone.
+ */
+static char *final_target( stmt_node *list, char *label )
+{
+  char *start = label;
+  int n;
+  for (n = 0; n < MAX_CHAIN; n += 1)
+  {
+    stmt_node *lbl = find_label( list, label );
+    stmt_node *instr;
+    if (!lbl)
+      return label;
+    instr = next_instr( lbl );
+    if (!is_instr(instr, OP_JMP) ||
+        !strcmp(instr->instr->u.format2.addr, label))
+      return label;
+    label = instr->instr->u.format2.addr;
+  }
+  return start;
+}
+
+/*
+ * log2_exact
+ *
+ * Returns k if value is 2^k (k < 64), otherwise -1.
+ */
+static int log2_exact( long long value )
+{
+  int k;
+  if (value <= 0 || (value & (value - 1)))
+    return -1;
+  for (k = 0; (1LL << k) != value; k += 1)
+    ;
+  return k;
+}
+
+/*
+ * mul_to_shift
+ *
+ * Rewrite a multiply by a power of two into a left shift: either the
+ * immediate form "mull ra, rb, 2^k", or the register form when the
+ * multiplier was loaded by the ldimm right before it. In the second case
+ * the ldimm stays, since its register may be read later.
+ */
+static int mul_to_shift( stmt_node *prev, stmt_node *stmt )
+{
+  INSTR *instr = stmt->instr;
+  int k;
+
+  if (is_instr(stmt, OP_MULL_I))
+  {
+    if ((k = log2_exact(instr->u.format7.const8)) < 0)
+      return 0;
+    instr->opcode = "lshift";
+    instr->u.format7.const8 = k;
+    return 1;
+  }
+
+  if (is_instr(stmt, OP_MULL) && is_instr(prev, OP_LDIMM) &&
+      (k = log2_exact(prev->instr->u.format4.constant)) >= 0)
+  {
+    unsigned int ra = instr->u.format10.reg1;
+    unsigned int rb = instr->u.format10.reg2;
+    unsigned int rc = instr->u.format10.reg3;
+    unsigned int rk = prev->instr->u.format4.reg;
+
+    // the other operand must not be the constant register itself
+    if (rc == rk && rb != rk)
+      ;
+    else if (rb == rk && rc != rk)
+      rb = rc;
+    else
+      return 0;
+    instr->opcode = "lshift";
+    instr->format = 7;
+    instr->u.format7.reg1 = ra;
+    instr->u.format7.reg2 = rb;
+    instr->u.format7.const8 = k;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * peephole_func
+ *
+ * Apply the rewrites to one function until nothing changes.
+ * Returns the number of instructions removed.
+ */
+static int peephole_func( func_node *func )
+{
+  int removed = 0;
+  int changed = 1;
+
+  while (changed)
+  {
+    stmt_node **link = &func->stmt_list;
+    stmt_node *prev = NULL;
+    changed = 0;
+
+    while (*link)
+    {
+      stmt_node *stmt = *link;
+      stmt_node *next = stmt->link;
+      char **target;
+      unsigned int r1, r2;
+      int drop = 0;
+
+      if (stmt->instr->format == 0)
+      {
+        prev = NULL;
+        link = &stmt->link;
+        continue;
+      }
+
+      // ldimm r, a; ldimm r, b  =>  ldimm r, b
+      if (is_const_load(stmt, &r1) && next && is_const_load(next, &r2) &&
+          r1 == r2)
+      {
+        drop = 1;
+      }
+      // stl ra, rb, c; ldl ra, rb, c  =>  stl ra, rb, c
+      else if (prev && is_reload(prev, stmt))
+      {
+        drop = 1;
+      }
+      else if ((target = branch_target(stmt)))
+      {
+        // branch to a label right after it  =>  nothing
+        stmt_node *walk;
+        for (walk = next; walk && walk->instr->format == 0; walk = walk->link)
+        {
+          if (!strcmp(walk->label, *target))
+          {
+            drop = 1;
+            break;
+          }
+        }
+        // branch to a jump  =>  branch to the jump's target
+        if (!drop)
+        {
+          char *final = final_target( func->stmt_list, *target );
+          if (final != *target && func->length < 0x7FFF)
+          {
+            *target = final;
+            changed = 1;
+          }
+        }
+      }
+      else if (mul_to_shift(prev, stmt))
+      {
+        changed = 1;
+      }
+
+      if (drop)
+      {
+        *link = next;
+        free(stmt->instr);
+        free(stmt);
+        removed += 1;
+        changed = 1;
+        continue;
+      }
+      prev = stmt;
+      link = &stmt->link;
+    }
+  }
+  return removed;
+}
+
+/*
+ * peephole_funcs
+ *
+ * Run the peephole optimizer over every function.
+ * Returns the number of instructions removed.
+ */
+int peephole_funcs( func_node *root )
+{
+  int removed = 0;
+  func_node *walk;
+  for (walk = root; walk; walk = walk->link)
+  {
+    removed += peephole_func( walk );
+  }
+  return removed;
+}
@@ -0,0 +1,150 @@
+/*
+ * regcompact.c - register compaction for the xpvm assembler
+ *
+ *                Renames the registers of each function into a dense
+ *                range, so its frame (see frame_size) is no larger than
+ *                the number of registers it uses. Run when xpas is given
+ *                -r, after the optimizer.
+ *
+ *                Registers are local to the frame, so a renaming that is
+ *                the same for every statement of a function, its handlers
+ *                included, doesn't change what it does. The registers call,
+ *                calln and ret name are operands like any other; what stays
+ *                put is what a frame shares with its caller and callees
+ *                without naming it:
+ *
+ *                  r0 to r15: arguments are passed in the registers below
+ *                  fp, and fp, sp and pc are r13 to r15. Every frame holds
+ *                  these anyway.
+ *
+ *                  the registers from r1 up that a calln passes as its
+ *                  arguments (its constant is their count).
+ *
+ *                The other registers are given the lowest free numbers
+ *                from r16 up, in their original order, so none moves up.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+// the first register that isn't part of every frame
+#define FIRST_FREE 16
+
+/*
+ * instr_regs
+ *
+ * Points regs at the register operands of instr and returns how many
+ * there are.
+ */
+static unsigned int instr_regs( INSTR *instr, unsigned int *regs[3] )
+{
+  switch (instr->format)
+  {
+    case 3:
+      regs[0] = &instr->u.format3.reg;
+      return 1;
+    case 4:
+      regs[0] = &instr->u.format4.reg;
+      return 1;
+    case 5:
+      regs[0] = &instr->u.format5.reg;
+      return 1;
+    case 6:
+      regs[0] = &instr->u.format6.reg1;
+      regs[1] = &instr->u.format6.reg2;
+      return 2;
+    case 7:
+      regs[0] = &instr->u.format7.reg1;
+      regs[1] = &instr->u.format7.reg2;
+      return 2;
+    case 8:
+      regs[0] = &instr->u.format8.reg1;
+      regs[1] = &instr->u.format8.reg2;
+      return 2;
+    case 10:
+      regs[0] = &instr->u.format10.reg1;
+      regs[1] = &instr->u.format10.reg2;
+      regs[2] = &instr->u.format10.reg3;
+      return 3;
+    case 11:
+      regs[0] = &instr->u.format11.reg;
+      return 1;
+  }
+  return 0;
+}
+
+/*
+ * compact_func
+ *
+ * Renames the registers of one function. Returns the number renamed.
+ */
+static unsigned int compact_func( func_node *func )
+{
+  unsigned char used[256], fixed[256];
+  unsigned int map[256];
+  unsigned int *regs[3];
+  unsigned int i, n, r, next, renamed = 0;
+  stmt_node *walk;
+
+  memset( used, 0, sizeof used );
+  memset( fixed, 0, sizeof fixed );
+  for (r = 0; r < FIRST_FREE; r += 1)
+    fixed[r] = 1;
+
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    INSTR *instr = walk->instr;
+    n = instr_regs( instr, regs );
+    for (i = 0; i < n; i += 1)
+      used[*regs[i]] = 1;
+    if (instr->format == 7 && opcode_lookup(instr->opcode, 7) == OP_CALLN)
+    {
+      for (r = 1; r <= (unsigned int) (instr->u.format7.const8 & 0xFF);
+           r += 1)
+        fixed[r] = 1;
+    }
+  }
+
+  // the renamed ones take the lowest numbers that aren't fixed
+  next = FIRST_FREE;
+  for (r = 0; r < 256; r += 1)
+  {
+    map[r] = r;
+    if (!used[r] || fixed[r])
+      continue;
+    while (fixed[next])
+      next += 1;
+    map[r] = next++;
+    renamed += map[r] != r;
+  }
+  if (!renamed)
+    return 0;
+
+  for (walk = func->stmt_list; walk; walk = walk->link)
+  {
+    n = instr_regs( walk->instr, regs );
+    for (i = 0; i < n; i += 1)
+      *regs[i] = map[*regs[i]];
+  }
+  return renamed;
+}
+
+int compact_regs_funcs( func_node *list, FILE *report )
+{
+  func_node *walk;
+  int funcs = 0;
+
+  for (walk = list; walk; walk = walk->link)
+  {
+    unsigned int before = frame_size( walk );
+    unsigned int renamed = compact_func( walk );
+    if (!renamed)
+      continue;
+    if (report)
+      fprintf(report, "regcompact: %s: renamed %u register(s), frame %u -> %u\n",
+              walk->name, renamed, before, frame_size( walk ));
+    funcs += 1;
+  }
+  return funcs;
+}
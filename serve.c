@@ -0,0 +1,244 @@
+/*
+ * serve.c - resident assembler server for the xpvm assembler
+ *
+ *           xpas --serve socket listens on a Unix domain socket, so a
+ *           client that assembles many small sources pays for process
+ *           startup once. Each connection carries one request:
+ *
+ *             request   word length, then length bytes of source
+ *             reply     word status, word length, then length bytes
+ *
+ *           Words are big endian, like the object file. A status of 0
+ *           means the bytes are the object file; otherwise it is the
+ *           number of errors and the bytes are the diagnostics. A
+ *           request that hits a fatal error is closed without a reply.
+ *           Every request is assembled with the options the server was
+ *           started with.
+ *
+ *           The assembler keeps its state in globals, so each connection
+ *           is handled by a forked child: it starts from the server's
+ *           initialized state, and whatever it leaves behind goes away
+ *           with it. Clients are handled concurrently. incbin paths are
+ *           relative to the server's directory.
+ *
+ *           A request touches no file of its own: the source is read
+ *           from the buffer it was received into, and the object file
+ *           and diagnostics are written to memory (a memory file, since
+ *           the header of the object file is patched once the rest is
+ *           written, which open_memstream would cut short). -s still
+ *           spools the blocks to a temporary file.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "defs.h"
+
+// sources larger than this are refused
+#define MAX_SOURCE (64 * 1024 * 1024)
+
+// the message module is told where diagnostics go
+extern void InitMessages( FILE * );
+
+static int read_all( int fd, void *buf, size_t n )
+{
+  char *p = buf;
+  while (n)
+  {
+    ssize_t got = read( fd, p, n );
+    if (got < 0 && errno == EINTR)
+      continue;
+    if (got <= 0)
+      return -1;
+    p += got;
+    n -= got;
+  }
+  return 0;
+}
+
+static int write_all( int fd, const void *buf, size_t n )
+{
+  const char *p = buf;
+  while (n)
+  {
+    ssize_t put = write( fd, p, n );
+    if (put < 0 && errno == EINTR)
+      continue;
+    if (put <= 0)
+      return -1;
+    p += put;
+    n -= put;
+  }
+  return 0;
+}
+
+// a memory file: bytes written anywhere in it, seeks included
+struct mem_file {
+  char *data;
+  size_t length;
+  size_t size;
+  off64_t at;
+};
+
+static ssize_t mem_write( void *cookie, const char *buf, size_t n )
+{
+  struct mem_file *m = cookie;
+  if (m->at + n > m->size)
+  {
+    size_t size = m->size ? m->size : 1 << 16;
+    while (size < m->at + n)
+      size *= 2;
+    if (!(m->data = realloc( m->data, size )))
+      fatal("malloc failed for the reply to a request");
+    m->size = size;
+  }
+  memcpy( m->data + m->at, buf, n );
+  m->at += n;
+  if (m->at > m->length)
+    m->length = m->at;
+  return n;
+}
+
+static int mem_seek( void *cookie, off64_t *offset, int whence )
+{
+  struct mem_file *m = cookie;
+  off64_t at = *offset + (whence == SEEK_SET ? 0 :
+                          whence == SEEK_CUR ? m->at : (off64_t) m->length);
+  // a seek past the end would leave a hole, which nothing here makes
+  if (at < 0 || at > (off64_t) m->length)
+    return -1;
+  *offset = m->at = at;
+  return 0;
+}
+
+static FILE *mem_open( struct mem_file *m )
+{
+  cookie_io_functions_t io = { NULL, mem_write, mem_seek, NULL };
+  memset( m, 0, sizeof *m );
+  return fopencookie( m, "w", io );
+}
+
+/*
+ * send_reply
+ *
+ * Reply with the status and the length bytes at data.
+ */
+static int send_reply( int fd, unsigned int status, const char *data,
+                       size_t length )
+{
+  unsigned char head[8];
+  int i;
+
+  for (i = 0; i < 4; i += 1)
+  {
+    head[i] = status >> (24 - 8 * i);
+    head[4 + i] = (unsigned long) length >> (24 - 8 * i);
+  }
+  if (write_all( fd, head, sizeof head ) || write_all( fd, data, length ))
+    return -1;
+  return 0;
+}
+
+/*
+ * handle
+ *
+ * Assemble the one request on the connection fd, in a child of the
+ * server.
+ */
+static int handle( int fd )
+{
+  unsigned char head[4];
+  unsigned long length;
+  char *source;
+  FILE *in, *out, *diag;
+  struct mem_file object, diagnostics;
+  int errors;
+
+  if (read_all( fd, head, sizeof head ))
+    return 1;
+  length = (unsigned long) head[0] << 24 | head[1] << 16 | head[2] << 8 |
+           head[3];
+  if (length > MAX_SOURCE)
+    return 1;
+  if (!(source = malloc( length ? length : 1 )))
+    fatal("malloc failed for the source");
+  if (read_all( fd, source, length ))
+    return 1;
+
+  // the passes seek in both, so the object file is a memory file
+  if (!(in = fmemopen( source, length, "r" )) ||
+      !(out = mem_open( &object )) || !(diag = mem_open( &diagnostics )))
+    fatal("can't create the streams for a request");
+  InitMessages( diag );
+
+  errors = assembleFile( in, out );
+  if (fclose( out ) || fclose( diag ))
+    return 1;
+  if (errors)
+    return send_reply( fd, errors, diagnostics.data, diagnostics.length ) != 0;
+  return send_reply( fd, 0, object.data, object.length ) != 0;
+}
+
+int serve( const char *path )
+{
+  struct sockaddr_un addr;
+  struct sigaction sa;
+  int listener, fd;
+
+  if (strlen( path ) >= sizeof addr.sun_path)
+  {
+    fprintf(stderr, "socket name %s is too long\n", path);
+    return 1;
+  }
+  memset( &addr, 0, sizeof addr );
+  addr.sun_family = AF_UNIX;
+  strcpy( addr.sun_path, path );
+
+  // children are never waited for, and a client that goes away early
+  //   only loses its reply
+  memset( &sa, 0, sizeof sa );
+  sa.sa_handler = SIG_IGN;
+  sa.sa_flags = SA_NOCLDWAIT;
+  sigaction( SIGCHLD, &sa, NULL );
+  sa.sa_flags = 0;
+  sigaction( SIGPIPE, &sa, NULL );
+
+  // a socket left by an earlier server is replaced
+  unlink( path );
+  if ((listener = socket( AF_UNIX, SOCK_STREAM, 0 )) < 0 ||
+      bind( listener, (struct sockaddr *) &addr, sizeof addr ) < 0 ||
+      listen( listener, 64 ) < 0)
+  {
+    fprintf(stderr, "can't listen on %s: %s\n", path, strerror( errno ));
+    return 1;
+  }
+
+  for (;;)
+  {
+    if ((fd = accept( listener, NULL, NULL )) < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      fprintf(stderr, "accept failed on %s: %s\n", path, strerror( errno ));
+      return 1;
+    }
+    switch (fork())
+    {
+      case -1:
+        // the client sees the connection close without a reply
+        fprintf(stderr, "fork failed: %s\n", strerror( errno ));
+        break;
+      case 0:
+        close( listener );
+        exit(handle( fd ));
+      default:
+        break;
+    }
+    close( fd );
+  }
+}
@@ -0,0 +1,358 @@
+/*
+ * stream.c - encode functions while the rest of the file is parsed (-s)
+ *
+ *            Each function goes to an encoder thread as soon as the
+ *            parser has reduced it, through a queue of STREAM_DEPTH
+ *            functions, and is freed once it is encoded, strings and
+ *            all. resolve_func drops its fixups and labels from the
+ *            symbol table, which then holds little more than the block
+ *            names, so only a few functions are in memory at a time,
+ *            and encoding overlaps parsing. Nothing is left for pass 2
+ *            to parse.
+ *
+ *            The blocks are encoded to a spool file, since the insymbol
+ *            table in front of them isn't known until the parse ends;
+ *            stream_finish copies them into the object file. The parser
+ *            thread resolves the label operands of a function before it
+ *            is queued (resolve_func), so the encoder never reads the
+ *            symbol table. An ldblkid naming a block that isn't parsed
+ *            yet is encoded with 0 and patched by stream_finish.
+ *
+ *            The labels a function's operands name must be defined by
+ *            the end of it, and are local to it: a later function can't
+ *            name them, and may define its own with the same names. A
+ *            function that uses one defined later, or
+ *            any function once pass 1 has found an error, stops the
+ *            queue: the object file won't be written, so nothing more
+ *            is encoded, and the error is reported between the passes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "defs.h"
+
+// functions parsed but not yet encoded, at most
+#define STREAM_DEPTH 2
+
+int streamFuncs = 0;
+
+static pthread_t encoder;
+
+// the queue and the block names are shared by the parser and encoder
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static func_node *queue[STREAM_DEPTH];
+static unsigned int head, count;
+static int parsed;          // the parse is over
+
+// the blocks are encoded here
+static FILE *spool;
+
+// set once a function can't be queued
+static int stopped;
+static char *lateLabel, *lateFunc;
+
+// block names by id, and a hash table of id + 1 by name
+static char **names;
+static unsigned int numNames, maxNames;
+static unsigned int *buckets;
+static unsigned int numBuckets;
+
+// an ldblkid to patch once its block is known
+struct patch {
+  char *name;           // a copy, the statement is freed
+  long at;              // offset in the spool
+  unsigned int word;    // the instruction, less the block id
+};
+static struct patch *patches;
+static unsigned int numPatches, maxPatches;
+
+static unsigned int hash( const char *s )
+{
+  unsigned int h = 5381;
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+// lookup
+//
+// the id of the block, or -1; called with lock held
+//
+static int lookup( const char *name )
+{
+  unsigned int i;
+  if (!numBuckets)
+    return -1;
+  for (i = hash( name ) & (numBuckets - 1); buckets[i];
+       i = (i + 1) & (numBuckets - 1))
+  {
+    if (!strcmp(names[buckets[i] - 1], name))
+      return buckets[i] - 1;
+  }
+  return -1;
+}
+
+// add_block
+//
+// give the next block id to name; called with lock held
+//
+static void add_block( char *name )
+{
+  unsigned int i;
+
+  if (numNames == maxNames)
+  {
+    maxNames = maxNames ? 2 * maxNames : 64;
+    if (!(names = realloc( names, maxNames * sizeof *names )))
+      fatal("malloc failed in add_block");
+  }
+  // a name defined twice is reported by pass 1; the first one is kept
+  if (lookup( name ) < 0)
+  {
+    if (2 * (numNames + 1) > numBuckets)
+    {
+      unsigned int n;
+      free(buckets);
+      numBuckets = numBuckets ? 2 * numBuckets : 128;
+      if (!(buckets = calloc( numBuckets, sizeof *buckets )))
+        fatal("malloc failed in add_block");
+      for (n = 0; n < numNames; n += 1)
+      {
+        if (lookup( names[n] ) < 0)
+        {
+          for (i = hash( names[n] ) & (numBuckets - 1); buckets[i];
+               i = (i + 1) & (numBuckets - 1))
+            ;
+          buckets[i] = n + 1;
+        }
+      }
+    }
+    for (i = hash( name ) & (numBuckets - 1); buckets[i];
+         i = (i + 1) & (numBuckets - 1))
+      ;
+    buckets[i] = numNames + 1;
+  }
+  names[numNames++] = name;
+}
+
+// release_func
+//
+// free what only the function refers to: its statements with their
+// labels and operands (the symbol table has its own copies), and its
+// handlers. its name is kept as its block's, and its opcodes are the
+// table's (see opcode_name)
+//
+static void release_func( func_node *func )
+{
+  while (func->stmt_list)
+  {
+    stmt_node *next = func->stmt_list->link;
+    INSTR *instr = func->stmt_list->instr;
+    switch (instr->format)
+    {
+      case 2:
+        free(instr->u.format2.addr);
+        break;
+      case 5:
+        free(instr->u.format5.addr);
+        break;
+      case 8:
+        free(instr->u.format8.addr);
+        break;
+      case 11:
+        free(instr->u.format11.pool);
+        break;
+      case 12:
+        free(instr->u.format12.values);
+        break;
+      case 13:
+        free(instr->u.format13.path);
+        break;
+    }
+    free(instr);
+    free(func->stmt_list->label);
+    free(func->stmt_list);
+    func->stmt_list = next;
+  }
+  while (func->handler_list)
+  {
+    handler_node *next = func->handler_list->link;
+    free(func->handler_list->handle_lbl);
+    free(func->handler_list->start_lbl);
+    free(func->handler_list->end_lbl);
+    free(func->handler_list);
+    func->handler_list = next;
+  }
+  // the names of the native references are their ldnative operands
+  while (func->native_ref_list)
+  {
+    native_ref_node *next = func->native_ref_list->link;
+    free(func->native_ref_list);
+    func->native_ref_list = next;
+  }
+  free(func);
+}
+
+// encode_queue
+//
+// the encoder thread
+//
+static void *encode_queue( void *arg )
+{
+  func_node *func;
+
+  for (;;)
+  {
+    pthread_mutex_lock( &lock );
+    while (!count && !parsed)
+      pthread_cond_wait( &changed, &lock );
+    if (!count)
+    {
+      pthread_mutex_unlock( &lock );
+      return NULL;
+    }
+    func = queue[head];
+    head = (head + 1) % STREAM_DEPTH;
+    count -= 1;
+    pthread_cond_broadcast( &changed );
+    pthread_mutex_unlock( &lock );
+
+    encode_func( func );
+    release_func( func );
+  }
+}
+
+void stream_begin( void )
+{
+  if (!(spool = tmpfile()))
+    fatal("can't create the spool file for -s");
+  set_output( spool );
+  if (pthread_create( &encoder, NULL, encode_queue, NULL ))
+    fatal("can't start the encoder thread");
+}
+
+func_node *stream_func( func_node *func )
+{
+  char *label;
+
+  if (!streamFuncs || !func)
+    return func;
+
+  pthread_mutex_lock( &lock );
+  add_block( func->name );
+  pthread_mutex_unlock( &lock );
+
+  // the rest of pass 1, for this function alone
+  func->link = NULL;
+  expand_constants( func );
+  verify_handlers( func );
+
+  if (!stopped)
+  {
+    switch (resolve_func( func, &label ))
+    {
+      case 0:
+        pthread_mutex_lock( &lock );
+        while (count == STREAM_DEPTH)
+          pthread_cond_wait( &changed, &lock );
+        queue[(head + count) % STREAM_DEPTH] = func;
+        count += 1;
+        pthread_cond_broadcast( &changed );
+        pthread_mutex_unlock( &lock );
+        return NULL;
+      case 1:
+        lateLabel = label;
+        lateFunc = func->name;
+        // fall through
+      default:
+        stopped = 1;
+    }
+  }
+  release_func( func );
+  return NULL;
+}
+
+int stream_end( void )
+{
+  pthread_mutex_lock( &lock );
+  parsed = 1;
+  pthread_cond_broadcast( &changed );
+  pthread_mutex_unlock( &lock );
+  pthread_join( encoder, NULL );
+
+  // a label that is never defined is reported between the passes
+  if (lateLabel && is_defined( lateLabel ))
+  {
+    error("label %s is used in %s before it is defined, which -s can't "
+          "encode", lateLabel, lateFunc);
+    return 1;
+  }
+  return 0;
+}
+
+unsigned int stream_blk_id( const char *name, long at, unsigned int word )
+{
+  int id;
+
+  pthread_mutex_lock( &lock );
+  id = lookup( name );
+  pthread_mutex_unlock( &lock );
+  if (id >= 0)
+    return id;
+
+  if (numPatches == maxPatches)
+  {
+    maxPatches = maxPatches ? 2 * maxPatches : 64;
+    if (!(patches = realloc( patches, maxPatches * sizeof *patches )))
+      fatal("malloc failed in stream_blk_id");
+  }
+  if (!(patches[numPatches].name = strdup( name )))
+    fatal("malloc failed in stream_blk_id");
+  patches[numPatches].at = at;
+  patches[numPatches].word = word;
+  numPatches += 1;
+  return 0;
+}
+
+int stream_lookup( const char *name )
+{
+  return lookup( name );
+}
+
+char *stream_block( unsigned int id )
+{
+  return id < numNames ? names[id] : NULL;
+}
+
+void stream_finish( FILE *out )
+{
+  long base = ftell( out ), length;
+  unsigned int i;
+
+  if (fflush( spool ) || fseek( spool, 0, SEEK_END ) ||
+      (length = ftell( spool )) < 0 ||
+      copy_range( fileno( spool ), 0, length, out ))
+    fatal("can't copy the spool file into the object file");
+  fclose( spool );
+
+  // an imported block isn't found, and keeps 0
+  for (i = 0; i < numPatches; i += 1)
+  {
+    int id = lookup( patches[i].name );
+    unsigned int word = patches[i].word | (id & 0xFFFF);
+    free(patches[i].name);
+    if (id < 0)
+      continue;
+    if (fseek( out, base + patches[i].at, SEEK_SET ))
+      fatal("can't seek back to patch the object file");
+    putc( word >> 24, out );
+    putc( word >> 16, out );
+    putc( word >> 8, out );
+    putc( word, out );
+  }
+  if (fseek( out, 0, SEEK_END ))
+    fatal("can't seek back to patch the object file");
+  free(patches);
+}
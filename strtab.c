@@ -0,0 +1,120 @@
+/*
+ * strtab.c - the object file's string table
+ *
+ *            Block and native names are written as byte offsets into a
+ *            single table of NUL terminated strings at the end of the
+ *            object file. Each distinct string is stored once. Other
+ *            files with names in a string table (ir.c) make their own
+ *            with strtab_new, so they don't add to the object file's.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defs.h"
+
+struct strtab_entry {
+  unsigned int offset;
+  struct strtab_entry *link;
+};
+
+struct strtab {
+  char *data;
+  unsigned int length;
+  unsigned int allocated;
+  struct strtab_entry **buckets;
+  unsigned int num_buckets;
+  unsigned int num_entries;
+};
+
+// the object file's
+static struct strtab object_strings;
+
+static unsigned int hash_string( const char *s )
+{
+  unsigned int h = 5381;
+  while (*s)
+    h = h * 33 + (unsigned char) *s++;
+  return h;
+}
+
+// grow the hash table, keeping the load under one
+static void rehash( struct strtab *t )
+{
+  unsigned int n = t->num_buckets ? 2 * t->num_buckets : 256;
+  struct strtab_entry **fresh = calloc( n, sizeof *fresh );
+  unsigned int i;
+
+  if (!fresh)
+    fatal("malloc failed in strtab_add");
+  for (i = 0; i < t->num_buckets; i += 1)
+  {
+    while (t->buckets[i])
+    {
+      struct strtab_entry *e = t->buckets[i];
+      unsigned int h = hash_string( t->data + e->offset ) & (n - 1);
+      t->buckets[i] = e->link;
+      e->link = fresh[h];
+      fresh[h] = e;
+    }
+  }
+  free(t->buckets);
+  t->buckets = fresh;
+  t->num_buckets = n;
+}
+
+struct strtab *strtab_new( void )
+{
+  struct strtab *t = calloc( 1, sizeof *t );
+  if (!t)
+    fatal("malloc failed in strtab_new");
+  return t;
+}
+
+unsigned int strtab_add( struct strtab *t, const char *s )
+{
+  unsigned int size = strlen( s ) + 1;
+  struct strtab_entry *e;
+  unsigned int h;
+
+  if (t->num_entries >= t->num_buckets)
+    rehash( t );
+  h = hash_string( s ) & (t->num_buckets - 1);
+  for (e = t->buckets[h]; e; e = e->link)
+  {
+    if (!strcmp(t->data + e->offset, s))
+      return e->offset;
+  }
+
+  if (t->length + size > t->allocated)
+  {
+    while (t->length + size > t->allocated)
+      t->allocated = t->allocated ? 2 * t->allocated : 4096;
+    if (!(t->data = realloc( t->data, t->allocated )))
+      fatal("malloc failed in strtab_add");
+  }
+  if (!(e = malloc( sizeof *e )))
+    fatal("malloc failed in strtab_add");
+  memcpy( t->data + t->length, s, size );
+  e->offset = t->length;
+  e->link = t->buckets[h];
+  t->buckets[h] = e;
+  t->num_entries += 1;
+  t->length += size;
+  return e->offset;
+}
+
+const char *strtab_contents( struct strtab *t, unsigned int *size )
+{
+  *size = t->length;
+  return t->data;
+}
+
+unsigned int strtab_intern( const char *s )
+{
+  return strtab_add( &object_strings, s );
+}
+
+const char *strtab_data( unsigned int *size )
+{
+  return strtab_contents( &object_strings, size );
+}
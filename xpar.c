@@ -0,0 +1,328 @@
+//
+// xpar.c - archiver for xpvm object files
+//
+//          Usage: xpar c archive.xpa file.obj ...   create an archive
+//                 xpar t archive.xpa                list members and exports
+//                 xpar x archive.xpa [member ...]   extract members
+//
+// see archive.h for the layout. the export index is built when the
+// archive is created: every insymbol of every member goes into a hash
+// table stored in the archive, so a linker looking for a block reads
+// one bucket. a block may only be exported by one member.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "defs.h"
+#include "objread.h"
+#include "archive.h"
+
+static FILE *outf;
+
+// fatal
+//
+// out of memory and the like; strtab.c reports through this too
+//
+void fatal(char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "xpar: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+static void *xmalloc(size_t n)
+{
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+  {
+    fatal("out of memory");
+  }
+  return p;
+}
+
+static void usage(void)
+{
+  fprintf(stderr, "usage: xpar c archive.xpa file.obj ...\n"
+                  "       xpar t archive.xpa\n"
+                  "       xpar x archive.xpa [member ...]\n");
+  exit(1);
+}
+
+static void putWord(unsigned int w)
+{
+  putc(w >> 24, outf);
+  putc(w >> 16, outf);
+  putc(w >> 8, outf);
+  putc(w, outf);
+}
+
+static void putBytes(const void *p, size_t n)
+{
+  if (n && fwrite(p, 1, n, outf) != n)
+  {
+    fatal("write failed");
+  }
+}
+
+static void pad(size_t n)
+{
+  for (; n & 3; n += 1)
+  {
+    putc(0, outf);
+  }
+}
+
+// baseName
+//
+// members are named by the last component of their path
+//
+static const char *baseName(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  return slash ? slash + 1 : path;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// create
+
+struct export {
+  const char   *name;
+  unsigned int member;
+  unsigned int bucket;
+  unsigned int next;
+};
+
+static int create(const char *path, char **files, int numFiles)
+{
+  obj_file *objs = xmalloc(numFiles * sizeof *objs);
+  struct export *exports;
+  unsigned int *buckets, *memberNames, *offsets;
+  unsigned int numExports = 0, numBuckets, i, j, length;
+  unsigned long long at;
+  const char *strings;
+  int k, errors = 0;
+
+  for (k = 0; k < numFiles; k += 1)
+  {
+    if (objOpen(files[k], &objs[k]))
+    {
+      fatal("%s", objError());
+    }
+    numExports += objs[k].num_insyms;
+  }
+
+  // the names go into the string table first, so its size is known
+  memberNames = xmalloc(numFiles * sizeof *memberNames);
+  exports = xmalloc(numExports * sizeof *exports);
+  for (k = 0; k < numFiles; k += 1)
+  {
+    memberNames[k] = strtab_intern(baseName(files[k]));
+  }
+  for (numBuckets = 16; numBuckets < numExports; numBuckets *= 2)
+    ;
+  buckets = xmalloc(numBuckets * sizeof *buckets);
+  for (i = 0; i < numBuckets; i += 1)
+  {
+    buckets[i] = AR_NONE;
+  }
+  for (numExports = 0, k = 0; k < numFiles; k += 1)
+  {
+    for (i = 0; i < objs[k].num_insyms; i += 1)
+    {
+      struct export *e = &exports[numExports];
+      e->name = objs[k].insyms[i].name;
+      e->member = k;
+      e->bucket = arHash(e->name) & (numBuckets - 1);
+      for (j = buckets[e->bucket]; j != AR_NONE; j = exports[j].next)
+      {
+        if (!strcmp(exports[j].name, e->name))
+        {
+          fprintf(stderr, "xpar: %s is exported by both %s and %s\n",
+                  e->name, files[exports[j].member], files[k]);
+          errors += 1;
+          break;
+        }
+      }
+      e->next = buckets[e->bucket];
+      buckets[e->bucket] = numExports;
+      strtab_intern(e->name);
+      numExports += 1;
+    }
+  }
+  if (errors)
+  {
+    exit(1);
+  }
+  strings = strtab_data(&length);
+
+  // the members follow the tables, each on a word
+  offsets = xmalloc(numFiles * sizeof *offsets);
+  at = 20 + 12 * (unsigned long long) numFiles + 4 * numBuckets +
+       12 * (unsigned long long) numExports + ((length + 3) & ~3u);
+  for (k = 0; k < numFiles; k += 1)
+  {
+    offsets[k] = at;
+    at += (objs[k].size + 3) & ~(size_t) 3;
+  }
+  if (at > 0xFFFFFFFF)
+  {
+    fatal("%s would be larger than 4GB", path);
+  }
+
+  if ((outf = fopen(path, "wb")) == NULL)
+  {
+    fatal("can't open %s", path);
+  }
+  putWord(AR_MAGIC);
+  putWord(numFiles);
+  putWord(numBuckets);
+  putWord(numExports);
+  putWord(length);
+  for (k = 0; k < numFiles; k += 1)
+  {
+    putWord(memberNames[k]);
+    putWord(offsets[k]);
+    putWord(objs[k].size);
+  }
+  for (i = 0; i < numBuckets; i += 1)
+  {
+    putWord(buckets[i]);
+  }
+  for (i = 0; i < numExports; i += 1)
+  {
+    putWord(strtab_intern(exports[i].name));
+    putWord(exports[i].member);
+    putWord(exports[i].next);
+  }
+  putBytes(strings, length);
+  pad(length);
+  for (k = 0; k < numFiles; k += 1)
+  {
+    putBytes(objs[k].base, objs[k].size);
+    pad(objs[k].size);
+    objClose(&objs[k]);
+  }
+  if (fclose(outf))
+  {
+    remove(path);
+    fatal("write failed for %s", path);
+  }
+
+  free(offsets);
+  free(buckets);
+  free(exports);
+  free(memberNames);
+  free(objs);
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// list and extract
+
+static int list(ar_file *ar)
+{
+  unsigned int i, j;
+
+  for (i = 0; i < ar->num_members; i += 1)
+  {
+    printf("%s\n", arMemberName(ar, i));
+    for (j = 0; j < ar->num_symbols; j += 1)
+    {
+      const unsigned char *s = ar->symbols + 12 * j;
+      if (objWord(s + 4) == i)
+      {
+        printf("  %s\n", ar->strings + objWord(s));
+      }
+    }
+  }
+  return 0;
+}
+
+static int extract(ar_file *ar, char **names, int numNames)
+{
+  unsigned int i;
+  int k, status = 0;
+
+  for (i = 0; i < ar->num_members; i += 1)
+  {
+    const char *name = arMemberName(ar, i);
+    const unsigned char *m = ar->members + 12 * i;
+
+    for (k = 0; k < numNames && strcmp(names[k], name); k += 1)
+      ;
+    if (numNames && k == numNames)
+    {
+      continue;
+    }
+    // members are written to the current directory only
+    if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..") ||
+        !*name)
+    {
+      fprintf(stderr, "xpar: bad member name %s\n", name);
+      status = 1;
+      continue;
+    }
+    if ((outf = fopen(name, "wb")) == NULL)
+    {
+      fprintf(stderr, "xpar: can't open %s\n", name);
+      status = 1;
+      continue;
+    }
+    putBytes(ar->base + objWord(m + 4), objWord(m + 8));
+    if (fclose(outf))
+    {
+      fprintf(stderr, "xpar: write failed for %s\n", name);
+      status = 1;
+    }
+  }
+  return status;
+}
+
+//
+//      main
+//
+int main(int argc, char *argv[])
+{
+  ar_file ar;
+  int status;
+
+  if (argc < 3 || strlen(argv[1]) != 1)
+  {
+    usage();
+  }
+  switch (argv[1][0])
+  {
+    case 'c':
+      if (argc < 4)
+      {
+        usage();
+      }
+      return create(argv[2], argv + 3, argc - 3);
+    case 't':
+    case 'x':
+      if (arOpen(argv[2], &ar))
+      {
+        fprintf(stderr, "xpar: %s\n", arError());
+        return 1;
+      }
+      if (argv[1][0] == 't')
+      {
+        status = list(&ar);
+      }
+      else
+      {
+        status = extract(&ar, argv + 3, argc - 3);
+      }
+      arClose(&ar);
+      return status;
+    default:
+      usage();
+  }
+  return 1;
+}
@@ -0,0 +1,92 @@
+//
+// xpas.h - building xpvm object files without assembler source
+//
+// an in-process code generator can hand its functions to the assembler
+// statement by statement instead of writing source for xpas to scan and
+// parse again. each call makes the INSTR the parser would have made for
+// the same line and runs it through pass 1, so the program gets the
+// same checks and the object file is the one xpas writes for the
+// equivalent source. link with libxpas.a and -pthread.
+//
+// the assembler keeps its state in globals: a process builds one
+// program, with one context.
+//
+// opcodes are given by their OP_ id from isa.h (install it and isa.def
+// next to this header), the row of isa.def for the mnemonic and its
+// operands: OP_ADDL takes three registers, OP_ADDL_I two and a
+// constant. an id whose row has other operands than the call passes is
+// an error. labels and names are given as in source; the strings are
+// copied. registers are 0 to 255 (fp, sp and pc are 13, 14 and 15).
+// errors are reported on stderr as they are found, with the number of
+// the statement in the function as the line, and counted; once there
+// are any, xpas_end writes nothing.
+//
+// the calls for a function, in order:
+//
+//   xpas_func_begin(ctx, "f3");
+//   xpas_handler(ctx, "handle1", "start", "stop1");   (before statements)
+//   xpas_emit_rc(ctx, OP_LDIMM, 5, 0);
+//   xpas_label(ctx, "start");
+//   xpas_emit_rrr(ctx, OP_DIVL, 7, 6, 5);
+//   ...
+//   xpas_func_end(ctx);
+//
+
+#include <stdio.h>
+#include "isa.h"
+
+typedef struct xpas_ctx xpas_ctx;
+
+// start the program
+//   returns NULL if one was started already
+extern xpas_ctx *xpas_begin(void);
+
+// start and finish a function (a block)
+extern void xpas_func_begin(xpas_ctx *ctx, const char *name);
+extern void xpas_func_end(xpas_ctx *ctx);
+
+// an exception handler of the function: handle catches what is thrown
+//   from start up to end
+extern void xpas_handler(xpas_ctx *ctx, const char *handle,
+                         const char *start, const char *end);
+
+// define a label at the next statement
+extern void xpas_label(xpas_ctx *ctx, const char *name);
+
+// one statement per operand shape: r is a register, c a constant and
+// l a label (or block, native or symbol name)
+extern void xpas_emit(xpas_ctx *ctx, enum opcodeId op);
+extern void xpas_emit_l(xpas_ctx *ctx, enum opcodeId op, const char *l);
+extern void xpas_emit_r(xpas_ctx *ctx, enum opcodeId op, unsigned int r);
+extern void xpas_emit_rc(xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                         int c);
+extern void xpas_emit_rl(xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                         const char *l);
+extern void xpas_emit_rr(xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                         unsigned int r2);
+extern void xpas_emit_rrc(xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                          unsigned int r2, int c);
+extern void xpas_emit_rrl(xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                          unsigned int r2, const char *l);
+extern void xpas_emit_rrr(xpas_ctx *ctx, enum opcodeId op, unsigned int r1,
+                          unsigned int r2, unsigned int r3);
+extern void xpas_emit_c(xpas_ctx *ctx, enum opcodeId op, int c);
+
+// ldimm of a constant wider than 32 bits, or of a double
+//   (OP_LDIMM_WIDE)
+extern void xpas_emit_rlong(xpas_ctx *ctx, enum opcodeId op, unsigned int r,
+                            long long c);
+extern void xpas_emit_rdouble(xpas_ctx *ctx, enum opcodeId op,
+                              unsigned int r, double c);
+
+// a data directive with a list of values (OP_WORDS, OP_FILL)
+extern void xpas_emit_data(xpas_ctx *ctx, enum opcodeId op,
+                           const int *values, unsigned int n);
+
+// ldnative r, name
+extern void xpas_ldnative(xpas_ctx *ctx, unsigned int r, const char *name);
+
+// finish the program and write its object file to out
+//   returns the number of errors; out holds nothing useful unless it
+//   is 0. the context is gone either way
+extern int xpas_end(xpas_ctx *ctx, FILE *out);
@@ -0,0 +1,505 @@
+//
+// xpdis.c - disassembler for xpvm object files
+//
+//          Usage: xpdis [-q] file.obj ...
+//
+//          Output: listing of every block on stdout
+//                  (-q decodes and checks the files without a listing)
+//
+// decoding is table driven: the opcode table shared with the assembler
+// (opcodes.c) is inverted into a 256 entry table indexed by the opcode
+// byte, and the operands are then pulled out according to the same
+// instruction formats encode_stmt uses. output goes through a private
+// buffer with hand rolled number formatting, since stdio formatting
+// would dominate the run time on large objects.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "defs.h"
+#include "objread.h"
+
+// opcode byte -> table entry, for the instructions
+static struct opcodeInfo *decodeTable[256];
+
+// register names, built once
+static char regNames[256][5];
+static unsigned char regLengths[256];
+
+// don't produce a listing, only decode
+static int quiet = 0;
+
+// words that did not decode to an instruction
+static unsigned long undecodable = 0;
+
+//////////////////////////////////////////////////////////////////////////
+// output buffer
+
+static char outBuf[1 << 16];
+static size_t outLen = 0;
+
+static void flushOut(void)
+{
+  if (outLen && fwrite(outBuf, 1, outLen, stdout) != outLen)
+  {
+    fprintf(stderr, "xpdis: write error\n");
+    exit(1);
+  }
+  outLen = 0;
+}
+
+// make sure there is room for n more bytes
+static inline void reserveOut(size_t n)
+{
+  if (outLen + n > sizeof outBuf)
+  {
+    flushOut();
+  }
+}
+
+static inline void putStr(const char *s, size_t len)
+{
+  reserveOut(len);
+  memcpy(outBuf + outLen, s, len);
+  outLen += len;
+}
+
+// put a string literal
+#define putLit(s) putStr(s, sizeof(s) - 1)
+
+static inline void putChar(char c)
+{
+  reserveOut(1);
+  outBuf[outLen++] = c;
+}
+
+// put value in hex, zero padded to width digits
+static inline void putHex(unsigned int value, int width)
+{
+  static const char digits[] = "0123456789abcdef";
+  int i;
+
+  reserveOut(width);
+  for (i = width - 1; i >= 0; i -= 1)
+  {
+    outBuf[outLen + i] = digits[value & 0xF];
+    value >>= 4;
+  }
+  outLen += width;
+}
+
+static inline void putDec(int value)
+{
+  char tmp[12];
+  int i = sizeof tmp;
+  unsigned int u = value < 0 ? -(unsigned int) value : (unsigned int) value;
+
+  do
+  {
+    tmp[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u);
+  if (value < 0)
+  {
+    tmp[--i] = '-';
+  }
+  putStr(tmp + i, sizeof tmp - i);
+}
+
+static inline void putReg(unsigned int r)
+{
+  putStr(regNames[r], regLengths[r]);
+}
+
+static inline void putName(const char *s)
+{
+  putStr(s, strlen(s));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// decoding
+
+// initDecodeTable
+//
+// invert the opcode table (isa.def); a format 11 ldimm is encoded as
+// its constant pool load, so only its format 4 row decodes
+//
+static void initDecodeTable(void)
+{
+  int i;
+
+  for (i = 0; i < NUM_OPS; i += 1)
+  {
+    if (opcodes[i].encoding == 0xFF || opcodes[i].format == 11)
+    {
+      continue;
+    }
+    decodeTable[opcodes[i].encoding] = &opcodes[i];
+  }
+
+  for (i = 0; i < 256; i += 1)
+  {
+    if (i == 13)
+      strcpy(regNames[i], "fp");
+    else if (i == 14)
+      strcpy(regNames[i], "sp");
+    else if (i == 15)
+      strcpy(regNames[i], "pc");
+    else
+      sprintf(regNames[i], "r%d", i);
+    regLengths[i] = strlen(regNames[i]);
+  }
+}
+
+static inline int signExtend(unsigned int value, int bits)
+{
+  return (int) (value << (32 - bits)) >> (32 - bits);
+}
+
+// putTarget
+//
+// print a PC-relative target as the word address it refers to
+//
+static inline void putTarget(unsigned int pc, int offset)
+{
+  putChar('@');
+  putHex(pc + offset, 6);
+}
+
+// putAnnotations
+//
+// name the flags set in annotation word 0, in parentheses
+//
+static void putAnnotations(unsigned int flags)
+{
+  static const struct {
+    unsigned int flag;
+    char *name;
+  } names[] = {
+    {ANNOT_SORTED_HANDLERS, "sorted"},
+    {ANNOT_LEAF,            "leaf"},
+    {ANNOT_NO_THROW,        "nothrow"},
+    {ANNOT_NO_NATIVE,       "nonative"},
+    {ANNOT_LOW_REGS,        "lowregs"},
+    {0,                     NULL}
+  };
+  int i, any = 0;
+
+  for (i = 0; names[i].name; i += 1)
+  {
+    if (flags & names[i].flag)
+    {
+      putLit(" ");
+      if (!any)
+      {
+        putChar('(');
+      }
+      putName(names[i].name);
+      any = 1;
+    }
+  }
+  if (any)
+  {
+    putChar(')');
+  }
+}
+
+// decodeWord
+//
+// decode (and unless quiet, print) word i of a block
+//
+static void decodeWord(obj_file *obj, const obj_block *blk,
+                       const char **nameAt, unsigned int i)
+{
+  unsigned int word = objContentsWord(blk, i);
+  struct opcodeInfo *info = decodeTable[word >> 24];
+  unsigned int r1 = (word >> 16) & 0xFF;
+  unsigned int r2 = (word >> 8) & 0xFF;
+  unsigned int r3 = word & 0xFF;
+  unsigned int pc = i + 1;
+
+  if (!info)
+  {
+    undecodable += 1;
+  }
+  if (quiet)
+  {
+    return;
+  }
+
+  putHex(i, 6);
+  putLit("  ");
+  putHex(word, 8);
+  putLit("  ");
+
+  if (!info)
+  {
+    putLit("word    ");
+    putDec((int) word);
+    putChar('\n');
+    return;
+  }
+
+  putName(info->opcode);
+  putChar(' ');
+  switch (info->format)
+  {
+    case 1:
+      break;
+    case 2:
+      putTarget(pc, signExtend(word & 0xFFFFF, 20));
+      break;
+    case 3:
+      putReg(r1);
+      break;
+    case 4:
+      putReg(r1);
+      putLit(", ");
+      putDec(signExtend(word & 0xFFFF, 16));
+      break;
+    case 5:
+      putReg(r1);
+      putLit(", ");
+      if (info == &opcodes[OP_LDBLKID])
+      {
+        unsigned int id = word & 0xFFFF;
+        if (nameAt && nameAt[i])
+          putName(nameAt[i]);
+        else if (id < obj->num_blocks)
+          putName(obj->blocks[id].name);
+        else
+          putDec(id);
+      }
+      else if (info == &opcodes[OP_LDNATIVE])
+      {
+        if (nameAt && nameAt[i])
+          putName(nameAt[i]);
+        else
+          putChar('?');
+      }
+      else
+      {
+        putTarget(pc, signExtend(word & 0xFFFF, 16));
+      }
+      break;
+    case 6:
+      putReg(r1);
+      putLit(", ");
+      putReg(r2);
+      break;
+    case 7:
+      putReg(r1);
+      putLit(", ");
+      putReg(r2);
+      putLit(", ");
+      putDec(signExtend(r3, 8));
+      break;
+    case 8:
+      putReg(r1);
+      putLit(", ");
+      putReg(r2);
+      putLit(", ");
+      putTarget(pc, signExtend(r3, 8));
+      break;
+    case 10:
+      putReg(r1);
+      putLit(", ");
+      putReg(r2);
+      putLit(", ");
+      putReg(r3);
+      break;
+  }
+  putChar('\n');
+}
+
+// disassembleBlock
+//
+// decode the contents of one block and list its tables
+//
+static void disassembleBlock(obj_file *obj, unsigned int id)
+{
+  const obj_block *blk = &obj->blocks[id];
+  const char **nameAt = NULL;
+  obj_lines lines;
+  int haveLine;
+  unsigned int i;
+
+  // map native and outsymbol reference sites back to the word they name
+  if ((blk->num_native_refs || blk->num_outsyms) && !quiet)
+  {
+    nameAt = calloc(blk->num_words, sizeof *nameAt);
+    if (nameAt == NULL)
+    {
+      fprintf(stderr, "xpdis: out of memory\n");
+      exit(1);
+    }
+    for (i = 0; i < blk->num_native_refs; i += 1)
+    {
+      if (blk->native_refs[i].offset / 4 < blk->num_words)
+      {
+        nameAt[blk->native_refs[i].offset / 4] = blk->native_refs[i].name;
+      }
+    }
+    for (i = 0; i < blk->num_outsyms; i += 1)
+    {
+      if (blk->outsyms[i].offset / 4 < blk->num_words)
+      {
+        nameAt[blk->outsyms[i].offset / 4] = blk->outsyms[i].name;
+      }
+    }
+  }
+
+  if (!quiet)
+  {
+    putLit("\nblock ");
+    putDec(id);
+    putChar(' ');
+    putName(blk->name);
+    putLit("\n  annotations ");
+    putDec(blk->annotations[0]);
+    putChar(' ');
+    putDec(blk->annotations[1]);
+    putAnnotations(blk->annotations[0]);
+    putLit(", frame size ");
+    putDec(blk->frame_size);
+    putLit(", ");
+    putDec(blk->num_words);
+    putLit(" words\n");
+  }
+
+  // the source lines (xpas -g) head the words they start at
+  haveLine = !quiet && objLinesBegin(blk, &lines) && objLinesNext(&lines);
+  for (i = 0; i < blk->num_words; i += 1)
+  {
+    if (haveLine && lines.offset == i)
+    {
+      putLit("        # line ");
+      putDec(lines.line);
+      putChar('\n');
+      haveLine = objLinesNext(&lines);
+    }
+    decodeWord(obj, blk, nameAt, i);
+  }
+  free(nameAt);
+
+  if (quiet)
+  {
+    return;
+  }
+
+  for (i = 0; i < blk->num_handlers; i += 1)
+  {
+    const unsigned char *h = blk->handlers + 12 * i;
+    putLit("  handler [");
+    putHex(objWord(h) / 4, 6);
+    putLit(", ");
+    putHex(objWord(h + 4) / 4, 6);
+    putLit(") -> ");
+    putHex(objWord(h + 8) / 4, 6);
+    putChar('\n');
+  }
+  for (i = 0; i < blk->num_outsyms; i += 1)
+  {
+    putLit("  outsymbol ");
+    putName(blk->outsyms[i].name);
+    putLit(" @");
+    putHex(blk->outsyms[i].offset / 4, 6);
+    putChar('\n');
+  }
+  // one line per native, listing its sites
+  for (i = 0; i < blk->num_native_refs; i += 1)
+  {
+    if (i == 0 || blk->native_refs[i].name != blk->native_refs[i - 1].name)
+    {
+      if (i)
+      {
+        putChar('\n');
+      }
+      putLit("  native ");
+      putName(blk->native_refs[i].name);
+    }
+    putLit(" @");
+    putHex(blk->native_refs[i].offset / 4, 6);
+  }
+  if (blk->num_native_refs)
+  {
+    putChar('\n');
+  }
+  if (blk->aux_length)
+  {
+    putLit("  aux data ");
+    putDec(blk->aux_length);
+    putLit(" bytes\n");
+  }
+}
+
+//
+//      main
+//
+int main(int argc, char *argv[])
+{
+  obj_file obj;
+  unsigned int i;
+  int c;
+  int status = 0;
+
+  while ((c = getopt(argc, argv, "q")) != -1)
+  {
+    switch (c)
+    {
+      case 'q':
+        quiet = 1;
+        break;
+      default:
+        fprintf(stderr, "usage: xpdis [-q] file.obj ...\n");
+        exit(1);
+    }
+  }
+  if (optind == argc)
+  {
+    fprintf(stderr, "usage: xpdis [-q] file.obj ...\n");
+    exit(1);
+  }
+
+  initDecodeTable();
+
+  for (; optind < argc; optind += 1)
+  {
+    if (objOpen(argv[optind], &obj))
+    {
+      fprintf(stderr, "xpdis: %s\n", objError());
+      status = 1;
+      continue;
+    }
+    if (!quiet)
+    {
+      putName(argv[optind]);
+      putLit(": ");
+      putDec(obj.num_blocks);
+      putLit(" blocks\n");
+      for (i = 0; i < obj.num_insyms; i += 1)
+      {
+        putLit("insymbol ");
+        putName(obj.insyms[i].name);
+        putLit(" block ");
+        putDec(obj.insyms[i].offset);
+        putChar('\n');
+      }
+    }
+    for (i = 0; i < obj.num_blocks; i += 1)
+    {
+      disassembleBlock(&obj, i);
+    }
+    objClose(&obj);
+  }
+  flushOut();
+
+  if (quiet && undecodable)
+  {
+    fprintf(stderr, "xpdis: %lu word(s) did not decode to an instruction\n",
+            undecodable);
+  }
+  return status;
+}
@@ -0,0 +1,558 @@
+//
+// xpld.c - linker for xpvm object files
+//
+//          Usage: xpld [-o out.obj] file.obj|lib.xpa ...
+//
+//          Output: one object file (a.obj by default) holding the blocks
+//                  of every object file, in the order given, then of the
+//                  archive members they need
+//
+// the blocks of each input keep their order and are numbered after
+// those of the inputs before it. every ldblkid is listed as an outsymbol
+// reference by the assembler, so each is resolved by name and patched
+// with the new block id: a block of the same input first, then a block
+// exported by any input. the exports go into one hash table keyed by
+// name, the blocks of each input into the same table keyed by name and
+// input, so resolution is a single lookup either way.
+//
+// a reference nothing resolves is looked up in the export index of each
+// archive (see archive.h), in the order given, and the member exporting
+// it is added after the inputs so far. members only pulled in this way
+// are linked, so a large library costs one lookup per import.
+//
+// the output lists the same outsymbol references (with the new ids), so
+// it can be linked again, and the exports of all the inputs.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include "defs.h"
+#include "objread.h"
+#include "archive.h"
+
+#define OBJ_MAGIC 0x31303636
+
+// blocks are named by the const16 of ldblkid
+#define MAX_BLOCKS 0x10000
+
+// input number of an exported symbol
+#define EXPORTED (-1)
+
+typedef struct symbol {
+  const char    *name;
+  int           input;         // input that can see it, or EXPORTED
+  unsigned int  id;            // block id in the output
+  struct symbol *link;
+} symbol;
+
+static symbol **buckets;
+static unsigned int numBuckets;
+static unsigned int numSymbols;
+
+// the object files being linked, in output order
+static obj_file *inputs;
+static char **inputNames;            // path, or archive(member)
+static unsigned int *firstBlock;     // output id of each input's block 0
+static int numInputs;
+static int maxInputs;
+static unsigned int numBlocks;
+
+// archives members are pulled from, and the members already pulled
+static ar_file *archives;
+static char **archiveNames;
+static unsigned char **pulled;
+static int numArchives;
+
+static FILE *outf;
+static int errors = 0;
+
+// fatal
+//
+// out of memory and the like; strtab.c reports through this too
+//
+void fatal(char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  fprintf(stderr, "xpld: ");
+  vfprintf(stderr, fmt, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+static void *xmalloc(size_t n)
+{
+  void *p = malloc(n ? n : 1);
+  if (p == NULL)
+  {
+    fatal("out of memory");
+  }
+  return p;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// symbol table
+
+static unsigned int hashName(const char *s, int input)
+{
+  unsigned int h = 5381 + (unsigned int) input;
+  while (*s)
+  {
+    h = h * 33 + (unsigned char) *s++;
+  }
+  return h & (numBuckets - 1);
+}
+
+static symbol *lookup(const char *name, int input)
+{
+  symbol *sym;
+  if (numBuckets == 0)
+  {
+    return NULL;
+  }
+  for (sym = buckets[hashName(name, input)]; sym; sym = sym->link)
+  {
+    if (sym->input == input && !strcmp(sym->name, name))
+    {
+      return sym;
+    }
+  }
+  return NULL;
+}
+
+// rehash
+//
+// grow the table, keeping the load under one
+//
+static void rehash(void)
+{
+  symbol **old = buckets;
+  unsigned int oldSize = numBuckets, i;
+
+  numBuckets = numBuckets ? 2 * numBuckets : 256;
+  buckets = calloc(numBuckets, sizeof *buckets);
+  if (buckets == NULL)
+  {
+    fatal("out of memory");
+  }
+  for (i = 0; i < oldSize; i += 1)
+  {
+    while (old[i])
+    {
+      symbol *sym = old[i];
+      unsigned int h = hashName(sym->name, sym->input);
+      old[i] = sym->link;
+      sym->link = buckets[h];
+      buckets[h] = sym;
+    }
+  }
+  free(old);
+}
+
+// install
+//
+// enter (name, input); returns the symbol already there, if any
+//
+static symbol *install(const char *name, int input, unsigned int id)
+{
+  symbol *sym = lookup(name, input);
+  unsigned int h;
+
+  if (sym)
+  {
+    return sym;
+  }
+  if (numSymbols >= numBuckets)
+  {
+    rehash();
+  }
+  sym = xmalloc(sizeof *sym);
+  h = hashName(name, input);
+  sym->name = name;
+  sym->input = input;
+  sym->id = id;
+  sym->link = buckets[h];
+  buckets[h] = sym;
+  numSymbols += 1;
+  return NULL;
+}
+
+// resolve
+//
+// the output id of the block name refers to from input; -1 if none
+//
+static int resolve(const char *name, int input)
+{
+  symbol *sym = lookup(name, input);
+  if (sym == NULL)
+  {
+    sym = lookup(name, EXPORTED);
+  }
+  return sym ? (int) sym->id : -1;
+}
+
+// addInput
+//
+// number the blocks of obj after those already added, and enter them
+// and its exports into the table
+//
+static void addInput(obj_file *obj, char *name)
+{
+  unsigned int i;
+  int k = numInputs;
+
+  if (numInputs == maxInputs)
+  {
+    maxInputs = maxInputs ? 2 * maxInputs : 16;
+    inputs = realloc(inputs, maxInputs * sizeof *inputs);
+    inputNames = realloc(inputNames, maxInputs * sizeof *inputNames);
+    firstBlock = realloc(firstBlock, maxInputs * sizeof *firstBlock);
+    if (!inputs || !inputNames || !firstBlock)
+    {
+      fatal("out of memory");
+    }
+  }
+  numInputs += 1;
+  inputs[k] = *obj;
+  inputNames[k] = name;
+  firstBlock[k] = numBlocks;
+
+  for (i = 0; i < obj->num_blocks; i += 1)
+  {
+    install(obj->blocks[i].name, k, numBlocks + i);
+  }
+  numBlocks += obj->num_blocks;
+
+  for (i = 0; i < obj->num_insyms; i += 1)
+  {
+    const obj_ref *in = &obj->insyms[i];
+    symbol *prev = install(in->name, EXPORTED, firstBlock[k] + in->offset);
+    if (prev)
+    {
+      int j;
+      for (j = 0; prev->id >= firstBlock[j] + inputs[j].num_blocks; j += 1)
+        ;
+      fprintf(stderr, "xpld: %s is exported by both %s and %s\n",
+              in->name, inputNames[j], name);
+      errors += 1;
+    }
+  }
+}
+
+// pullMember
+//
+// add the first archive member that exports name, if there is one
+//   returns 1 if a member was added
+//
+static int pullMember(const char *name)
+{
+  obj_file obj;
+  char *memberName;
+  int a, m;
+
+  for (a = 0; a < numArchives; a += 1)
+  {
+    if ((m = arLookup(&archives[a], name)) < 0)
+    {
+      continue;
+    }
+    if (pulled[a][m])
+    {
+      // its blocks are in already, so the export is a duplicate
+      return 0;
+    }
+    pulled[a][m] = 1;
+    if (arOpenMember(&archives[a], m, &obj))
+    {
+      fprintf(stderr, "xpld: %s: %s\n", archiveNames[a], arError());
+      exit(1);
+    }
+    memberName = xmalloc(strlen(archiveNames[a]) +
+                         strlen(arMemberName(&archives[a], m)) + 3);
+    sprintf(memberName, "%s(%s)", archiveNames[a],
+            arMemberName(&archives[a], m));
+    addInput(&obj, memberName);
+    return 1;
+  }
+  return 0;
+}
+
+// resolveReferences
+//
+// pull in the archive members the inputs need, then report every
+// outsymbol reference that resolves to no block. members are added to
+// the end of the inputs, so their own references are seen in turn.
+//
+static void resolveReferences(void)
+{
+  unsigned int i, j;
+  int k;
+
+  for (k = 0; k < numInputs; k += 1)
+  {
+    for (i = 0; i < inputs[k].num_blocks; i += 1)
+    {
+      const obj_block *blk = &inputs[k].blocks[i];
+      for (j = 0; j < blk->num_outsyms; j += 1)
+      {
+        if (resolve(blk->outsyms[j].name, k) < 0 &&
+            !pullMember(blk->outsyms[j].name))
+        {
+          fprintf(stderr, "xpld: %s: block %s loads undefined block %s\n",
+                  inputNames[k], blk->name, blk->outsyms[j].name);
+          errors += 1;
+        }
+        else if (blk->outsyms[j].offset / 4 >= blk->num_words)
+        {
+          fprintf(stderr, "xpld: %s: block %s has a reference outside it\n",
+                  inputNames[k], blk->name);
+          errors += 1;
+        }
+      }
+    }
+  }
+}
+
+// isArchive
+//
+// does the file start with the archive magic number?
+//
+static int isArchive(const char *path)
+{
+  unsigned char magic[4];
+  FILE *f = fopen(path, "rb");
+  int ret;
+
+  if (f == NULL)
+  {
+    return 0;
+  }
+  ret = fread(magic, 1, 4, f) == 4 && objWord(magic) == AR_MAGIC;
+  fclose(f);
+  return ret;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// output
+
+static void putWord(unsigned int w)
+{
+  putc(w >> 24, outf);
+  putc(w >> 16, outf);
+  putc(w >> 8, outf);
+  putc(w, outf);
+}
+
+static void putBytes(const void *p, size_t n)
+{
+  if (n && fwrite(p, 1, n, outf) != n)
+  {
+    fatal("write failed");
+  }
+}
+
+// writeBlock
+//
+// copy block i of input k, patching its ldblkids with the new ids
+//
+static void writeBlock(int k, unsigned int i)
+{
+  const obj_block *blk = &inputs[k].blocks[i];
+  unsigned char *contents;
+  unsigned int j, n;
+
+  putWord(strtab_intern(blk->name));
+  putWord(blk->annotations[0]);
+  putWord(blk->annotations[1]);
+  putWord(blk->frame_size);
+  putWord(blk->num_words * 4);
+
+  contents = xmalloc(blk->num_words * 4);
+  memcpy(contents, blk->contents, blk->num_words * 4);
+  for (j = 0; j < blk->num_outsyms; j += 1)
+  {
+    unsigned char *at = contents + (blk->outsyms[j].offset & ~3u);
+    unsigned int id = resolve(blk->outsyms[j].name, k);
+    at[2] = id >> 8;
+    at[3] = id;
+  }
+  putBytes(contents, blk->num_words * 4);
+  free(contents);
+
+  putWord(blk->num_handlers);
+  putBytes(blk->handlers, blk->num_handlers * 12);
+
+  putWord(blk->num_outsyms);
+  for (j = 0; j < blk->num_outsyms; j += 1)
+  {
+    putWord(strtab_intern(blk->outsyms[j].name));
+    putWord(blk->outsyms[j].offset);
+  }
+
+  // the native references are grouped by name already
+  putWord(blk->num_natives);
+  for (j = 0; j < blk->num_native_refs; j += n)
+  {
+    for (n = 1; j + n < blk->num_native_refs &&
+                blk->native_refs[j + n].name == blk->native_refs[j].name;
+         n += 1)
+      ;
+    putWord(strtab_intern(blk->native_refs[j].name));
+    putWord(n);
+    for (n = 0; j + n < blk->num_native_refs &&
+                blk->native_refs[j + n].name == blk->native_refs[j].name;
+         n += 1)
+    {
+      putWord(blk->native_refs[j + n].offset);
+    }
+  }
+
+  putWord(blk->aux_length);
+  putBytes(blk->aux, blk->aux_length);
+}
+
+static void writeOutput(void)
+{
+  unsigned int numExports = 0, i, length;
+  const char *strings;
+  long offset;
+  int k;
+
+  for (k = 0; k < numInputs; k += 1)
+  {
+    numExports += inputs[k].num_insyms;
+  }
+
+  putWord(OBJ_MAGIC);
+  putWord(numBlocks);
+  // string table offset and length, filled in at the end
+  putWord(0);
+  putWord(0);
+
+  putWord(numExports);
+  for (k = 0; k < numInputs; k += 1)
+  {
+    for (i = 0; i < inputs[k].num_insyms; i += 1)
+    {
+      putWord(strtab_intern(inputs[k].insyms[i].name));
+      putWord(firstBlock[k] + inputs[k].insyms[i].offset);
+    }
+  }
+
+  for (k = 0; k < numInputs; k += 1)
+  {
+    for (i = 0; i < inputs[k].num_blocks; i += 1)
+    {
+      writeBlock(k, i);
+    }
+  }
+
+  offset = ftell(outf);
+  strings = strtab_data(&length);
+  putBytes(strings, length);
+  if (fseek(outf, 8, SEEK_SET))
+  {
+    fatal("can't seek back to the header");
+  }
+  putWord(offset);
+  putWord(length);
+}
+
+//
+//      main
+//
+int main(int argc, char *argv[])
+{
+  const char *outName = "a.obj";
+  obj_file obj;
+  int c, k;
+
+  while ((c = getopt(argc, argv, "o:")) != -1)
+  {
+    switch (c)
+    {
+      case 'o':
+        outName = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: xpld [-o out.obj] file.obj|lib.xpa ...\n");
+        exit(1);
+    }
+  }
+  if (optind == argc)
+  {
+    fprintf(stderr, "usage: xpld [-o out.obj] file.obj|lib.xpa ...\n");
+    exit(1);
+  }
+
+  // object files are linked whole, archives are searched afterwards
+  archives = xmalloc((argc - optind) * sizeof *archives);
+  archiveNames = xmalloc((argc - optind) * sizeof *archiveNames);
+  pulled = xmalloc((argc - optind) * sizeof *pulled);
+  for (k = optind; k < argc; k += 1)
+  {
+    if (isArchive(argv[k]))
+    {
+      if (arOpen(argv[k], &archives[numArchives]))
+      {
+        fprintf(stderr, "xpld: %s\n", arError());
+        exit(1);
+      }
+      archiveNames[numArchives] = argv[k];
+      pulled[numArchives] = calloc(archives[numArchives].num_members + 1, 1);
+      if (pulled[numArchives] == NULL)
+      {
+        fatal("out of memory");
+      }
+      numArchives += 1;
+    }
+    else
+    {
+      if (objOpen(argv[k], &obj))
+      {
+        fprintf(stderr, "xpld: %s\n", objError());
+        exit(1);
+      }
+      addInput(&obj, argv[k]);
+    }
+  }
+
+  resolveReferences();
+  if (numBlocks > MAX_BLOCKS)
+  {
+    fprintf(stderr, "xpld: %u blocks, more than ldblkid can name\n",
+            numBlocks);
+    errors += 1;
+  }
+  if (errors)
+  {
+    exit(1);
+  }
+
+  if ((outf = fopen(outName, "wb")) == NULL)
+  {
+    fprintf(stderr, "xpld: can't open %s\n", outName);
+    exit(1);
+  }
+  writeOutput();
+  if (fclose(outf))
+  {
+    fprintf(stderr, "xpld: write failed for %s\n", outName);
+    remove(outName);
+    exit(1);
+  }
+
+  for (k = 0; k < numInputs; k += 1)
+  {
+    objClose(&inputs[k]);
+  }
+  for (k = 0; k < numArchives; k += 1)
+  {
+    arClose(&archives[k]);
+  }
+  return 0;
+}